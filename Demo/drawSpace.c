@@ -247,6 +247,53 @@ drawPolyShape(cpBody *body, cpPolyShape *poly, cpSpace *space)
 	glDrawArrays(GL_LINE_LOOP, 0, count);
 }
 
+static void
+drawChainShape(cpBody *body, cpChainShape *chain, cpSpace *space)
+{
+	// Closed chains repeat their first vertex, so a strip draws them fully.
+#if CP_USE_DOUBLES
+	glVertexPointer(2, GL_DOUBLE, 0, chain->tVerts);
+#else
+	glVertexPointer(2, GL_FLOAT, 0, chain->tVerts);
+#endif
+	
+	glColor3f(LINE_COLOR);
+	glDrawArrays(GL_LINE_STRIP, 0, chain->numVerts);
+}
+
+static void
+drawTileMapShape(cpBody *body, cpTileMapShape *map, cpSpace *space)
+{
+	for(int y=0; y<map->height; y++){
+		for(int x=0; x<map->width; x++){
+			if(!cpTileMapShapeIsSolid(map, x, y)) continue;
+			
+			cpVect a = cpTileMapShapeWorldPoint(map, cpv(x    , y    ));
+			cpVect b = cpTileMapShapeWorldPoint(map, cpv(x + 1, y    ));
+			cpVect c = cpTileMapShapeWorldPoint(map, cpv(x + 1, y + 1));
+			cpVect d = cpTileMapShapeWorldPoint(map, cpv(x    , y + 1));
+			
+			if(!map->shape.sensor){
+				glColor_for_shape((cpShape *)map, space);
+				glBegin(GL_TRIANGLE_FAN); {
+					glVertex2f(a.x, a.y);
+					glVertex2f(b.x, b.y);
+					glVertex2f(c.x, c.y);
+					glVertex2f(d.x, d.y);
+				} glEnd();
+			}
+			
+			glColor3f(LINE_COLOR);
+			glBegin(GL_LINE_LOOP); {
+				glVertex2f(a.x, a.y);
+				glVertex2f(b.x, b.y);
+				glVertex2f(c.x, c.y);
+				glVertex2f(d.x, d.y);
+			} glEnd();
+		}
+	}
+}
+
 static void
 drawObject(cpShape *shape, cpSpace *space)
 {
@@ -262,6 +309,12 @@ drawObject(cpShape *shape, cpSpace *space)
 		case CP_POLY_SHAPE:
 			drawPolyShape(body, (cpPolyShape *)shape, space);
 			break;
+		case CP_CHAIN_SHAPE:
+			drawChainShape(body, (cpChainShape *)shape, space);
+			break;
+		case CP_TILE_MAP_SHAPE:
+			drawTileMapShape(body, (cpTileMapShape *)shape, space);
+			break;
 		default:
 			printf("Bad enumeration in drawObject().\n");
 	}
@@ -405,15 +458,24 @@ drawBB(cpShape *shape, void *unused)
 }
 
 // copied from cpSpaceHash.c
-static inline cpHashValue
-hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
+static inline int
+hash_func(int x, int y, int mask)
 {
-	return (x*1640531513ul ^ y*2654435789ul) % n;
+	cpHashValue h = ((cpHashValue)x*1640531513ul ^ (cpHashValue)y*2654435789ul);
+	h ^= h >> 15;
+	h *= 2246822519ul;
+	h ^= h >> 13;
+	
+	return (int)(h & mask);
 }
 
 static void
-drawSpatialHash(cpSpaceHash *hash)
+drawSpatialHash(cpSpatialIndex *index)
 {
+	// Only spatial hashes have cells to draw.
+	if(!cpSpatialIndexIsSpaceHash(index)) return;
+	cpSpaceHash *hash = (cpSpaceHash *)index;
+	
 	cpBB bb = cpBBNew(-320, -240, 320, 240);
 	
 	cpFloat dim = hash->celldim;
@@ -426,11 +488,8 @@ drawSpatialHash(cpSpaceHash *hash)
 	
 	for(int i=l; i<=r; i++){
 		for(int j=b; j<=t; j++){
-			int cell_count = 0;
-			
-			int index = hash_func(i,j,n);
-			for(cpSpaceHashBin *bin = hash->table[index]; bin; bin = bin->next)
-				cell_count++;
+			int index = hash_func(i,j,n - 1);
+			int cell_count = hash->cells[index].count;
 			
 			GLfloat v = 1.0f - (GLfloat)cell_count/10.0f;
 			glColor3f(v,v,v);
@@ -452,15 +511,15 @@ drawSpace(cpSpace *space, drawSpaceOptions *options)
 	
 	glLineWidth(options->lineThickness);
 	if(options->drawShapes){
-		cpSpaceHashEach(space->activeShapes, (cpSpaceHashIterator)drawObject, space);
-		cpSpaceHashEach(space->staticShapes, (cpSpaceHashIterator)drawObject, space);
+		cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)drawObject, space);
+		cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)drawObject, space);
 	}
 	
 	glLineWidth(1.0f);
 	if(options->drawBBs){
 		glColor3f(0.3f, 0.5f, 0.3f);
-		cpSpaceHashEach(space->activeShapes, (cpSpaceHashIterator)drawBB, NULL);
-		cpSpaceHashEach(space->staticShapes, (cpSpaceHashIterator)drawBB, NULL);
+		cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)drawBB, NULL);
+		cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)drawBB, NULL);
 	}
 
 	cpArray *constraints = space->constraints;
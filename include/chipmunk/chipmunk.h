@@ -83,11 +83,14 @@ void cpMessage(const char *message, const char *condition, const char *file, int
 #include "cpBB.h"
 #include "cpArray.h"
 #include "cpHashSet.h"
+#include "cpSpatialIndex.h"
 #include "cpSpaceHash.h"
 
 #include "cpBody.h"
 #include "cpShape.h"
 #include "cpPolyShape.h"
+#include "cpChainShape.h"
+#include "cpTileMapShape.h"
 
 #include "cpArbiter.h"
 #include "cpCollision.h"
@@ -26,6 +26,68 @@ void *cpSpaceGetPostStepData(cpSpace *space, void *obj);
 
 void cpSpaceActivateBody(cpSpace *space, cpBody *body);
 
+// Pair cache bookkeeping. These do nothing unless the pair cache is enabled.
+// Call when a shape is removed from the active or static shapes.
+void cpSpaceUncacheShape(cpSpace *space, cpShape *shape);
+// Call when a shape is added to the static shapes.
+void cpSpaceCacheStaticShape(cpSpace *space, cpShape *shape);
+
+// Call when a shape is added to the active shapes or its bbox changed outside of a step.
+// Collapses the fat bbox to a corner of the bbox. That can't contain the bbox, so the shape is treated as moved on the next step.
+static inline void
+cpShapeResetFatBB(cpShape *shape)
+{
+	cpBB bb = shape->bb;
+	shape->fatBB = cpBBNew(bb.l, bb.b, bb.l, bb.b);
+}
+
+// Returns the body's transform generation, changing it first if the body moved or rotated since the last call.
+// Comparing against the last seen values also catches positions that were written to the struct directly.
+static inline cpTimestamp
+cpBodyTransformGeneration(cpBody *body)
+{
+	cpVect p = body->p, rot = body->rot;
+	cpVect lastP = body->transformP, lastRot = body->transformRot;
+	
+	if(p.x != lastP.x || p.y != lastP.y || rot.x != lastRot.x || rot.y != lastRot.y){
+		body->transformP = p;
+		body->transformRot = rot;
+		
+		// Generation 0 is reserved for shapes that need to be recached.
+		body->transformGeneration++;
+		if(!body->transformGeneration) body->transformGeneration++;
+	}
+	
+	return body->transformGeneration;
+}
+
+// Segment query against the segment ta->tb with unit normal tn rounded by r. Defined in cpShape.c.
+void cpRoundedSegmentQuery(cpShape *shape, cpVect ta, cpVect tb, cpVect tn, cpFloat r, cpVect a, cpVect b, cpSegmentQueryInfo *info);
+
+// Closest point to p on the segment a->b.
+static inline cpVect
+cpClosestPointOnSegment(const cpVect p, const cpVect a, const cpVect b)
+{
+	cpVect delta = cpvsub(b, a);
+	cpFloat lengthsq = cpvlengthsq(delta);
+	cpFloat t = (lengthsq ? cpfclamp(cpvdot(delta, cpvsub(p, a))/lengthsq, 0.0f, 1.0f) : 0.0f);
+	return cpvadd(a, cpvmult(delta, t));
+}
+
+// Length of each of a poly's component arrays after padding.
+static inline int
+cpPolyShapeSoALength(const int numVerts)
+{
+	return (numVerts + CP_POLY_SOA_WIDTH - 1)/CP_POLY_SOA_WIDTH*CP_POLY_SOA_WIDTH;
+}
+
+// Call when all of the static shapes change.
+static inline void
+cpSpaceInvalidateStaticPairs(cpSpace *space)
+{
+	space->staticPairsStale = cpTrue;
+}
+
 static inline void
 cpSpaceLock(cpSpace *space)
 {
@@ -56,6 +56,15 @@ cpVect CP_PRIVATE(cpContactsSumImpulsesWithFriction)(cpContact *contacts, int nu
 
 #define CP_MAX_CONTACTS_PER_ARBITER 6
 
+// Separating axis found by the last narrowphase test of a pair of shapes.
+// The next test of the pair starts with it since it's the axis most likely to separate them again.
+typedef struct cpSeparatingAxis {
+	// Shape that owns the axis, or NULL when nothing has been cached.
+	const cpShape *shape;
+	// Index of the axis on that shape. For polys this is also the reference face.
+	int index;
+} cpSeparatingAxis;
+
 typedef enum cpArbiterState {
 	cpArbiterStateNormal,
 	cpArbiterStateFirstColl,
@@ -91,6 +100,9 @@ typedef struct cpArbiter {
 	// Are the shapes swapped in relation to the collision handler?
 	CP_PRIVATE(cpBool swappedColl);
 	CP_PRIVATE(cpArbiterState state);
+	
+	// Separating axis cached from the last narrowphase test.
+	CP_PRIVATE(cpSeparatingAxis axis);
 } cpArbiter;
 
 // Arbiters are allocated in large buffers by the space and don't require a destroy function
@@ -69,6 +69,59 @@ cpBBexpand(const cpBB bb, const cpVect v){
 	);
 }
 
+static inline cpFloat
+cpBBArea(cpBB bb)
+{
+	return (bb.r - bb.l)*(bb.t - bb.b);
+}
+
+// Area of the bbox that would result from merging a and b.
+static inline cpFloat
+cpBBMergedArea(cpBB a, cpBB b)
+{
+	return (cpfmax(a.r, b.r) - cpfmin(a.l, b.l))*(cpfmax(a.t, b.t) - cpfmin(a.b, b.b));
+}
+
+// Manhattan distance between the centers of two bboxes.
+// Used as a tiebreaker when building trees.
+static inline cpFloat
+cpBBProximity(cpBB a, cpBB b)
+{
+	return cpfabs(a.l + a.r - b.l - b.r) + cpfabs(a.b + a.t - b.b - b.t);
+}
+
+// Returns the fraction along the segment a->b where it first enters the bbox.
+// Returns INFINITY if the segment misses the bbox entirely.
+static inline cpFloat
+cpBBSegmentQuery(cpBB bb, cpVect a, cpVect b)
+{
+	cpFloat tmin = -INFINITY, tmax = INFINITY;
+	
+	if(a.x == b.x){
+		if(a.x < bb.l || bb.r < a.x) return INFINITY;
+	} else {
+		cpFloat t1 = (bb.l - a.x)/(b.x - a.x);
+		cpFloat t2 = (bb.r - a.x)/(b.x - a.x);
+		tmin = cpfmax(tmin, cpfmin(t1, t2));
+		tmax = cpfmin(tmax, cpfmax(t1, t2));
+	}
+	
+	if(a.y == b.y){
+		if(a.y < bb.b || bb.t < a.y) return INFINITY;
+	} else {
+		cpFloat t1 = (bb.b - a.y)/(b.y - a.y);
+		cpFloat t2 = (bb.t - a.y)/(b.y - a.y);
+		tmin = cpfmax(tmin, cpfmin(t1, t2));
+		tmax = cpfmin(tmax, cpfmax(t1, t2));
+	}
+	
+	if(tmin <= tmax && 0.0f <= tmax && tmin <= 1.0f){
+		return cpfmax(tmin, 0.0f);
+	} else {
+		return INFINITY;
+	}
+}
+
 cpVect cpBBClampVect(const cpBB bb, const cpVect v); // clamps the vector to lie within the bbox
 // TODO edge case issue
 cpVect cpBBWrapVect(const cpBB bb, const cpVect v); // wrap a vector to a bbox
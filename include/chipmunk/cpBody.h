@@ -96,6 +96,14 @@ typedef struct cpBody{
 	
 	// Used by cpSpaceStep() to store contact graph information.
 	CP_PRIVATE(cpComponentNode node);
+	
+	// Position and rotation last seen by cpBodyTransformGeneration() and a counter that changes along with them.
+	// Shapes remember the generation their data was cached at so unmoved bodies skip transforming them.
+	// cpBodyTransformGeneration() writes to these, so it and cpShapeCacheBB() must not be called
+	// from several threads at once for the same body.
+	CP_PRIVATE(cpVect transformP);
+	CP_PRIVATE(cpVect transformRot);
+	CP_PRIVATE(cpTimestamp transformGeneration);
 } cpBody;
 
 // Basic allocation/destruction functions
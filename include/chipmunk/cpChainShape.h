@@ -0,0 +1,101 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Number of segments under each leaf of a chain's bounding box tree.
+#define CP_CHAIN_LEAF_SIZE 4
+
+// Polyline shape for static terrain. A heightfield is just a chain with increasing x coordinates.
+// The whole chain is a single entry in the space's spatial index. Collisions and queries find the segments
+// they touch using a tree of bounding boxes over runs of neighboring segments.
+// Circles and polys collide with the chain. Contacts at the joint between two segments are only kept on
+// the convex side of the joint so that shapes don't snag on the seams while sliding along the chain.
+typedef struct cpChainShape{
+	cpShape shape;
+	
+	// Vertexes and segment normals. (body space coordinates)
+	// Segment i goes from verts[i] to verts[i+1]. The chain is a closed loop if the first and last vertexes are the same.
+	CP_PRIVATE(int numVerts);
+	CP_PRIVATE(cpVect *verts);
+	CP_PRIVATE(cpVect *normals);
+	CP_PRIVATE(cpBool loop);
+	
+	// Radius of the segments. (Thickness)
+	CP_PRIVATE(cpFloat r);
+	
+	// Transformed vertexes and segment normals. (world space coordinates)
+	CP_PRIVATE(cpVect *tVerts);
+	CP_PRIVATE(cpVect *tNormals);
+	
+	// Implicit bounding box tree over the transformed segments.
+	// nodes[1] is the root, the children of node i are 2*i and 2*i + 1,
+	// and leaf j is node numLeaves + j. numLeaves is a power of two.
+	CP_PRIVATE(int numLeaves);
+	CP_PRIVATE(cpBB *nodes);
+} cpChainShape;
+
+// Basic allocation functions.
+cpChainShape *cpChainShapeAlloc(void);
+cpChainShape *cpChainShapeInit(cpChainShape *chain, cpBody *body, int numVerts, cpVect *verts, cpFloat radius);
+cpShape *cpChainShapeNew(cpBody *body, int numVerts, cpVect *verts, cpFloat radius);
+
+int cpChainShapeGetNumVerts(cpShape *shape);
+cpVect cpChainShapeGetVert(cpShape *shape, int idx);
+cpFloat cpChainShapeGetRadius(cpShape *shape);
+
+// Chain segment iterator callback.
+typedef void (*cpChainShapeSegmentFunc)(cpChainShape *chain, int index, void *data);
+// Calls func for each segment of the chain whose bbox intersects bb, in order.
+void cpChainShapeQuery(cpChainShape *chain, cpBB bb, cpChainShapeSegmentFunc func, void *data);
+
+// *** inlined utility functions
+
+static inline int
+cpChainShapeGetNumSegments(const cpChainShape *chain)
+{
+	return chain->CP_PRIVATE(numVerts) - 1;
+}
+
+// Index of the segment before segment i, or -1 if it's the first segment of an open chain.
+static inline int
+cpChainShapePrevSegment(const cpChainShape *chain, const int i)
+{
+	int count = cpChainShapeGetNumSegments(chain);
+	return (i > 0 ? i - 1 : (chain->CP_PRIVATE(loop) ? count - 1 : -1));
+}
+
+// Index of the segment after segment i, or -1 if it's the last segment of an open chain.
+static inline int
+cpChainShapeNextSegment(const cpChainShape *chain, const int i)
+{
+	int count = cpChainShapeGetNumSegments(chain);
+	return (i < count - 1 ? i + 1 : (chain->CP_PRIVATE(loop) ? 0 : -1));
+}
+
+// Bounding box of segment i of the chain.
+static inline cpBB
+cpChainShapeSegmentBB(const cpChainShape *chain, const int i)
+{
+	cpVect a = chain->CP_PRIVATE(tVerts)[i];
+	cpVect b = chain->CP_PRIVATE(tVerts)[i + 1];
+	cpFloat r = chain->CP_PRIVATE(r);
+	
+	return cpBBNew(cpfmin(a.x, b.x) - r, cpfmin(a.y, b.y) - r, cpfmax(a.x, b.x) + r, cpfmax(a.y, b.y) + r);
+}
@@ -21,8 +21,32 @@
 
 //TODO delete this header?
 
+// When enabled, poly-poly and segment-poly collisions clip the incident edge against the reference face.
+// This produces at most two contacts per pair instead of one for every penetrating vertex. Disabled by default.
+extern cpBool cp_poly_contact_clipping;
+
+// Poly pairs whose vertex counts multiply to at least this much are collided using GJK and EPA instead of SAT.
+// SAT's cost grows with the product while GJK's only grows with the log of each count.
+// Their contacts are always clipped. Defaults to 1024, a pair of 32-gons.
+extern int cp_poly_gjk_threshold;
+
 // Collides two cpShape structures.
 // Returns the number of contact points added to arr
 // which should be at least CP_MAX_CONTACTS_PER_ARBITER in length.
 // This function is very lonely in this header :(
 int cpCollideShapes(const cpShape *a, const cpShape *b, cpContact *arr);
+
+// Same as cpCollideShapes(), but poly collisions start with the axis cached in 'axis'
+// and store the separating or minimum penetration axis they end up with back into it.
+int cpCollideShapesWithAxis(const cpShape *a, const cpShape *b, cpContact *arr, cpSeparatingAxis *axis);
+
+// Collides count pairs of shapes that all have the same pair of shape types, sorted as for cpCollideShapes().
+// The contacts for pair i are written to arr + i*CP_MAX_CONTACTS_PER_ARBITER and their number to numContacts[i].
+// axes holds the cached separating axis of each pair and is updated like cpCollideShapesWithAxis() does.
+void cpCollideShapesBatch(const cpShape **a, const cpShape **b, cpSeparatingAxis *axes, int count, cpContact *arr, int *numContacts);
+
+// Sweeps shape 'a' along the displacement d and finds when it first touches shape 'b'.
+// Returns the fraction of d traveled, or t_max if they don't touch before then.
+// n is set to the surface normal of 'b' at the point of impact.
+// Shapes that are already overlapping aren't detected. Check with cpCollideShapes() first.
+cpFloat cpCastShapes(const cpShape *a, const cpShape *b, cpVect d, cpFloat t_max, cpVect *n);
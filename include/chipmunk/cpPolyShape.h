@@ -27,6 +27,9 @@ typedef struct cpPolyShapeAxis{
 	cpFloat d;
 } cpPolyShapeAxis;
 
+// Block width of the component arrays used by the poly collision kernels.
+#define CP_POLY_SOA_WIDTH 4
+
 // Convex polygon shape structure.
 typedef struct cpPolyShape{
 	cpShape shape;
@@ -39,6 +42,15 @@ typedef struct cpPolyShape{
 	// Transformed vertex and axis lists.
 	CP_PRIVATE(cpVect *tVerts);
 	CP_PRIVATE(cpPolyShapeAxis *tAxes);
+	
+	// Transformed vertex and axis lists split into component arrays for the collision kernels.
+	// The arrays share one allocation and are padded to a multiple of CP_POLY_SOA_WIDTH
+	// by repeating the first vertex and axis, which doesn't change any min or max taken over them.
+	CP_PRIVATE(cpFloat *tVertsX);
+	CP_PRIVATE(cpFloat *tVertsY);
+	CP_PRIVATE(cpFloat *tAxesX);
+	CP_PRIVATE(cpFloat *tAxesY);
+	CP_PRIVATE(cpFloat *tAxesD);
 } cpPolyShape;
 
 // Basic allocation functions.
@@ -61,12 +73,13 @@ cpVect cpPolyShapeGetVert(cpShape *shape, int idx);
 static inline cpFloat
 cpPolyShapeValueOnAxis(const cpPolyShape *poly, const cpVect n, const cpFloat d)
 {
-	cpVect *verts = poly->CP_PRIVATE(tVerts);
-	cpFloat min = cpvdot(n, verts[0]);
+	const cpFloat *x = poly->CP_PRIVATE(tVertsX);
+	const cpFloat *y = poly->CP_PRIVATE(tVertsY);
+	cpFloat min = n.x*x[0] + n.y*y[0];
 	
 	int i;
 	for(i=1; i<poly->CP_PRIVATE(numVerts); i++)
-		min = cpfmin(min, cpvdot(n, verts[i]));
+		min = cpfmin(min, n.x*x[i] + n.y*y[i]);
 	
 	return min - d;
 }
@@ -29,11 +29,19 @@ typedef struct cpSegmentQueryInfo {
 	cpVect n; // normal of hit surface
 } cpSegmentQueryInfo;
 
+typedef struct cpNearestPointQueryInfo {
+	struct cpShape *shape; // shape that was found, NULL if none
+	cpVect p; // closest point on the shape's surface
+	cpFloat d; // distance to the query point, negative if the point is inside the shape
+} cpNearestPointQueryInfo;
+
 // Enumeration of shape types.
 typedef enum cpShapeType{
 	CP_CIRCLE_SHAPE,
 	CP_SEGMENT_SHAPE,
 	CP_POLY_SHAPE,
+	CP_CHAIN_SHAPE,
+	CP_TILE_MAP_SHAPE,
 	CP_NUM_SHAPES
 } cpShapeType;
 
@@ -51,6 +59,9 @@ typedef struct cpShapeClass {
 	
 	// called by cpShapeSegmentQuery()
 	 void (*segmentQuery)(struct cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info);
+	
+	// called by cpShapeNearestPointQuery()
+	void (*nearestPointQuery)(struct cpShape *shape, cpVect p, cpNearestPointQueryInfo *info);
 } cpShapeClass;
 
 // Basic shape struct that the others inherit from.
@@ -95,6 +106,14 @@ typedef struct cpShape{
 	
 	// Unique id used as the hash value.
 	CP_PRIVATE(cpHashValue hashid);
+	
+	// Enlarged bbox used by the space's pair cache.
+	CP_PRIVATE(cpBB fatBB);
+	
+	// Transform generation of the body when the shape's data was last cached, or 0 if it needs to be recached.
+	// Generations are only unique per body, so the body they came from is stored too.
+	CP_PRIVATE(cpTimestamp transformGeneration);
+	CP_PRIVATE(cpBody *transformBody);
 } cpShape;
 
 // Low level shape initialization func.
@@ -110,6 +129,9 @@ cpBB cpShapeCacheBB(cpShape *shape);
 // Test if a point lies within a shape.
 cpBool cpShapePointQuery(cpShape *shape, cpVect p);
 
+// Find the closest point on the surface of a shape. Returns the distance, negative if p is inside.
+cpFloat cpShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *out);
+
 #define CP_DeclareShapeGetter(struct, type, name) type struct##Get##name(cpShape *shape)
 
 // Circle shape structure.
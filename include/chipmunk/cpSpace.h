@@ -81,9 +81,9 @@ typedef struct cpSpace{
 	// Time stamp. Is incremented on every call to cpSpaceStep().
 	CP_PRIVATE(cpTimestamp stamp);
 
-	// The static and active shape spatial hashes.
-	CP_PRIVATE(cpSpaceHash *staticShapes);
-	CP_PRIVATE(cpSpaceHash *activeShapes);
+	// The static and active shape spatial indexes.
+	CP_PRIVATE(cpSpatialIndex *staticShapes);
+	CP_PRIVATE(cpSpatialIndex *activeShapes);
 	
 	// List of bodies in the system.
 	CP_PRIVATE(cpArray *bodies);
@@ -120,6 +120,31 @@ typedef struct cpSpace{
 	
 	CP_PRIVATE(cpHashSet *postStepCallbacks);
 	
+	// Broadphase pair cache. NULL unless enabled with cpSpaceEnablePairCache().
+	CP_PRIVATE(cpHashSet *pairCache);
+	// The cached pairs in the order they were found. Iterated every step instead of the pairCache.
+	CP_PRIVATE(cpArray *cachedPairs);
+	CP_PRIVATE(cpArray *pooledPairs);
+	CP_PRIVATE(cpFloat pairCacheMargin);
+	// Active shapes that moved outside of their fat bboxes during the current step.
+	CP_PRIVATE(cpArray *movedShapes);
+	// Shapes removed from the active shapes since the last step. Their pairs are thrown away.
+	CP_PRIVATE(cpHashSet *removedShapes);
+	// Shapes added to the static shapes since the last step. Their pairs with the active shapes are found on the next step.
+	CP_PRIVATE(cpHashSet *newStaticShapes);
+	// Set when all of the static shapes changed. All of the static pairs are found again on the next step.
+	CP_PRIVATE(cpBool staticPairsStale);
+	
+	// Number of threads used to find the broadphase pairs and the worker threads themselves.
+	CP_PRIVATE(int threads);
+	CP_PRIVATE(struct cpBroadphaseThreads *broadphaseThreads);
+	
+	// Set between cpSpaceBeginConcurrentQueries() and cpSpaceEndConcurrentQueries().
+	CP_PRIVATE(cpBool concurrentQueries);
+	
+	// Pairs waiting for the narrowphase. NULL unless enabled with cpSpaceSetBatchedNarrowphase().
+	CP_PRIVATE(struct cpNarrowphaseBatch *narrowphaseBatch);
+	
 	cpBody staticBody;
 } cpSpace;
 
@@ -157,6 +182,9 @@ void cpSpaceRemoveCollisionHandler(cpSpace *space, cpCollisionType a, cpCollisio
 // Add and remove entities from the system.
 cpShape *cpSpaceAddShape(cpSpace *space, cpShape *shape);
 cpShape *cpSpaceAddStaticShape(cpSpace *space, cpShape *shape);
+// Add many static shapes at once, such as when loading a level.
+// Unlike cpSpaceAddStaticShape(), bodies touching the new shapes are not woken up.
+void cpSpaceAddStaticShapes(cpSpace *space, cpShape **shapes, int count);
 cpBody *cpSpaceAddBody(cpSpace *space, cpBody *body);
 cpConstraint *cpSpaceAddConstraint(cpSpace *space, cpConstraint *constraint);
 
@@ -175,19 +203,74 @@ void cpSpaceAddPostStepCallback(cpSpace *space, cpPostStepFunc func, void *obj,
 typedef void (*cpSpacePointQueryFunc)(cpShape *shape, void *data);
 void cpSpacePointQuery(cpSpace *space, cpVect point, cpLayers layers, cpGroup group, cpSpacePointQueryFunc func, void *data);
 cpShape *cpSpacePointQueryFirst(cpSpace *space, cpVect point, cpLayers layers, cpGroup group);
+// Same as cpSpacePointQuery() but writes the shapes into out instead of calling a callback.
+// Returns the total number of hits. Hits past capacity are not written.
+int cpSpacePointQueryInto(cpSpace *space, cpVect point, cpLayers layers, cpGroup group, cpShape **out, int capacity);
+// Point query many points at once. Nearby points are grouped so the spatial index is only walked once per group.
+// Each hit is written as a shape in outShapes and the index of the point it contains in outPoints, in no particular order.
+// Returns the total number of hits. Hits past capacity are not written.
+int cpSpacePointQueryBatch(cpSpace *space, const cpVect *points, int count, cpLayers layers, cpGroup group, cpShape **outShapes, int *outPoints, int capacity);
+// Same as calling cpSpacePointQueryFirst() for each point. out[i] is set to a shape containing points[i] or NULL.
+void cpSpacePointQueryFirstBatch(cpSpace *space, const cpVect *points, int count, cpLayers layers, cpGroup group, cpShape **out);
+
+// Find the closest shape to a point within maxDistance. Sensor shapes are ignored.
+// The distance is measured to the shape's surface and is negative if the point is inside the shape.
+// Returns the shape, or NULL if nothing was within range.
+cpShape *cpSpaceNearestPointQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpLayers layers, cpGroup group, cpNearestPointQueryInfo *out);
+// Find the k closest shapes to a point within maxDistance, sorted by distance.
+// Returns the number of shapes written to out.
+int cpSpaceNearestPointQueryK(cpSpace *space, cpVect point, cpFloat maxDistance, cpLayers layers, cpGroup group, cpNearestPointQueryInfo *out, int k);
 
 // Segment query callback function
 typedef void (*cpSpaceSegmentQueryFunc)(cpShape *shape, cpFloat t, cpVect n, void *data);
 void cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpLayers layers, cpGroup group, cpSpaceSegmentQueryFunc func, void *data);
 cpShape *cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpLayers layers, cpGroup group, cpSegmentQueryInfo *out);
+// Same as cpSpaceSegmentQuery() but writes the hits into out in no particular order.
+// Returns the total number of hits. Hits past capacity are not written.
+int cpSpaceSegmentQueryInto(cpSpace *space, cpVect start, cpVect end, cpLayers layers, cpGroup group, cpSegmentQueryInfo *out, int capacity);
+// Perform cpSpaceSegmentQueryFirst() for many segments at once. out[i] receives the first hit along starts[i]->ends[i].
+// Nearby segments pointing the same way are bundled so the spatial index is only queried once per bundle.
+// Returns the number of segments that hit something.
+int cpSpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, int count, cpLayers layers, cpGroup group, cpSegmentQueryInfo *out);
 
 // BB query callback function
 typedef void (*cpSpaceBBQueryFunc)(cpShape *shape, void *data);
 void cpSpaceBBQuery(cpSpace *space, cpBB bb, cpLayers layers, cpGroup group, cpSpaceBBQueryFunc func, void *data);
+// Same as cpSpaceBBQuery() but writes the shapes into out. Returns the total number of hits.
+int cpSpaceBBQueryInto(cpSpace *space, cpBB bb, cpLayers layers, cpGroup group, cpShape **out, int capacity);
 
 // Shape query callback function
 typedef void (*cpSpaceShapeQueryFunc)(cpShape *shape, cpContactPointSet *points, void *data);
 cpBool cpSpaceShapeQuery(cpSpace *space, cpShape *shape, cpSpaceShapeQueryFunc func, void *data);
+// Same as cpSpaceShapeQuery() but writes the shapes into out, and their contacts into outSets if it's not NULL.
+// Returns the total number of overlapping shapes. Hits past capacity are not written.
+int cpSpaceShapeQueryInto(cpSpace *space, cpShape *shape, cpShape **out, cpContactPointSet *outSets, int capacity);
+
+// Sweep a shape through the space as if its body moved from start to end without rotating.
+// Returns the first shape hit, or NULL. out->t is the fraction of the way to end where they touch,
+// and out->n is the surface normal of the shape that was hit. Other shapes on the same body are ignored.
+cpShape *cpSpaceShapeCast(cpSpace *space, cpShape *shape, cpVect start, cpVect end, cpSegmentQueryInfo *out);
+
+// Allow the space to be queried from several threads at once.
+// Between these calls the queries only read from the space, and the space is locked so that
+// it can't be stepped or modified. The query callbacks must not modify the space either.
+// Threads must not share a shape passed to cpSpaceShapeQuery() or cpSpaceShapeCast().
+void cpSpaceBeginConcurrentQueries(cpSpace *space);
+void cpSpaceEndConcurrentQueries(cpSpace *space);
+
+// An immutable copy of the shapes in a space that can be queried while the space is being stepped.
+// Take one at the end of a step and hand it off to other threads. Pass the space returned by
+// cpSpaceQuerySnapshotGetSpace() to any of the query functions. They can be called from several threads at once.
+// The shapes returned by the queries are copies, but their body and data pointers are the same as the originals.
+typedef struct cpSpaceQuerySnapshot cpSpaceQuerySnapshot;
+
+cpSpaceQuerySnapshot *cpSpaceQuerySnapshotNew(cpSpace *space);
+void cpSpaceQuerySnapshotFree(cpSpaceQuerySnapshot *snapshot);
+
+// Take a new snapshot of the space, reusing the memory of an old one. Nothing can be querying the snapshot.
+void cpSpaceQuerySnapshotUpdate(cpSpaceQuerySnapshot *snapshot, cpSpace *space);
+// The space to pass to the query functions. It can't be stepped or modified.
+cpSpace *cpSpaceQuerySnapshotGetSpace(cpSpaceQuerySnapshot *snapshot);
 
 
 void cpSpaceActivateShapesTouchingShape(cpSpace *space, cpShape *shape);
@@ -197,9 +280,43 @@ void cpSpaceActivateShapesTouchingShape(cpSpace *space, cpShape *shape);
 typedef void (*cpSpaceBodyIterator)(cpBody *body, void *data);
 void cpSpaceEachBody(cpSpace *space, cpSpaceBodyIterator func, void *data);
 
-// Spatial hash management functions.
+// Spatial index management functions.
+// Replace the index used for the static or active shapes. Any shapes in the old index are moved over
+// and the old index is freed. The space takes ownership of the new index and sets its bbfunc.
+// ex: cpSpaceSetActiveIndex(space, cpBBTreeNew(NULL));
+void cpSpaceSetStaticIndex(cpSpace *space, cpSpatialIndex *index);
+void cpSpaceSetActiveIndex(cpSpace *space, cpSpatialIndex *index);
+
+// Resizing is only valid when the index is a spatial hash. (the default)
 void cpSpaceResizeStaticHash(cpSpace *space, cpFloat dim, int count);
 void cpSpaceResizeActiveHash(cpSpace *space, cpFloat dim, int count);
+// Let the active hash pick its own cell size and table size as the shapes in the space change.
+void cpSpaceSetActiveHashAutoTune(cpSpace *space, cpBool autoTune);
+
+// Keep the broadphase pairs between steps instead of finding them all again every step.
+// The bboxes of active shapes are enlarged by margin plus a few steps worth of their velocity.
+// A shape's pairs are only looked for again once its bbox moves outside of the enlarged one,
+// which makes resting and slow moving shapes almost free in the broadphase.
+// Disabled by default.
+void cpSpaceEnablePairCache(cpSpace *space, cpFloat margin);
+void cpSpaceDisablePairCache(cpSpace *space);
+
+// Number of threads used to find the broadphase pairs. Defaults to 1.
+// The active shapes are split between the threads, each of which collects the pairs for its shapes.
+// The pairs are then passed on to the collision handlers on the calling thread.
+// The pairs are the same as with a single thread. They are also passed on in the same order for any
+// number of threads above one, so a threaded simulation is deterministic whatever the thread count.
+// Each thread does a little more work than the single threaded broadphase, so use at least 3 threads.
+// Threads are not used when the pair cache is enabled, or on platforms without pthreads.
+void cpSpaceSetThreads(cpSpace *space, int threads);
+
+// Collect all of the broadphase pairs before running the narrowphase on them.
+// The pairs are grouped by their shape types so that each group runs through one collision function,
+// and pairs of circles are tested several at a time. The collision handlers are still called in
+// the same order as when the pairs are collided as they are found, so the simulation doesn't change.
+// Disabled by default.
+void cpSpaceSetBatchedNarrowphase(cpSpace *space, cpBool enabled);
+
 void cpSpaceRehashStatic(cpSpace *space);
 
 void cpSpaceRehashShape(cpSpace *space, cpShape *shape);
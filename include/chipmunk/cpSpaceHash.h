@@ -19,50 +19,92 @@
  * SOFTWARE.
  */
 
-// The spatial hash is Chipmunk's default (and currently only) spatial index type.
-// Based on a chained hash table.
+// The spatial hash is Chipmunk's default spatial index type.
+// Based on a hash table of cells stored in a single flat array.
+
+// Range of cells covered by a bbox. Inclusive.
+typedef struct cpSpaceHashRect{
+	int l, b, r, t;
+} cpSpaceHashRect;
 
 // Used internally to track objects added to the hash
 typedef struct cpHandle{
 	// Pointer to the object
 	void *obj;
-	// Retain count
-	int retain;
-	// Query stamp. Used to make sure two objects
-	// aren't identified twice in the same query.
-	cpTimestamp stamp;
+	// BBox the object was last hashed with and the cells it covers.
+	cpBB bb;
+	cpSpaceHashRect rect;
 } cpHandle;
 
-// Linked list element for in the chains.
-typedef struct cpSpaceHashBin{
+// The cells are stored as spans of one flat array of entries.
+// The object and its bbox are copied inline so that testing the
+// pairs in a cell doesn't need to chase pointers.
+typedef struct cpSpaceHashEntry{
+	void *obj;
+	cpBB bb;
 	cpHandle *handle;
-	struct cpSpaceHashBin *next;
-} cpSpaceHashBin;
+} cpSpaceHashEntry;
+
+// The entries of a cell are entries[start] to entries[start + count - 1].
+// Cells have some spare room so that objects can move between cells without rebuilding.
+typedef struct cpSpaceHashCell{
+	int start, count, capacity;
+} cpSpaceHashCell;
 
 // BBox callback. Called whenever the hash needs a bounding box from an object.
-typedef cpBB (*cpSpaceHashBBFunc)(void *obj);
+typedef cpSpatialIndexBBFunc cpSpaceHashBBFunc;
 
 typedef struct cpSpaceHash{
-	// Number of cells in the table.
+	// Spatial index "superclass". Must be the first member.
+	CP_PRIVATE(cpSpatialIndex spatialIndex);
+	
+	// Number of cells in the table. Always a power of two.
 	CP_PRIVATE(int numcells);
 	// Dimentions of the cells.
 	CP_PRIVATE(cpFloat celldim);
 	
-	// BBox callback.
-	CP_PRIVATE(cpSpaceHashBBFunc bbfunc);
-
 	// Hashset of the handles and the recycled ones.
 	CP_PRIVATE(cpHashSet *handleSet);
 	CP_PRIVATE(cpArray *pooledHandles);
+	// Handles added since the cells were last updated.
+	CP_PRIVATE(cpArray *pendingHandles);
+	// Handles whose bbox changed during the current update.
+	CP_PRIVATE(cpArray *dirtyHandles);
+	
+	// The cells and the flat array their entries are stored in.
+	// Built with a counting sort, then updated only for the objects that change cells.
+	CP_PRIVATE(cpSpaceHashCell *cells);
+	CP_PRIVATE(cpSpaceHashEntry *entries);
+	// Number of entries in the cells, used by the cells including spare room, and allocated.
+	CP_PRIVATE(int numEntries);
+	CP_PRIVATE(int usedEntries);
+	CP_PRIVATE(int maxEntries);
+	// Entries left behind when a full cell is moved to the end of the array.
+	CP_PRIVATE(int wastedEntries);
+	// Number of cells with at least one entry.
+	CP_PRIVATE(int numOccupied);
+	// Indexes of the cells that own a span of the entry array. All other cells are empty.
+	// Only these cells are cleared when rebuilding or visited when finding pairs,
+	// so a large, mostly empty table doesn't cost anything extra per step.
+	CP_PRIVATE(int *touchedCells);
+	CP_PRIVATE(int numTouched);
+	// Used to avoid adding a handle to a cell twice when its cells collide.
+	CP_PRIVATE(cpTimestamp *cellStamps);
+	// True if the cells must be rebuilt before they can be used.
+	CP_PRIVATE(cpBool stale);
 	
-	// The table and the recycled bins.
-	CP_PRIVATE(cpSpaceHashBin **table);
-	CP_PRIVATE(cpSpaceHashBin *pooledBins);
+	// Stats gathered over several updates for cpSpaceHashSetAutoTune().
+	CP_PRIVATE(cpBool autoTune);
+	CP_PRIVATE(int tuneUpdates);
+	CP_PRIVATE(int tuneHandles);
+	CP_PRIVATE(int tuneEntries);
+	CP_PRIVATE(int tuneOccupied);
+	CP_PRIVATE(cpFloat tuneExtent);
 	
 	// list of buffers to free on destruction.
 	CP_PRIVATE(cpArray *allocatedBuffers);
 	
-	// Incremented on each query. See cpHandle.stamp.
+	// Incremented each time a handle is linked so it's only added once to each cell.
 	CP_PRIVATE(cpTimestamp stamp);
 } cpSpaceHash;
 
@@ -74,8 +116,14 @@ cpSpaceHash *cpSpaceHashNew(cpFloat celldim, int cells, cpSpaceHashBBFunc bbfunc
 void cpSpaceHashDestroy(cpSpaceHash *hash);
 void cpSpaceHashFree(cpSpaceHash *hash);
 
-// Resize the hashtable. (Does not rehash! You must call cpSpaceHashRehash() if needed.)
+// Returns true if the spatial index is a cpSpaceHash.
+cpBool cpSpatialIndexIsSpaceHash(cpSpatialIndex *index);
+
+// Resize the hashtable. The cells are rebuilt before the next query.
 void cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells);
+// When enabled, the hash periodically resizes itself based on the size and number of the objects in it.
+// Disabled by default.
+void cpSpaceHashSetAutoTune(cpSpaceHash *hash, cpBool autoTune);
 
 // Add an object to the hash.
 void cpSpaceHashInsert(cpSpaceHash *hash, void *obj, cpHashValue id, cpBB _deprecated_ignored);
@@ -83,7 +131,7 @@ void cpSpaceHashInsert(cpSpaceHash *hash, void *obj, cpHashValue id, cpBB _depre
 void cpSpaceHashRemove(cpSpaceHash *hash, void *obj, cpHashValue id);
 
 // Iterator function
-typedef void (*cpSpaceHashIterator)(void *obj, void *data);
+typedef cpSpatialIndexIterator cpSpaceHashIterator;
 // Iterate over the objects in the hash.
 void cpSpaceHashEach(cpSpaceHash *hash, cpSpaceHashIterator func, void *data);
 
@@ -91,9 +139,11 @@ void cpSpaceHashEach(cpSpaceHash *hash, cpSpaceHashIterator func, void *data);
 void cpSpaceHashRehash(cpSpaceHash *hash);
 // Rehash only a specific object.
 void cpSpaceHashRehashObject(cpSpaceHash *hash, void *obj, cpHashValue id);
+// Link in objects that were inserted since the last query and rebuild the cells if they are stale.
+void cpSpaceHashFlush(cpSpaceHash *hash);
 
 // Query callback.
-typedef void (*cpSpaceHashQueryFunc)(void *obj1, void *obj2, void *data);
+typedef cpSpatialIndexQueryFunc cpSpaceHashQueryFunc;
 // Point query the hash. A reference to the query point is passed as obj1 to the query callback.
 void cpSpaceHashPointQuery(cpSpaceHash *hash, cpVect point, cpSpaceHashQueryFunc func, void *data);
 // Query the hash for a given BBox.
@@ -106,5 +156,5 @@ void cpSpaceHashQueryRehash(cpSpaceHash *hash, cpSpaceHashQueryFunc func, void *
 // Segment Query callback.
 // Return value is uesd for early exits of the query.
 // If while traversing the grid, the raytrace function detects that an entire grid cell is beyond the hit point, it will stop the trace.
-typedef cpFloat (*cpSpaceHashSegmentQueryFunc)(void *obj1, void *obj2, void *data);
+typedef cpSpatialIndexSegmentQueryFunc cpSpaceHashSegmentQueryFunc;
 void cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpaceHashSegmentQueryFunc func, void *data);
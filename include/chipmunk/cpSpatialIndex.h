@@ -0,0 +1,200 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Spatial indexes are the broadphase acceleration structures used by the space.
+// cpSpatialIndex is an abstract "base class" in the same way that cpShape is.
+// Each implementation embeds a cpSpatialIndex as its first member and fills
+// in a cpSpatialIndexClass with its function pointers.
+
+struct cpSpatialIndex;
+struct cpSpatialIndexClass;
+
+// BBox callback. Called whenever the index needs a bounding box from an object.
+typedef cpBB (*cpSpatialIndexBBFunc)(void *obj);
+// Iterator function.
+typedef void (*cpSpatialIndexIterator)(void *obj, void *data);
+// Query callback.
+typedef void (*cpSpatialIndexQueryFunc)(void *obj1, void *obj2, void *data);
+// Segment Query callback.
+// Return value is used for early exits of the query.
+// Objects that are entirely beyond the returned value along the segment may be skipped.
+typedef cpFloat (*cpSpatialIndexSegmentQueryFunc)(void *obj1, void *obj2, void *data);
+
+typedef struct cpSpatialIndex {
+	// The "class" of the index as defined below.
+	CP_PRIVATE(const struct cpSpatialIndexClass *klass);
+	
+	// BBox callback.
+	CP_PRIVATE(cpSpatialIndexBBFunc bbfunc);
+} cpSpatialIndex;
+
+// Spatial index class. Holds the function pointers for an index implementation.
+typedef struct cpSpatialIndexClass {
+	// Called by cpSpatialIndexDestroy().
+	void (*destroy)(cpSpatialIndex *index);
+	
+	// Number of objects in the index.
+	int (*count)(cpSpatialIndex *index);
+	// Iterate over the objects in the index.
+	void (*each)(cpSpatialIndex *index, cpSpatialIndexIterator func, void *data);
+	// Returns true if the object is in the index.
+	cpBool (*contains)(cpSpatialIndex *index, void *obj, cpHashValue id);
+	
+	// Add/remove an object.
+	void (*insert)(cpSpatialIndex *index, void *obj, cpHashValue id);
+	void (*remove)(cpSpatialIndex *index, void *obj, cpHashValue id);
+	
+	// Update the index for all objects, or for a single object.
+	void (*reindex)(cpSpatialIndex *index);
+	void (*reindexObject)(cpSpatialIndex *index, void *obj, cpHashValue id);
+	// Update the index for all objects while reporting every overlapping pair exactly once.
+	void (*reindexQuery)(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data);
+	// Finish any work the index put off, such as linking in inserted objects.
+	// Afterwards queries only read from the index until it's modified again.
+	void (*flush)(cpSpatialIndex *index);
+	
+	// A reference to the query point is passed as obj1 to the query callback.
+	void (*pointQuery)(cpSpatialIndex *index, cpVect point, cpSpatialIndexQueryFunc func, void *data);
+	void (*query)(cpSpatialIndex *index, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data);
+	void (*segmentQuery)(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data);
+} cpSpatialIndexClass;
+
+// Initialize the base index struct. Called by the implementations' init functions.
+cpSpatialIndex *cpSpatialIndexInit(cpSpatialIndex *index, const cpSpatialIndexClass *klass, cpSpatialIndexBBFunc bbfunc);
+
+// Basic destructor functions. (allocation functions are not shared)
+void cpSpatialIndexDestroy(cpSpatialIndex *index);
+void cpSpatialIndexFree(cpSpatialIndex *index);
+
+
+// Dynamic AABB tree index.
+// Objects are stored in the leaves of a binary tree of bounding boxes.
+// Unlike the spatial hash, there is nothing to tune and the cost does not
+// depend on the sizes of the objects, only on how many there are.
+// Large batches of insertions and full reindexes bulk build the whole tree at once,
+// which makes it a good choice for the static shapes of large levels.
+struct cpBBTree;
+typedef struct cpBBTree cpBBTree;
+
+cpBBTree *cpBBTreeAlloc(void);
+cpSpatialIndex *cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc);
+cpSpatialIndex *cpBBTreeNew(cpSpatialIndexBBFunc bbfunc);
+
+
+// Sort and sweep index along the x-axis.
+// Objects are kept in an array sorted by the left edges of their bboxes
+// which is insertion sorted again each step. Works best for worlds that are
+// much wider than they are tall, such as side-scrollers.
+struct cpSweep1D;
+typedef struct cpSweep1D cpSweep1D;
+
+cpSweep1D *cpSweep1DAlloc(void);
+cpSpatialIndex *cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc);
+cpSpatialIndex *cpSweep1DNew(cpSpatialIndexBBFunc bbfunc);
+
+
+// Hierarchical spatial hash.
+// Keeps several spatial hashes, each with cells twice the size of the one below it.
+// Each object is stored in the level whose cells match the size of its bbox so that
+// huge objects (long ground segments, etc) only touch a few cells.
+// Mixing very small and very large objects in a single spatial hash is slow either way you size the cells.
+struct cpHierarchicalHash;
+typedef struct cpHierarchicalHash cpHierarchicalHash;
+
+cpHierarchicalHash *cpHierarchicalHashAlloc(void);
+// celldim is the size of the cells of the finest level.
+cpSpatialIndex *cpHierarchicalHashInit(cpHierarchicalHash *hhash, cpFloat celldim, int numLevels, int numcells, cpSpatialIndexBBFunc bbfunc);
+cpSpatialIndex *cpHierarchicalHashNew(cpFloat celldim, int numLevels, int numcells, cpSpatialIndexBBFunc bbfunc);
+
+
+// *** inlined dispatch functions
+
+static inline int
+cpSpatialIndexCount(cpSpatialIndex *index)
+{
+	return index->CP_PRIVATE(klass)->count(index);
+}
+
+static inline void
+cpSpatialIndexEach(cpSpatialIndex *index, cpSpatialIndexIterator func, void *data)
+{
+	index->CP_PRIVATE(klass)->each(index, func, data);
+}
+
+static inline cpBool
+cpSpatialIndexContains(cpSpatialIndex *index, void *obj, cpHashValue id)
+{
+	return index->CP_PRIVATE(klass)->contains(index, obj, id);
+}
+
+static inline void
+cpSpatialIndexInsert(cpSpatialIndex *index, void *obj, cpHashValue id)
+{
+	index->CP_PRIVATE(klass)->insert(index, obj, id);
+}
+
+static inline void
+cpSpatialIndexRemove(cpSpatialIndex *index, void *obj, cpHashValue id)
+{
+	index->CP_PRIVATE(klass)->remove(index, obj, id);
+}
+
+static inline void
+cpSpatialIndexReindex(cpSpatialIndex *index)
+{
+	index->CP_PRIVATE(klass)->reindex(index);
+}
+
+static inline void
+cpSpatialIndexReindexObject(cpSpatialIndex *index, void *obj, cpHashValue id)
+{
+	index->CP_PRIVATE(klass)->reindexObject(index, obj, id);
+}
+
+static inline void
+cpSpatialIndexReindexQuery(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data)
+{
+	index->CP_PRIVATE(klass)->reindexQuery(index, func, data);
+}
+
+static inline void
+cpSpatialIndexFlush(cpSpatialIndex *index)
+{
+	index->CP_PRIVATE(klass)->flush(index);
+}
+
+static inline void
+cpSpatialIndexPointQuery(cpSpatialIndex *index, cpVect point, cpSpatialIndexQueryFunc func, void *data)
+{
+	index->CP_PRIVATE(klass)->pointQuery(index, point, func, data);
+}
+
+static inline void
+cpSpatialIndexQuery(cpSpatialIndex *index, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	index->CP_PRIVATE(klass)->query(index, obj, bb, func, data);
+}
+
+static inline void
+cpSpatialIndexSegmentQuery(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	index->CP_PRIVATE(klass)->segmentQuery(index, obj, a, b, t_exit, func, data);
+}
@@ -0,0 +1,88 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// Grid of square tiles for static tile worlds.
+// The whole map is a single entry in the space's spatial index. Collisions and queries find the tiles
+// they touch by indexing the grid directly. Tile id 0 is empty and every other id is solid.
+// Faces shared by two solid tiles never make contacts, so shapes don't snag on the seams between tiles.
+typedef struct cpTileMapShape{
+	cpShape shape;
+	
+	// Number of columns and rows of tiles.
+	CP_PRIVATE(int width);
+	CP_PRIVATE(int height);
+	
+	// Tile ids stored a row at a time starting from the bottom left tile.
+	CP_PRIVATE(unsigned char *tiles);
+	
+	// Size of the tiles and the bottom left corner of the map. (body space coordinates)
+	CP_PRIVATE(cpFloat cellSize);
+	CP_PRIVATE(cpVect offset);
+	
+	// Transformed bottom left corner and rotation of the map. (world space coordinates)
+	CP_PRIVATE(cpVect tOffset);
+	CP_PRIVATE(cpVect tRot);
+} cpTileMapShape;
+
+// Basic allocation functions.
+// tiles holds width*height tile ids and is copied. Pass NULL to start with an empty map.
+cpTileMapShape *cpTileMapShapeAlloc(void);
+cpTileMapShape *cpTileMapShapeInit(cpTileMapShape *map, cpBody *body, int width, int height, const unsigned char *tiles, cpFloat cellSize, cpVect offset);
+cpShape *cpTileMapShapeNew(cpBody *body, int width, int height, const unsigned char *tiles, cpFloat cellSize, cpVect offset);
+
+int cpTileMapShapeGetWidth(cpShape *shape);
+int cpTileMapShapeGetHeight(cpShape *shape);
+cpFloat cpTileMapShapeGetCellSize(cpShape *shape);
+
+unsigned char cpTileMapShapeGetTile(cpShape *shape, int x, int y);
+// Tiles can be changed at any time outside of a call to cpSpaceStep() since the map's bbox doesn't change.
+void cpTileMapShapeSetTile(cpShape *shape, int x, int y, unsigned char tile);
+
+// Tile map iterator callback.
+typedef void (*cpTileMapShapeTileFunc)(cpTileMapShape *map, int x, int y, void *data);
+// Calls func for each solid tile of the map that intersects bb, a row at a time from the bottom.
+void cpTileMapShapeQuery(cpTileMapShape *map, cpBB bb, cpTileMapShapeTileFunc func, void *data);
+
+// *** inlined utility functions
+
+// Returns true if the tile is solid. Tiles outside of the map are empty.
+static inline cpBool
+cpTileMapShapeIsSolid(const cpTileMapShape *map, const int x, const int y)
+{
+	int width = map->CP_PRIVATE(width);
+	return (0 <= x && x < width && 0 <= y && y < map->CP_PRIVATE(height) && map->CP_PRIVATE(tiles)[x + y*width]);
+}
+
+// Converts a point from world space to the map's grid space where tile (x, y) covers [x, x + 1]x[y, y + 1].
+static inline cpVect
+cpTileMapShapeGridPoint(const cpTileMapShape *map, const cpVect p)
+{
+	cpVect v = cpvunrotate(cpvsub(p, map->CP_PRIVATE(tOffset)), map->CP_PRIVATE(tRot));
+	return cpvmult(v, 1.0f/map->CP_PRIVATE(cellSize));
+}
+
+// Converts a point from the map's grid space to world space.
+static inline cpVect
+cpTileMapShapeWorldPoint(const cpTileMapShape *map, const cpVect v)
+{
+	return cpvadd(map->CP_PRIVATE(tOffset), cpvrotate(cpvmult(v, map->CP_PRIVATE(cellSize)), map->CP_PRIVATE(tRot)));
+}
@@ -120,6 +120,9 @@ cpArbiterInit(cpArbiter *arb, cpShape *a, cpShape *b)
 	arb->stamp = 0;
 	arb->state = cpArbiterStateFirstColl;
 	
+	arb->axis.shape = NULL;
+	arb->axis.index = 0;
+	
 	return arb;
 }
 
@@ -0,0 +1,597 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "chipmunk_private.h"
+
+// Tree nodes are either leaves that hold an object,
+// or internal nodes that hold two children.
+typedef struct Node Node;
+struct Node {
+	// Object held by a leaf, NULL for internal nodes.
+	void *obj;
+	cpBB bb;
+	
+	Node *parent;
+	Node *a, *b;
+};
+
+struct cpBBTree {
+	// Spatial index "superclass". Must be the first member.
+	cpSpatialIndex spatialIndex;
+	
+	// Set of the leaves, used to look up the leaf for an object.
+	cpHashSet *leaves;
+	Node *root;
+	
+	// Leaves that have been inserted but not yet linked into the tree.
+	// They are linked in before the next query that needs the tree.
+	cpArray *pendingLeaves;
+	
+	// Recycled nodes, linked together using Node.parent.
+	Node *pooledNodes;
+	// list of buffers to free on destruction.
+	cpArray *allocatedBuffers;
+};
+
+static inline const cpSpatialIndexClass *Klass(void);
+
+#pragma mark Node Functions
+
+static inline cpBool NodeIsLeaf(Node *node){return (node->obj != NULL);}
+
+static inline void
+NodeRecycle(cpBBTree *tree, Node *node)
+{
+	node->parent = tree->pooledNodes;
+	tree->pooledNodes = node;
+}
+
+// Get a recycled or new node.
+static Node *
+NodeFromPool(cpBBTree *tree)
+{
+	Node *node = tree->pooledNodes;
+	
+	if(node){
+		tree->pooledNodes = node->parent;
+		return node;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Node);
+		cpAssert(count, "Buffer size is too small.");
+		
+		Node *buffer = (Node *)cpmalloc(CP_BUFFER_BYTES);
+		cpArrayPush(tree->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++) NodeRecycle(tree, buffer + i);
+		return buffer;
+	}
+}
+
+static inline void
+NodeSetA(Node *node, Node *value)
+{
+	node->a = value;
+	value->parent = node;
+}
+
+static inline void
+NodeSetB(Node *node, Node *value)
+{
+	node->b = value;
+	value->parent = node;
+}
+
+// Create an internal node holding two subtrees.
+static Node *
+NodeNew(cpBBTree *tree, Node *a, Node *b)
+{
+	Node *node = NodeFromPool(tree);
+	
+	node->obj = NULL;
+	node->bb = cpBBmerge(a->bb, b->bb);
+	node->parent = NULL;
+	
+	NodeSetA(node, a);
+	NodeSetB(node, b);
+	
+	return node;
+}
+
+static inline Node *
+NodeOther(Node *node, Node *child)
+{
+	return (node->a == child ? node->b : node->a);
+}
+
+// Replace 'child' of 'parent' with 'value' and recycle 'child'.
+// The bboxes of all the ancestors are refit afterwards.
+static void
+NodeReplaceChild(cpBBTree *tree, Node *parent, Node *child, Node *value)
+{
+	cpAssert(!NodeIsLeaf(parent), "Internal Error: Cannot replace child of a leaf.");
+	cpAssert(child == parent->a || child == parent->b, "Internal Error: Node is not a child of parent.");
+	
+	if(parent->a == child){
+		NodeSetA(parent, value);
+	} else {
+		NodeSetB(parent, value);
+	}
+	
+	NodeRecycle(tree, child);
+	
+	for(Node *node=parent; node; node = node->parent){
+		node->bb = cpBBmerge(node->a->bb, node->b->bb);
+	}
+}
+
+#pragma mark Subtree Functions
+
+// Insert a leaf into a subtree and return the new subtree root.
+// Descends into whichever child grows the total area the least.
+static Node *
+SubtreeInsert(cpBBTree *tree, Node *subtree, Node *leaf)
+{
+	if(subtree == NULL){
+		leaf->parent = NULL;
+		return leaf;
+	} else if(NodeIsLeaf(subtree)){
+		return NodeNew(tree, leaf, subtree);
+	} else {
+		cpFloat cost_a = cpBBArea(subtree->b->bb) + cpBBMergedArea(subtree->a->bb, leaf->bb);
+		cpFloat cost_b = cpBBArea(subtree->a->bb) + cpBBMergedArea(subtree->b->bb, leaf->bb);
+		
+		if(cost_a == cost_b){
+			cost_a = cpBBProximity(subtree->a->bb, leaf->bb);
+			cost_b = cpBBProximity(subtree->b->bb, leaf->bb);
+		}
+		
+		if(cost_b < cost_a){
+			NodeSetB(subtree, SubtreeInsert(tree, subtree->b, leaf));
+		} else {
+			NodeSetA(subtree, SubtreeInsert(tree, subtree->a, leaf));
+		}
+		
+		subtree->bb = cpBBmerge(subtree->bb, leaf->bb);
+		return subtree;
+	}
+}
+
+// Remove a leaf from a subtree and return the new subtree root.
+// The leaf itself is not recycled.
+static Node *
+SubtreeRemove(cpBBTree *tree, Node *subtree, Node *leaf)
+{
+	if(leaf == subtree){
+		return NULL;
+	} else {
+		Node *parent = leaf->parent;
+		if(parent == subtree){
+			Node *other = NodeOther(subtree, leaf);
+			other->parent = subtree->parent;
+			NodeRecycle(tree, subtree);
+			return other;
+		} else {
+			NodeReplaceChild(tree, parent->parent, parent, NodeOther(parent, leaf));
+			return subtree;
+		}
+	}
+}
+
+static void
+SubtreeQuery(Node *subtree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(!cpBBintersects(subtree->bb, bb)) return;
+	
+	if(NodeIsLeaf(subtree)){
+		if(subtree->obj != obj) func(obj, subtree->obj, data);
+	} else {
+		SubtreeQuery(subtree->a, obj, bb, func, data);
+		SubtreeQuery(subtree->b, obj, bb, func, data);
+	}
+}
+
+static inline cpBool
+bbContainsPoint(cpBB bb, cpVect p)
+{
+	return (bb.l <= p.x && p.x <= bb.r && bb.b <= p.y && p.y <= bb.t);
+}
+
+static void
+SubtreePointQuery(Node *subtree, cpVect *point, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(!bbContainsPoint(subtree->bb, *point)) return;
+	
+	if(NodeIsLeaf(subtree)){
+		func(point, subtree->obj, data);
+	} else {
+		SubtreePointQuery(subtree->a, point, func, data);
+		SubtreePointQuery(subtree->b, point, func, data);
+	}
+}
+
+// Visits the children nearest to the start of the segment first so that
+// the callback has a chance to shrink t_exit and prune the farther ones.
+static cpFloat
+SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(NodeIsLeaf(subtree)){
+		return func(obj, subtree->obj, data);
+	} else {
+		cpFloat t_a = cpBBSegmentQuery(subtree->a->bb, a, b);
+		cpFloat t_b = cpBBSegmentQuery(subtree->b->bb, a, b);
+		
+		if(t_a < t_b){
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->a, obj, a, b, t_exit, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->b, obj, a, b, t_exit, func, data));
+		} else {
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->b, obj, a, b, t_exit, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->a, obj, a, b, t_exit, func, data));
+		}
+		
+		return t_exit;
+	}
+}
+
+// Report the overlapping leaf pairs between two disjoint subtrees.
+static void
+SubtreeCrossQuery(Node *a, Node *b, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(!cpBBintersects(a->bb, b->bb)) return;
+	
+	if(NodeIsLeaf(a)){
+		if(NodeIsLeaf(b)){
+			func(a->obj, b->obj, data);
+		} else {
+			SubtreeCrossQuery(a, b->a, func, data);
+			SubtreeCrossQuery(a, b->b, func, data);
+		}
+	} else if(NodeIsLeaf(b) || cpBBArea(a->bb) >= cpBBArea(b->bb)){
+		// Descend into the larger subtree first.
+		SubtreeCrossQuery(a->a, b, func, data);
+		SubtreeCrossQuery(a->b, b, func, data);
+	} else {
+		SubtreeCrossQuery(a, b->a, func, data);
+		SubtreeCrossQuery(a, b->b, func, data);
+	}
+}
+
+// Report all the overlapping leaf pairs within a subtree exactly once.
+static void
+SubtreeSelfQuery(Node *subtree, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(NodeIsLeaf(subtree)) return;
+	
+	SubtreeSelfQuery(subtree->a, func, data);
+	SubtreeSelfQuery(subtree->b, func, data);
+	SubtreeCrossQuery(subtree->a, subtree->b, func, data);
+}
+
+// Recycle all the internal nodes of a subtree, leaving the leaves alone.
+static void
+SubtreeRecycle(cpBBTree *tree, Node *subtree)
+{
+	if(NodeIsLeaf(subtree)) return;
+	
+	SubtreeRecycle(tree, subtree->a);
+	SubtreeRecycle(tree, subtree->b);
+	NodeRecycle(tree, subtree);
+}
+
+#pragma mark Bulk Building
+
+static inline cpFloat
+LeafCenter(Node *leaf, cpBool splitX)
+{
+	cpBB bb = leaf->bb;
+	return (splitX ? bb.l + bb.r : bb.b + bb.t);
+}
+
+// Partially sort the leaves so that leaves[k] holds the median along the
+// split axis with the smaller leaves before it and larger ones after it.
+// Runs in linear time on average.
+static void
+SelectMedian(Node **leaves, int count, int k, cpBool splitX)
+{
+	int left = 0, right = count - 1;
+	
+	while(left < right){
+		cpFloat pivot = LeafCenter(leaves[(left + right)/2], splitX);
+		int i = left, j = right;
+		
+		while(i <= j){
+			while(LeafCenter(leaves[i], splitX) < pivot) i++;
+			while(LeafCenter(leaves[j], splitX) > pivot) j--;
+			
+			if(i <= j){
+				Node *temp = leaves[i];
+				leaves[i] = leaves[j];
+				leaves[j] = temp;
+				i++; j--;
+			}
+		}
+		
+		if(k <= j){
+			right = j;
+		} else if(k >= i){
+			left = i;
+		} else {
+			break;
+		}
+	}
+}
+
+// Build a subtree top down by splitting the leaves at the median of the
+// longest axis of their bounds. O(n log n) and gives a balanced tree.
+static Node *
+SubtreeBuild(cpBBTree *tree, Node **leaves, int count)
+{
+	if(count == 1) return leaves[0];
+	
+	cpBB bb = leaves[0]->bb;
+	for(int i=1; i<count; i++) bb = cpBBmerge(bb, leaves[i]->bb);
+	
+	int half = count/2;
+	SelectMedian(leaves, count, half, (bb.r - bb.l) > (bb.t - bb.b));
+	
+	return NodeNew(tree, SubtreeBuild(tree, leaves, half), SubtreeBuild(tree, leaves + half, count - half));
+}
+
+static void pushLeaf(Node *leaf, cpArray *leaves){cpArrayPush(leaves, leaf);}
+
+// Throw away the internal nodes and bulk build a new tree over all the leaves.
+static void
+TreeRebuild(cpBBTree *tree)
+{
+	if(tree->root) SubtreeRecycle(tree, tree->root);
+	tree->root = NULL;
+	tree->pendingLeaves->num = 0;
+	
+	int count = tree->leaves->entries;
+	if(count == 0) return;
+	
+	cpArray *leaves = cpArrayNew(count);
+	cpHashSetEach(tree->leaves, (cpHashSetIterFunc)pushLeaf, leaves);
+	
+	tree->root = SubtreeBuild(tree, (Node **)leaves->arr, count);
+	tree->root->parent = NULL;
+	
+	cpArrayFree(leaves);
+}
+
+// Link in any leaves waiting to be added to the tree.
+// A large batch of leaves (such as when loading a level) is cheaper and
+// gives a better tree when the whole tree is rebuilt at once.
+static void
+TreeLinkPendingLeaves(cpBBTree *tree)
+{
+	cpArray *pending = tree->pendingLeaves;
+	if(pending->num == 0) return;
+	
+	if(pending->num*2 >= tree->leaves->entries){
+		TreeRebuild(tree);
+	} else {
+		for(int i=0; i<pending->num; i++){
+			tree->root = SubtreeInsert(tree, tree->root, (Node *)pending->arr[i]);
+		}
+		
+		pending->num = 0;
+	}
+}
+
+#pragma mark Leaf Functions
+
+// Equality function for the leaf set.
+static cpBool leafSetEql(void *obj, Node *leaf){return (obj == leaf->obj);}
+
+// Transformation function for the leaf set.
+static void *
+leafSetTrans(void *obj, cpBBTree *tree)
+{
+	Node *leaf = NodeFromPool(tree);
+	
+	leaf->obj = obj;
+	leaf->bb = tree->spatialIndex.bbfunc(obj);
+	leaf->parent = NULL;
+	leaf->a = leaf->b = NULL;
+	
+	return leaf;
+}
+
+// Refresh the leaf's bbox, moving it within the tree if it changed.
+static void
+LeafUpdate(Node *leaf, cpBBTree *tree)
+{
+	cpBB bb = tree->spatialIndex.bbfunc(leaf->obj);
+	cpBB old = leaf->bb;
+	
+	if(bb.l != old.l || bb.b != old.b || bb.r != old.r || bb.t != old.t){
+		tree->root = SubtreeRemove(tree, tree->root, leaf);
+		leaf->bb = bb;
+		tree->root = SubtreeInsert(tree, tree->root, leaf);
+	}
+}
+
+#pragma mark Memory Management Functions
+
+cpBBTree *
+cpBBTreeAlloc(void)
+{
+	return (cpBBTree *)cpcalloc(1, sizeof(cpBBTree));
+}
+
+cpSpatialIndex *
+cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)tree, Klass(), bbfunc);
+	
+	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql, (cpHashSetTransFunc)leafSetTrans);
+	tree->root = NULL;
+	tree->pendingLeaves = cpArrayNew(0);
+	
+	tree->pooledNodes = NULL;
+	tree->allocatedBuffers = cpArrayNew(0);
+	
+	return (cpSpatialIndex *)tree;
+}
+
+cpSpatialIndex *
+cpBBTreeNew(cpSpatialIndexBBFunc bbfunc)
+{
+	return cpBBTreeInit(cpBBTreeAlloc(), bbfunc);
+}
+
+static void freeWrap(void *ptr, void *unused){cpfree(ptr);}
+
+static void
+cpBBTreeDestroy(cpBBTree *tree)
+{
+	cpHashSetFree(tree->leaves);
+	cpArrayFree(tree->pendingLeaves);
+	
+	cpArrayEach(tree->allocatedBuffers, freeWrap, NULL);
+	cpArrayFree(tree->allocatedBuffers);
+}
+
+#pragma mark Insert/Remove
+
+static void
+cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
+{
+	Node *leaf = (Node *)cpHashSetInsert(tree->leaves, hashid, obj, tree);
+	cpArrayPush(tree->pendingLeaves, leaf);
+}
+
+static void
+cpBBTreeRemove(cpBBTree *tree, void *obj, cpHashValue hashid)
+{
+	TreeLinkPendingLeaves(tree);
+	Node *leaf = (Node *)cpHashSetRemove(tree->leaves, hashid, obj);
+	
+	if(leaf){
+		tree->root = SubtreeRemove(tree, tree->root, leaf);
+		NodeRecycle(tree, leaf);
+	}
+}
+
+static cpBool
+cpBBTreeContains(cpBBTree *tree, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(tree->leaves, hashid, obj) != NULL);
+}
+
+static int cpBBTreeCount(cpBBTree *tree){return tree->leaves->entries;}
+
+typedef struct eachPair {
+	cpSpatialIndexIterator func;
+	void *data;
+} eachPair;
+
+static void eachHelper(Node *leaf, eachPair *pair){pair->func(leaf->obj, pair->data);}
+
+static void
+cpBBTreeEach(cpBBTree *tree, cpSpatialIndexIterator func, void *data)
+{
+	eachPair pair = {func, data};
+	cpHashSetEach(tree->leaves, (cpHashSetIterFunc)eachHelper, &pair);
+}
+
+#pragma mark Reindex
+
+static void updateLeafBB(Node *leaf, cpBBTree *tree){leaf->bb = tree->spatialIndex.bbfunc(leaf->obj);}
+
+// Full reindex. Bulk builds a new tree in a single O(n log n) pass.
+static void
+cpBBTreeReindex(cpBBTree *tree)
+{
+	cpHashSetEach(tree->leaves, (cpHashSetIterFunc)updateLeafBB, tree);
+	TreeRebuild(tree);
+}
+
+static void
+cpBBTreeReindexObject(cpBBTree *tree, void *obj, cpHashValue hashid)
+{
+	TreeLinkPendingLeaves(tree);
+	Node *leaf = (Node *)cpHashSetFind(tree->leaves, hashid, obj);
+	if(leaf) LeafUpdate(leaf, tree);
+}
+
+static void
+cpBBTreeReindexQuery(cpBBTree *tree, cpSpatialIndexQueryFunc func, void *data)
+{
+	TreeLinkPendingLeaves(tree);
+	if(!tree->root) return;
+	
+	// Objects move a little each step, so update the leaves in place.
+	cpHashSetEach(tree->leaves, (cpHashSetIterFunc)LeafUpdate, tree);
+	SubtreeSelfQuery(tree->root, func, data);
+}
+
+#pragma mark Query
+
+static void
+cpBBTreePointQuery(cpBBTree *tree, cpVect point, cpSpatialIndexQueryFunc func, void *data)
+{
+	TreeLinkPendingLeaves(tree);
+	if(tree->root) SubtreePointQuery(tree->root, &point, func, data);
+}
+
+static void cpBBTreeFlush(cpBBTree *tree){TreeLinkPendingLeaves(tree);}
+
+static void
+cpBBTreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	TreeLinkPendingLeaves(tree);
+	if(tree->root) SubtreeQuery(tree->root, obj, bb, func, data);
+}
+
+static void
+cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	TreeLinkPendingLeaves(tree);
+	
+	Node *root = tree->root;
+	if(root && cpBBSegmentQuery(root->bb, a, b) < t_exit) SubtreeSegmentQuery(root, obj, a, b, t_exit, func, data);
+}
+
+static const cpSpatialIndexClass klass = {
+	(void (*)(cpSpatialIndex *))cpBBTreeDestroy,
+	
+	(int (*)(cpSpatialIndex *))cpBBTreeCount,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexIterator, void *))cpBBTreeEach,
+	(cpBool (*)(cpSpatialIndex *, void *, cpHashValue))cpBBTreeContains,
+	
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpBBTreeInsert,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpBBTreeRemove,
+	
+	(void (*)(cpSpatialIndex *))cpBBTreeReindex,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpBBTreeReindexObject,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexQueryFunc, void *))cpBBTreeReindexQuery,
+	(void (*)(cpSpatialIndex *))cpBBTreeFlush,
+	
+	(void (*)(cpSpatialIndex *, cpVect, cpSpatialIndexQueryFunc, void *))cpBBTreePointQuery,
+	(void (*)(cpSpatialIndex *, void *, cpBB, cpSpatialIndexQueryFunc, void *))cpBBTreeQuery,
+	(void (*)(cpSpatialIndex *, void *, cpVect, cpVect, cpFloat, cpSpatialIndexSegmentQueryFunc, void *))cpBBTreeSegmentQuery,
+};
+static inline const cpSpatialIndexClass *Klass(void){return &klass;}
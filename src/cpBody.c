@@ -67,6 +67,10 @@ cpBodyInit(cpBody *body, cpFloat m, cpFloat i)
 	cpComponentNode node = {NULL, NULL, 0, 0.0f};
 	body->node = node;
 	
+	body->transformP = body->p;
+	body->transformRot = body->rot;
+	body->transformGeneration = 1;
+	
 	return body;
 }
 
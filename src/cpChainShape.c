@@ -0,0 +1,298 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+ 
+#include <stdlib.h>
+#include <math.h>
+
+#include "chipmunk_private.h"
+
+// Deep enough for a tree over any number of segments that fits in an int.
+#define CP_CHAIN_STACK_SIZE 64
+
+cpChainShape *
+cpChainShapeAlloc(void)
+{
+	return (cpChainShape *)cpcalloc(1, sizeof(cpChainShape));
+}
+
+static cpBB
+cpChainShapeCacheData(cpShape *shape, cpVect p, cpVect rot)
+{
+	cpChainShape *chain = (cpChainShape *)shape;
+	int numSegments = cpChainShapeGetNumSegments(chain);
+	
+	for(int i=0; i<chain->numVerts; i++) chain->tVerts[i] = cpvadd(p, cpvrotate(chain->verts[i], rot));
+	for(int i=0; i<numSegments; i++) chain->tNormals[i] = cpvrotate(chain->normals[i], rot);
+	
+	// Rebuild the tree from the leaves up. Leaves past the end of the chain are left empty.
+	cpBB *nodes = chain->nodes;
+	int numLeaves = chain->numLeaves;
+	for(int leaf=0; leaf<numLeaves; leaf++){
+		cpBB bb = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+		
+		int first = leaf*CP_CHAIN_LEAF_SIZE;
+		int last = (first + CP_CHAIN_LEAF_SIZE < numSegments ? first + CP_CHAIN_LEAF_SIZE : numSegments);
+		for(int i=first; i<last; i++) bb = cpBBmerge(bb, cpChainShapeSegmentBB(chain, i));
+		
+		nodes[numLeaves + leaf] = bb;
+	}
+	
+	for(int i=numLeaves - 1; i>0; i--) nodes[i] = cpBBmerge(nodes[2*i], nodes[2*i + 1]);
+	
+	return nodes[1];
+}
+
+static void
+cpChainShapeDestroy(cpShape *shape)
+{
+	cpChainShape *chain = (cpChainShape *)shape;
+	
+	cpfree(chain->verts);
+	cpfree(chain->normals);
+	
+	cpfree(chain->tVerts);
+	cpfree(chain->tNormals);
+	
+	cpfree(chain->nodes);
+}
+
+// Index of the first segment under a leaf node and the index after its last one.
+static inline int leafFirst(const cpChainShape *chain, int node){return (node - chain->numLeaves)*CP_CHAIN_LEAF_SIZE;}
+
+static inline int
+leafLast(const cpChainShape *chain, int node)
+{
+	int last = leafFirst(chain, node) + CP_CHAIN_LEAF_SIZE;
+	int numSegments = cpChainShapeGetNumSegments(chain);
+	return (last < numSegments ? last : numSegments);
+}
+
+void
+cpChainShapeQuery(cpChainShape *chain, cpBB bb, cpChainShapeSegmentFunc func, void *data)
+{
+	cpBB *nodes = chain->nodes;
+	
+	int stack[CP_CHAIN_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 1;
+	
+	while(top){
+		int node = stack[--top];
+		if(!cpBBintersects(nodes[node], bb)) continue;
+		
+		if(node < chain->numLeaves){
+			// Push the right child first so the segments are visited in order.
+			stack[top++] = 2*node + 1;
+			stack[top++] = 2*node;
+		} else {
+			for(int i=leafFirst(chain, node), last=leafLast(chain, node); i<last; i++){
+				if(cpBBintersects(cpChainShapeSegmentBB(chain, i), bb)) func(chain, i, data);
+			}
+		}
+	}
+}
+
+typedef struct pointQueryContext {
+	cpVect p;
+	cpBool inside;
+} pointQueryContext;
+
+static void
+pointQueryHelper(cpChainShape *chain, int i, pointQueryContext *context)
+{
+	cpVect closest = cpClosestPointOnSegment(context->p, chain->tVerts[i], chain->tVerts[i + 1]);
+	if(cpvlengthsq(cpvsub(context->p, closest)) < chain->r*chain->r) context->inside = cpTrue;
+}
+
+static cpBool
+cpChainShapePointQuery(cpShape *shape, cpVect p){
+	if(!cpBBcontainsVect(shape->bb, p)) return cpFalse;
+	
+	pointQueryContext context = {p, cpFalse};
+	cpChainShapeQuery((cpChainShape *)shape, cpBBNew(p.x, p.y, p.x, p.y), (cpChainShapeSegmentFunc)pointQueryHelper, &context);
+	
+	return context.inside;
+}
+
+// Visits the nodes nearest to the start of the query first and skips any that start past the closest hit so far.
+static void
+cpChainShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info)
+{
+	cpChainShape *chain = (cpChainShape *)shape;
+	cpBB *nodes = chain->nodes;
+	cpSegmentQueryInfo best = {NULL, 1.0f, cpvzero};
+	
+	int stack[CP_CHAIN_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 1;
+	
+	while(top){
+		int node = stack[--top];
+		if(cpBBSegmentQuery(nodes[node], a, b) > best.t) continue;
+		
+		if(node < chain->numLeaves){
+			int near = 2*node, far = 2*node + 1;
+			if(cpBBSegmentQuery(nodes[far], a, b) < cpBBSegmentQuery(nodes[near], a, b)){
+				near = 2*node + 1;
+				far = 2*node;
+			}
+			
+			stack[top++] = far;
+			stack[top++] = near;
+		} else {
+			for(int i=leafFirst(chain, node), last=leafLast(chain, node); i<last; i++){
+				cpSegmentQueryInfo segInfo = {NULL, 1.0f, cpvzero};
+				cpRoundedSegmentQuery(shape, chain->tVerts[i], chain->tVerts[i + 1], chain->tNormals[i], chain->r, a, b, &segInfo);
+				if(segInfo.shape && segInfo.t < best.t) best = segInfo;
+			}
+		}
+	}
+	
+	if(best.shape) (*info) = best;
+}
+
+// Distance from p to the bbox, 0 if p is inside of it.
+static inline cpFloat
+bbDistance(const cpBB bb, const cpVect p)
+{
+	cpFloat dx = cpfmax(cpfmax(bb.l - p.x, p.x - bb.r), 0.0f);
+	cpFloat dy = cpfmax(cpfmax(bb.b - p.y, p.y - bb.t), 0.0f);
+	return cpfsqrt(dx*dx + dy*dy);
+}
+
+// Branch and bound search for the closest segment.
+// The segments are inside of their bboxes, so their surface is at least the distance to the bbox minus the radius away.
+static void
+cpChainShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpChainShape *chain = (cpChainShape *)shape;
+	cpBB *nodes = chain->nodes;
+	cpFloat r = chain->r;
+	
+	cpFloat minDist = INFINITY;
+	cpVect closest = cpvzero;
+	
+	int stack[CP_CHAIN_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 1;
+	
+	while(top){
+		int node = stack[--top];
+		if(bbDistance(nodes[node], p) - r >= minDist) continue;
+		
+		if(node < chain->numLeaves){
+			int near = 2*node, far = 2*node + 1;
+			if(bbDistance(nodes[far], p) < bbDistance(nodes[near], p)){
+				near = 2*node + 1;
+				far = 2*node;
+			}
+			
+			stack[top++] = far;
+			stack[top++] = near;
+		} else {
+			for(int i=leafFirst(chain, node), last=leafLast(chain, node); i<last; i++){
+				cpVect v = cpClosestPointOnSegment(p, chain->tVerts[i], chain->tVerts[i + 1]);
+				cpFloat dist = cpvdist(p, v);
+				if(dist - r < minDist){
+					minDist = dist - r;
+					
+					// Pick an arbitrary direction when p is exactly on the segment.
+					cpVect n = (dist ? cpvmult(cpvsub(p, v), 1.0f/dist) : chain->tNormals[i]);
+					closest = cpvadd(v, cpvmult(n, r));
+				}
+			}
+		}
+	}
+	
+	info->shape = shape;
+	info->p = closest;
+	info->d = minDist;
+}
+
+static const cpShapeClass chainClass = {
+	CP_CHAIN_SHAPE,
+	cpChainShapeCacheData,
+	cpChainShapeDestroy,
+	cpChainShapePointQuery,
+	cpChainShapeSegmentQuery,
+	cpChainShapeNearestPointQuery,
+};
+
+int
+cpChainShapeGetNumVerts(cpShape *shape)
+{
+	cpAssert(shape->klass == &chainClass, "Shape is not a chain shape.");
+	return ((cpChainShape *)shape)->numVerts;
+}
+
+cpVect
+cpChainShapeGetVert(cpShape *shape, int idx)
+{
+	cpAssert(shape->klass == &chainClass, "Shape is not a chain shape.");
+	cpAssert(0 <= idx && idx < cpChainShapeGetNumVerts(shape), "Index out of range.");
+	
+	return ((cpChainShape *)shape)->verts[idx];
+}
+
+cpFloat
+cpChainShapeGetRadius(cpShape *shape)
+{
+	cpAssert(shape->klass == &chainClass, "Shape is not a chain shape.");
+	return ((cpChainShape *)shape)->r;
+}
+
+cpChainShape *
+cpChainShapeInit(cpChainShape *chain, cpBody *body, int numVerts, cpVect *verts, cpFloat radius)
+{
+	cpAssert(numVerts >= 2, "A chain needs at least two vertexes.");
+	
+	chain->numVerts = numVerts;
+	chain->loop = (numVerts > 2 && cpveql(verts[0], verts[numVerts - 1]));
+	chain->r = radius;
+	
+	int numSegments = (numVerts > 1 ? numVerts - 1 : 0);
+	chain->verts = (cpVect *)cpcalloc(numVerts, sizeof(cpVect));
+	chain->normals = (cpVect *)cpcalloc(numSegments, sizeof(cpVect));
+	chain->tVerts = (cpVect *)cpcalloc(numVerts, sizeof(cpVect));
+	chain->tNormals = (cpVect *)cpcalloc(numSegments, sizeof(cpVect));
+	
+	for(int i=0; i<numVerts; i++) chain->verts[i] = verts[i];
+	for(int i=0; i<numSegments; i++){
+		cpAssert(!cpveql(verts[i], verts[i + 1]), "A chain can't have zero length segments.");
+		chain->normals[i] = cpvperp(cpvnormalize(cpvsub(verts[i + 1], verts[i])));
+	}
+	
+	int numLeaves = 1;
+	while(numLeaves*CP_CHAIN_LEAF_SIZE < numSegments) numLeaves *= 2;
+	
+	chain->numLeaves = numLeaves;
+	chain->nodes = (cpBB *)cpcalloc(2*numLeaves, sizeof(cpBB));
+	
+	cpShapeInit((cpShape *)chain, &chainClass, body);
+	
+	return chain;
+}
+
+cpShape *
+cpChainShapeNew(cpBody *body, int numVerts, cpVect *verts, cpFloat radius)
+{
+	return (cpShape *)cpChainShapeInit(cpChainShapeAlloc(), body, numVerts, verts, radius);
+}
@@ -25,7 +25,10 @@
 
 #include "chipmunk_private.h"
 
-typedef int (*collisionFunc)(const cpShape *, const cpShape *, cpContact *);
+typedef int (*collisionFunc)(const cpShape *, const cpShape *, cpContact *, cpSeparatingAxis *);
+
+cpBool cp_poly_contact_clipping = cpFalse;
+int cp_poly_gjk_threshold = 1024;
 
 // Add contact points for circle to circle collisions.
 // Used by several collision tests.
@@ -53,7 +56,7 @@ circle2circleQuery(const cpVect p1, const cpVect p2, const cpFloat r1, const cpF
 
 // Collide circle shapes.
 static int
-circle2circle(const cpShape *shape1, const cpShape *shape2, cpContact *arr)
+circle2circle(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
 {
 	cpCircleShape *circ1 = (cpCircleShape *)shape1;
 	cpCircleShape *circ2 = (cpCircleShape *)shape2;
@@ -63,7 +66,7 @@ circle2circle(const cpShape *shape1, const cpShape *shape2, cpContact *arr)
 
 // Collide circles to segment shapes.
 static int
-circle2segment(const cpShape *circleShape, const cpShape *segmentShape, cpContact *con)
+circle2segment(const cpShape *circleShape, const cpShape *segmentShape, cpContact *con, cpSeparatingAxis *axis)
 {
 	cpCircleShape *circ = (cpCircleShape *)circleShape;
 	cpSegmentShape *seg = (cpSegmentShape *)segmentShape;
@@ -126,19 +129,61 @@ nextContactPoint(cpContact *arr, int *numPtr)
 	}
 }
 
-// Find the minimum separating axis for the give poly and axis list.
+// Returns the minimum distance of the poly to the axis.
+// The vertexes are projected a block at a time without branching over the padded component arrays
+// so that the compiler can vectorize the projections. Padding repeats the first vertex so it can't change the minimum.
+static inline cpFloat
+polyValueOnAxis(const cpPolyShape *poly, const cpFloat nx, const cpFloat ny, const cpFloat d)
+{
+	const cpFloat *x = poly->tVertsX;
+	const cpFloat *y = poly->tVertsY;
+	const int count = cpPolyShapeSoALength(poly->numVerts);
+	
+	cpFloat values[CP_POLY_SOA_WIDTH];
+	for(int k=0; k<CP_POLY_SOA_WIDTH; k++) values[k] = nx*x[k] + ny*y[k];
+	
+	for(int i=CP_POLY_SOA_WIDTH; i<count; i+=CP_POLY_SOA_WIDTH){
+		for(int k=0; k<CP_POLY_SOA_WIDTH; k++) values[k] = cpfmin(values[k], nx*x[i + k] + ny*y[i + k]);
+	}
+	
+	cpFloat min = values[0];
+	for(int k=1; k<CP_POLY_SOA_WIDTH; k++) min = cpfmin(min, values[k]);
+	
+	return min - d;
+}
+
+// Index of the cached axis if it belongs to the shape, otherwise the shape's first axis.
 static inline int
-findMSA(const cpPolyShape *poly, const cpPolyShapeAxis *axes, const int num, cpFloat *min_out)
+cachedAxisIndex(const cpSeparatingAxis *axis, const cpShape *shape, const int count)
 {
-	int min_index = 0;
-	cpFloat min = cpPolyShapeValueOnAxis(poly, axes->n, axes->d);
-	if(min > 0.0f) return -1;
-	
-	for(int i=1; i<num; i++){
-		cpFloat dist = cpPolyShapeValueOnAxis(poly, axes[i].n, axes[i].d);
-		if(dist > 0.0f) {
-			return -1;
-		} else if(dist > min){
+	return (axis->shape == shape && axis->index < count ? axis->index : 0);
+}
+
+static inline int
+cacheAxis(cpSeparatingAxis *axis, const cpShape *shape, const int index)
+{
+	axis->shape = shape;
+	axis->index = index;
+	return 0;
+}
+
+// Find the minimum separating axis of axisPoly's axes for the given poly, starting with axis 'first'.
+// Stops at the first separating axis found, in which case (*min_out) is positive.
+static inline int
+findMSA(const cpPolyShape *poly, const cpPolyShape *axisPoly, const int first, cpFloat *min_out)
+{
+	const cpFloat *nx = axisPoly->tAxesX;
+	const cpFloat *ny = axisPoly->tAxesY;
+	const cpFloat *d = axisPoly->tAxesD;
+	
+	int min_index = first;
+	cpFloat min = polyValueOnAxis(poly, nx[first], ny[first], d[first]);
+	
+	for(int i=0; i<axisPoly->numVerts && min <= 0.0f; i++){
+		if(i == first) continue;
+		
+		cpFloat dist = polyValueOnAxis(poly, nx[i], ny[i], d[i]);
+		if(dist > min){
 			min = dist;
 			min_index = i;
 		}
@@ -171,47 +216,480 @@ findVertsFallback(cpContact *arr, const cpPolyShape *poly1, const cpPolyShape *p
 	return num;
 }
 
+// Add contacts for the vertexes of poly that are inside of axisPoly.
+// Each block of vertexes is tested against all of axisPoly's axes at once without branching.
+static inline void
+findInsideVerts(cpContact *arr, int *num, const cpPolyShape *poly, const cpPolyShape *axisPoly, const cpVect n, const cpFloat dist)
+{
+	const cpFloat *nx = axisPoly->tAxesX;
+	const cpFloat *ny = axisPoly->tAxesY;
+	const cpFloat *d = axisPoly->tAxesD;
+	const int numAxes = axisPoly->numVerts;
+	
+	for(int block=0; block<poly->numVerts; block+=CP_POLY_SOA_WIDTH){
+		const cpFloat *x = poly->tVertsX + block;
+		const cpFloat *y = poly->tVertsY + block;
+		
+		int outside[CP_POLY_SOA_WIDTH] = {0};
+		for(int j=0; j<numAxes; j++){
+			cpFloat ax = nx[j], ay = ny[j], ad = d[j];
+			for(int k=0; k<CP_POLY_SOA_WIDTH; k++) outside[k] |= (ax*x[k] + ay*y[k] - ad > 0.0f);
+		}
+		
+		for(int k=0; k<CP_POLY_SOA_WIDTH && block + k<poly->numVerts; k++){
+			if(!outside[k]){
+				int i = block + k;
+				cpContactInit(nextContactPoint(arr, num), poly->tVerts[i], n, dist, CP_HASH_PAIR(poly->shape.hashid, i));
+			}
+		}
+	}
+}
+
 // Add contacts for penetrating vertexes.
 static inline int
 findVerts(cpContact *arr, const cpPolyShape *poly1, const cpPolyShape *poly2, const cpVect n, const cpFloat dist)
 {
 	int num = 0;
+	findInsideVerts(arr, &num, poly1, poly2, n, dist);
+	findInsideVerts(arr, &num, poly2, poly1, n, dist);
 	
-	for(int i=0; i<poly1->numVerts; i++){
-		cpVect v = poly1->tVerts[i];
-		if(cpPolyShapeContainsVert(poly2, v))
-			cpContactInit(nextContactPoint(arr, &num), v, n, dist, CP_HASH_PAIR(poly1->shape.hashid, i));
+	return (num ? num : findVertsFallback(arr, poly1, poly2, n, dist));
+}
+
+// Clip the incident edge v0->v1 against the side planes of the reference face r0->r1 and add a contact
+// for each remaining point that is behind the reference face. Unclipped points keep the incident
+// vertex's id while clipped points take the id of the side plane that clipped them.
+static int
+clipContacts(
+	cpContact *arr,
+	cpVect r0, cpVect r1, cpVect refN, cpFloat refD, cpHashValue sideId0, cpHashValue sideId1,
+	cpVect v0, cpVect v1, cpHashValue id0, cpHashValue id1,
+	cpVect n
+){
+	cpVect t = cpvsub(r1, r0);
+	cpFloat lo = cpvdot(t, r0);
+	cpFloat hi = cpvdot(t, r1);
+	if(lo == hi) return 0;
+	
+	cpFloat e0 = cpvdot(t, v0);
+	cpFloat e1 = cpvdot(t, v1);
+	if((e0 < lo && e1 < lo) || (e0 > hi && e1 > hi)) return 0;
+	
+	// Clip both ends to the slab between the side planes.
+	// Once one end is inside the slab, e0 != e1 for any end that is still outside.
+	cpVect d = cpvsub(v1, v0);
+	cpFloat de = e1 - e0;
+	cpVect c0 = v0, c1 = v1;
+	
+	if(e0 < lo){
+		c0 = cpvadd(v0, cpvmult(d, (lo - e0)/de));
+		id0 = sideId0;
+	} else if(e0 > hi){
+		c0 = cpvadd(v0, cpvmult(d, (hi - e0)/de));
+		id0 = sideId1;
 	}
 	
-	for(int i=0; i<poly2->numVerts; i++){
-		cpVect v = poly2->tVerts[i];
-		if(cpPolyShapeContainsVert(poly1, v))
-			cpContactInit(nextContactPoint(arr, &num), v, n, dist, CP_HASH_PAIR(poly2->shape.hashid, i));
+	if(e1 < lo){
+		c1 = cpvadd(v0, cpvmult(d, (lo - e0)/de));
+		id1 = sideId0;
+	} else if(e1 > hi){
+		c1 = cpvadd(v0, cpvmult(d, (hi - e0)/de));
+		id1 = sideId1;
 	}
 	
-	return (num ? num : findVertsFallback(arr, poly1, poly2, n, dist));
+	int num = 0;
+	
+	cpFloat dist0 = cpvdot(refN, c0) - refD;
+	if(dist0 <= 0.0f) cpContactInit(nextContactPoint(arr, &num), c0, n, dist0, id0);
+	
+	cpFloat dist1 = cpvdot(refN, c1) - refD;
+	if(dist1 <= 0.0f) cpContactInit(nextContactPoint(arr, &num), c1, n, dist1, id1);
+	
+	return num;
+}
+
+// Find the edge of the poly whose normal points the most against n.
+static inline int
+findIncidentEdge(const cpPolyShape *poly, const cpVect n)
+{
+	const cpFloat *nx = poly->tAxesX;
+	const cpFloat *ny = poly->tAxesY;
+	
+	int min_index = 0;
+	cpFloat min = nx[0]*n.x + ny[0]*n.y;
+	
+	for(int i=1; i<poly->numVerts; i++){
+		cpFloat dot = nx[i]*n.x + ny[i]*n.y;
+		if(dot < min){
+			min = dot;
+			min_index = i;
+		}
+	}
+	
+	return min_index;
+}
+
+// Id of a point clipped by the side plane at vertex 'vert' of the reference shape.
+static inline cpHashValue
+clipSideId(const cpShape *ref, int vert, const cpShape *inc, int edge)
+{
+	return CP_HASH_PAIR(CP_HASH_PAIR(ref->hashid, vert), CP_HASH_PAIR(inc->hashid, edge));
+}
+
+// Two point manifold for polys using the face with the least penetration as the reference face.
+// 'edge' is the incident edge of inc, the one whose normal points the most against the reference face's.
+static int
+clipPolys(cpContact *arr, const cpPolyShape *ref, const int face, const cpPolyShape *inc, const int edge, const cpVect n)
+{
+	cpVect refN = ref->tAxes[face].n;
+	int face1 = (face + 1)%ref->numVerts;
+	int edge1 = (edge + 1)%inc->numVerts;
+	const cpShape *refShape = (cpShape *)ref;
+	const cpShape *incShape = (cpShape *)inc;
+	
+	return clipContacts(arr,
+		ref->tVerts[face], ref->tVerts[face1], refN, ref->tAxes[face].d,
+		clipSideId(refShape, face, incShape, edge), clipSideId(refShape, face1, incShape, edge),
+		inc->tVerts[edge], inc->tVerts[edge1],
+		CP_HASH_PAIR(inc->shape.hashid, edge), CP_HASH_PAIR(inc->shape.hashid, edge1),
+		n
+	);
+}
+
+// Which half turn clockwise from r the vector v lies in, 0 for [0, pi) or 1 for [pi, 2pi).
+static inline int
+clockwiseHalf(const cpVect r, const cpVect v)
+{
+	cpFloat y = -cpvcross(r, v);
+	return (y > 0.0f || (y == 0.0f && cpvdot(r, v) > 0.0f) ? 0 : 1);
+}
+
+// Binary search for the last axis of the poly at or before n going clockwise from the first axis.
+// A poly's axes turn clockwise, so they are sorted by that angle.
+// n lies between that axis and the next one, so the vertex they share is the poly's support point for n.
+static inline int
+findAxisBefore(const cpPolyShape *poly, const cpVect n)
+{
+	const cpPolyShapeAxis *axes = poly->tAxes;
+	cpVect r = axes[0].n;
+	int half = clockwiseHalf(r, n);
+	
+	int lo = 0, hi = poly->numVerts - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1)/2;
+		int midHalf = clockwiseHalf(r, axes[mid].n);
+		
+		if(midHalf < half || (midHalf == half && cpvcross(axes[mid].n, n) <= 0.0f)){
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	
+	return lo;
+}
+
+// Index of the poly's vertex that is the furthest along the (non-zero) direction n.
+// The binary search gets within rounding of the answer and hill climbing finishes it off.
+static inline int
+polySupportIndex(const cpPolyShape *poly, const cpVect n)
+{
+	const cpVect *verts = poly->tVerts;
+	const int count = poly->numVerts;
+	
+	int i = (findAxisBefore(poly, n) + 1)%count;
+	cpFloat max = cpvdot(verts[i], n);
+	
+	for(int steps=0; steps<count; steps++){
+		int next = (i + 1)%count;
+		int prev = (i + count - 1)%count;
+		cpFloat dnext = cpvdot(verts[next], n);
+		cpFloat dprev = cpvdot(verts[prev], n);
+		
+		if(dnext > max && dnext >= dprev){
+			i = next;
+			max = dnext;
+		} else if(dprev > max){
+			i = prev;
+			max = dprev;
+		} else {
+			break;
+		}
+	}
+	
+	return i;
+}
+
+// Index of the poly's axis that points the most along n.
+static inline int
+findAlignedAxis(const cpPolyShape *poly, const cpVect n)
+{
+	int i = findAxisBefore(poly, n);
+	int next = (i + 1)%poly->numVerts;
+	return (cpvdot(poly->tAxes[next].n, n) > cpvdot(poly->tAxes[i].n, n) ? next : i);
+}
+
+// Like polyValueOnAxis(), but only looks at the vertex furthest behind the axis.
+static inline cpFloat
+polySupportValueOnAxis(const cpPolyShape *poly, const cpVect n, const cpFloat d)
+{
+	return cpvdot(n, poly->tVerts[polySupportIndex(poly, cpvneg(n))]) - d;
+}
+
+// Support point of the Minkowski difference b - a.
+static inline cpVect
+minkowskiSupport(const cpPolyShape *a, const cpPolyShape *b, const cpVect d)
+{
+	return cpvsub(b->tVerts[polySupportIndex(b, d)], a->tVerts[polySupportIndex(a, cpvneg(d))]);
+}
+
+#define CP_GJK_MAX_ITERATIONS 32
+#define CP_EPA_MAX_POINTS 32
+
+// Look for the origin in the Minkowski difference b - a starting in the direction d.
+// Returns 0 if the polys are separated, 1 if they overlap in which case simplex holds a triangle around the origin,
+// or -1 if the simplex degenerated and the result should be found another way.
+static int
+gjk(const cpPolyShape *a, const cpPolyShape *b, cpVect d, cpVect *simplex)
+{
+	simplex[0] = minkowskiSupport(a, b, d);
+	if(cpvdot(simplex[0], d) < 0.0f) return 0;
+	
+	int count = 1;
+	d = cpvneg(simplex[0]);
+	
+	for(int i=0; i<CP_GJK_MAX_ITERATIONS; i++){
+		if(d.x == 0.0f && d.y == 0.0f) return -1;
+		
+		cpVect w = minkowskiSupport(a, b, d);
+		if(cpvdot(w, d) < 0.0f) return 0;
+		
+		if(count == 1){
+			// Search perpendicular to the line towards the origin.
+			cpVect perp = cpvperp(cpvsub(simplex[0], w));
+			d = (cpvdot(perp, w) > 0.0f ? cpvneg(perp) : perp);
+			simplex[1] = w;
+			count = 2;
+		} else {
+			cpVect ca = cpvsub(simplex[0], w);
+			cpVect cb = cpvsub(simplex[1], w);
+			if(cpvcross(ca, cb) == 0.0f) return -1;
+			
+			// Outward facing normals of the two new edges.
+			cpVect caPerp = cpvperp(ca);
+			if(cpvdot(caPerp, cb) > 0.0f) caPerp = cpvneg(caPerp);
+			cpVect cbPerp = cpvperp(cb);
+			if(cpvdot(cbPerp, ca) > 0.0f) cbPerp = cpvneg(cbPerp);
+			
+			if(cpvdot(caPerp, w) < 0.0f){
+				simplex[1] = w;
+				d = caPerp;
+			} else if(cpvdot(cbPerp, w) < 0.0f){
+				simplex[0] = simplex[1];
+				simplex[1] = w;
+				d = cbPerp;
+			} else {
+				simplex[2] = w;
+				return 1;
+			}
+		}
+	}
+	
+	return -1;
+}
+
+// Outward normal of the edge from v0 to v1 of a clockwise polytope and its distance from the origin.
+static inline cpFloat
+epaEdge(const cpVect v0, const cpVect v1, cpVect *n)
+{
+	cpVect edge = cpvsub(v1, v0);
+	cpFloat lengthsq = cpvlengthsq(edge);
+	if(lengthsq == 0.0f){
+		(*n) = cpvzero;
+		return INFINITY;
+	}
+	
+	(*n) = cpvmult(cpvperp(edge), 1.0f/cpfsqrt(lengthsq));
+	return cpvdot(*n, v0);
+}
+
+// Expand the triangle found by gjk() until its edge closest to the origin lies on the boundary of b - a.
+// Stores the outward normal of that edge in n. Its distance from the origin is the penetration depth.
+// Returns cpFalse if the polytope ran out of room first, in which case n is only approximate.
+static cpBool
+epa(const cpPolyShape *a, const cpPolyShape *b, const cpVect *simplex, cpVect *n)
+{
+	// Wind the polytope clockwise like the polys so cpvperp() gives the outward normals.
+	cpVect verts[CP_EPA_MAX_POINTS] = {simplex[0], simplex[1], simplex[2]};
+	if(cpvcross(cpvsub(simplex[1], simplex[0]), cpvsub(simplex[2], simplex[0])) > 0.0f){
+		verts[1] = simplex[2];
+		verts[2] = simplex[1];
+	}
+	
+	// Edge i goes from verts[i] to verts[i + 1].
+	cpVect normals[CP_EPA_MAX_POINTS];
+	cpFloat dists[CP_EPA_MAX_POINTS];
+	for(int i=0; i<3; i++) dists[i] = epaEdge(verts[i], verts[(i + 1)%3], &normals[i]);
+	
+	for(int count=3;; count++){
+		int mini = 0;
+		for(int i=1; i<count; i++) if(dists[i] < dists[mini]) mini = i;
+		
+		(*n) = normals[mini];
+		cpFloat min = dists[mini];
+		
+		cpVect w = minkowskiSupport(a, b, *n);
+		if(cpvdot(w, *n) - min <= 1e-4f*(1.0f + min)) return cpTrue;
+		if(count == CP_EPA_MAX_POINTS) return cpFalse;
+		
+		// Split the closest edge at w.
+		for(int i=count; i>mini + 1; i--){
+			verts[i] = verts[i - 1];
+			normals[i] = normals[i - 1];
+			dists[i] = dists[i - 1];
+		}
+		
+		verts[mini + 1] = w;
+		dists[mini] = epaEdge(verts[mini], w, &normals[mini]);
+		dists[mini + 1] = epaEdge(w, verts[(mini + 2)%(count + 1)], &normals[mini + 1]);
+	}
+}
+
+// Climb from axis i of axisPoly to the neighboring axis with the least penetration of poly.
+// (*min) holds the penetration of the starting axis and is updated with the final one.
+static inline int
+polyClimbAxis(const cpPolyShape *poly, const cpPolyShape *axisPoly, int i, cpFloat *min)
+{
+	const cpPolyShapeAxis *axes = axisPoly->tAxes;
+	const int count = axisPoly->numVerts;
+	
+	for(int step=1; step>=-1; step-=2){
+		for(int steps=0; steps<count; steps++){
+			int next = (i + count + step)%count;
+			cpFloat dist = polySupportValueOnAxis(poly, axes[next].n, axes[next].d);
+			if(dist <= (*min)) break;
+			
+			i = next;
+			(*min) = dist;
+		}
+	}
+	
+	return i;
+}
+
+// Add the contacts for overlapping polys given the minimum penetration axis of each.
+// The reference face is also the axis most likely to separate the shapes next time.
+// The GJK path always clips since finding every penetrating vertex would defeat its purpose.
+static int
+polyContacts(
+	cpContact *arr, const cpPolyShape *poly1, const cpPolyShape *poly2, cpSeparatingAxis *axis,
+	cpFloat min1, int mini1, cpFloat min2, int mini2, cpBool gjk
+){
+	cpBool clip = (cp_poly_contact_clipping || gjk);
+	
+	cpBool ref1 = (min1 > min2);
+	if(clip){
+		// Keep the cached reference face unless the other poly's face is clearly better.
+		// Flip-flopping between two nearly parallel faces would change the contact ids.
+		cpFloat tolerance = 0.1f*cp_collision_slop;
+		ref1 = (axis->shape == (cpShape *)poly2 ? min1 > min2 + tolerance : min1 + tolerance >= min2);
+	}
+	
+	const cpPolyShape *ref = (ref1 ? poly1 : poly2);
+	const cpPolyShape *inc = (ref1 ? poly2 : poly1);
+	int face = (ref1 ? mini1 : mini2);
+	cpFloat min = (ref1 ? min1 : min2);
+	
+	cacheAxis(axis, (cpShape *)ref, face);
+	cpVect refN = ref->tAxes[face].n;
+	cpVect n = (ref1 ? refN : cpvneg(refN));
+	
+	int num = 0;
+	if(clip){
+		int edge = (gjk ? findAlignedAxis(inc, cpvneg(refN)) : findIncidentEdge(inc, refN));
+		num = clipPolys(arr, ref, face, inc, edge, n);
+	}
+	
+	return (num ? num : findVerts(arr, poly1, poly2, n, min));
+}
+
+// Collide polys with many vertexes without testing every axis of each against every vertex of the other.
+// GJK finds out if they overlap, EPA finds the direction of least penetration and the
+// faces closest to that direction are clipped against each other. Every support point is found in logarithmic time.
+// Returns -1 if the simplex degenerated and the pair should be handled by poly2poly() instead.
+static int
+poly2polyGJK(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
+{
+	cpPolyShape *poly1 = (cpPolyShape *)shape1;
+	cpPolyShape *poly2 = (cpPolyShape *)shape2;
+	
+	// Start searching along the cached axis, flipped to point from poly2 towards poly1.
+	cpVect d;
+	if(axis->shape == shape1){
+		d = cpvneg(poly1->tAxes[cachedAxisIndex(axis, shape1, poly1->numVerts)].n);
+	} else if(axis->shape == shape2){
+		d = poly2->tAxes[cachedAxisIndex(axis, shape2, poly2->numVerts)].n;
+	} else {
+		cpBB bb1 = shape1->bb, bb2 = shape2->bb;
+		d = cpv(bb1.l + bb1.r - bb2.l - bb2.r, bb1.b + bb1.t - bb2.b - bb2.t);
+		if(d.x == 0.0f && d.y == 0.0f) d = cpv(1.0f, 0.0f);
+	}
+	
+	cpVect simplex[3];
+	int result = gjk(poly1, poly2, d, simplex);
+	if(result <= 0) return result;
+	
+	cpVect n;
+	cpBool exact = epa(poly1, poly2, simplex, &n);
+	n = cpvneg(n);
+	
+	int mini1 = findAlignedAxis(poly1, n);
+	cpFloat min1 = polySupportValueOnAxis(poly2, poly1->tAxes[mini1].n, poly1->tAxes[mini1].d);
+	int mini2 = findAlignedAxis(poly2, cpvneg(n));
+	cpFloat min2 = polySupportValueOnAxis(poly1, poly2->tAxes[mini2].n, poly2->tAxes[mini2].d);
+	
+	// The faces of b - a are the faces of the polys, so a converged normal is exactly the best axis of one of them.
+	// The other poly's best axis is only needed for picking the reference face and is somewhere nearby.
+	if(!exact || min1 < min2) mini1 = polyClimbAxis(poly2, poly1, mini1, &min1);
+	if(!exact || min2 <= min1) mini2 = polyClimbAxis(poly1, poly2, mini2, &min2);
+	
+	if(min1 > 0.0f) return cacheAxis(axis, shape1, mini1);
+	if(min2 > 0.0f) return cacheAxis(axis, shape2, mini2);
+	
+	return polyContacts(arr, poly1, poly2, axis, min1, mini1, min2, mini2, cpTrue);
 }
 
 // Collide poly shapes together.
+// The poly that owns the cached axis is tested first, starting with the cached axis.
+// Pairs that are still separated usually exit after projecting onto that single axis.
 static int
-poly2poly(const cpShape *shape1, const cpShape *shape2, cpContact *arr)
+poly2poly(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
 {
 	cpPolyShape *poly1 = (cpPolyShape *)shape1;
 	cpPolyShape *poly2 = (cpPolyShape *)shape2;
 	
-	cpFloat min1;
-	int mini1 = findMSA(poly2, poly1->tAxes, poly1->numVerts, &min1);
-	if(mini1 == -1) return 0;
+	if(poly1->numVerts*poly2->numVerts >= cp_poly_gjk_threshold){
+		int num = poly2polyGJK(shape1, shape2, arr, axis);
+		if(num >= 0) return num;
+	}
+	
+	cpBool flip = (axis->shape == shape2);
+	cpPolyShape *first = (flip ? poly2 : poly1);
+	cpPolyShape *second = (flip ? poly1 : poly2);
+	
+	cpFloat minFirst;
+	int miniFirst = findMSA(second, first, cachedAxisIndex(axis, (cpShape *)first, first->numVerts), &minFirst);
+	if(minFirst > 0.0f) return cacheAxis(axis, (cpShape *)first, miniFirst);
 	
-	cpFloat min2;
-	int mini2 = findMSA(poly1, poly2->tAxes, poly2->numVerts, &min2);
-	if(mini2 == -1) return 0;
+	cpFloat minSecond;
+	int miniSecond = findMSA(first, second, 0, &minSecond);
+	if(minSecond > 0.0f) return cacheAxis(axis, (cpShape *)second, miniSecond);
 	
-	// There is overlap, find the penetrating verts
-	if(min1 > min2)
-		return findVerts(arr, poly1, poly2, poly1->tAxes[mini1].n, min1);
-	else
-		return findVerts(arr, poly1, poly2, cpvneg(poly2->tAxes[mini2].n), min2);
+	return polyContacts(arr, poly1, poly2, axis,
+		(flip ? minSecond : minFirst), (flip ? miniSecond : miniFirst),
+		(flip ? minFirst : minSecond), (flip ? miniFirst : miniSecond),
+		cpFalse
+	);
 }
 
 // Like cpPolyValueOnAxis(), but for segments.
@@ -242,31 +720,111 @@ findPointsBehindSeg(cpContact *arr, int *num, const cpSegmentShape *seg, const c
 	}
 }
 
+// Find the minimum separating axis of the poly's axes for the segment, starting with axis 'first'.
+// Stops at the first separating axis found, in which case (*min_out) is positive.
+static inline int
+segFindMSA(const cpSegmentShape *seg, const cpPolyShape *poly, const int first, cpFloat *min_out)
+{
+	cpPolyShapeAxis *axes = poly->tAxes;
+	
+	int min_index = first;
+	cpFloat min = segValueOnAxis(seg, axes[first].n, axes[first].d);
+	
+	for(int i=0; i<poly->numVerts && min <= 0.0f; i++){
+		if(i == first) continue;
+		
+		cpFloat dist = segValueOnAxis(seg, axes[i].n, axes[i].d);
+		if(dist > min){
+			min = dist;
+			min_index = i;
+		}
+	}
+	
+	(*min_out) = min;
+	return min_index;
+}
+
+// Two point manifold for a segment and a poly.
+// The segment's face is the reference when it penetrates about as little as the poly's best face,
+// the same preference seg2poly() uses. The segment's ends are rounded, so contacts near
+// them are left to the regular contact generation by returning 0.
+static int
+clipSegPoly(
+	cpContact *arr, const cpSegmentShape *seg, const cpPolyShape *poly,
+	const int mini, const cpFloat poly_min, const cpFloat minNorm, const cpFloat minNeg
+){
+	const cpShape *segShape = (cpShape *)seg;
+	const cpShape *polyShape = (cpShape *)poly;
+	
+	if(cpfmax(minNorm, minNeg) >= poly_min - cp_collision_slop){
+		cpVect n = cpvmult(seg->tn, minNorm > minNeg ? 1.0f : -1.0f);
+		int edge = findIncidentEdge(poly, n);
+		int edge1 = (edge + 1)%poly->numVerts;
+		
+		return clipContacts(arr,
+			seg->ta, seg->tb, n, cpvdot(n, seg->ta) + seg->r,
+			clipSideId(segShape, 0, polyShape, edge), clipSideId(segShape, 1, polyShape, edge),
+			poly->tVerts[edge], poly->tVerts[edge1],
+			CP_HASH_PAIR(poly->shape.hashid, edge), CP_HASH_PAIR(poly->shape.hashid, edge1),
+			n
+		);
+	} else {
+		cpVect refN = poly->tAxes[mini].n;
+		int mini1 = (mini + 1)%poly->numVerts;
+		
+		// The incident edge is the side of the segment's rounded body facing the poly.
+		cpVect offset = cpvmult(refN, -seg->r);
+		return clipContacts(arr,
+			poly->tVerts[mini], poly->tVerts[mini1], refN, poly->tAxes[mini].d,
+			clipSideId(polyShape, mini, segShape, 0), clipSideId(polyShape, mini1, segShape, 0),
+			cpvadd(seg->ta, offset), cpvadd(seg->tb, offset),
+			CP_HASH_PAIR(seg->shape.hashid, 0), CP_HASH_PAIR(seg->shape.hashid, 1),
+			cpvneg(refN)
+		);
+	}
+}
+
 // This one is complicated and gross. Just don't go there...
 // TODO: Comment me!
 static int
-seg2poly(const cpShape *shape1, const cpShape *shape2, cpContact *arr)
+seg2poly(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
 {
 	cpSegmentShape *seg = (cpSegmentShape *)shape1;
 	cpPolyShape *poly = (cpPolyShape *)shape2;
 	cpPolyShapeAxis *axes = poly->tAxes;
 	
+	// Start with the poly's axes if one of them was cached, otherwise with the segment's normals.
+	// The segment's axes are cached with index 0 for the normal and 1 for the negated normal.
+	cpBool polyFirst = (axis->shape == shape2);
+	
+	int mini = 0;
+	cpFloat poly_min = 0.0f;
+	if(polyFirst){
+		mini = segFindMSA(seg, poly, cachedAxisIndex(axis, shape2, poly->numVerts), &poly_min);
+		if(poly_min > 0.0f) return cacheAxis(axis, shape2, mini);
+	}
+	
 	cpFloat segD = cpvdot(seg->tn, seg->ta);
 	cpFloat minNorm = cpPolyShapeValueOnAxis(poly, seg->tn, segD) - seg->r;
+	if(minNorm > 0.0f) return cacheAxis(axis, shape1, 0);
 	cpFloat minNeg = cpPolyShapeValueOnAxis(poly, cpvneg(seg->tn), -segD) - seg->r;
-	if(minNeg > 0.0f || minNorm > 0.0f) return 0;
+	if(minNeg > 0.0f) return cacheAxis(axis, shape1, 1);
 	
-	int mini = 0;
-	cpFloat poly_min = segValueOnAxis(seg, axes->n, axes->d);
-	if(poly_min > 0.0f) return 0;
-	for(int i=0; i<poly->numVerts; i++){
-		cpFloat dist = segValueOnAxis(seg, axes[i].n, axes[i].d);
-		if(dist > 0.0f){
-			return 0;
-		} else if(dist > poly_min){
-			poly_min = dist;
-			mini = i;
-		}
+	if(!polyFirst){
+		mini = segFindMSA(seg, poly, 0, &poly_min);
+		if(poly_min > 0.0f) return cacheAxis(axis, shape2, mini);
+	}
+	
+	// Cache the axis with the least penetration.
+	if(poly_min >= minNorm && poly_min >= minNeg){
+		cacheAxis(axis, shape2, mini);
+	} else {
+		cacheAxis(axis, shape1, (minNorm >= minNeg ? 0 : 1));
+	}
+	
+	if(cp_poly_contact_clipping){
+		int num = clipSegPoly(arr, seg, poly, mini, poly_min, minNorm, minNeg);
+		if(num) return num;
 	}
 	
 	int num = 0;
@@ -314,7 +872,7 @@ seg2poly(const cpShape *shape1, const cpShape *shape2, cpContact *arr)
 // This one is less gross, but still gross.
 // TODO: Comment me!
 static int
-circle2poly(const cpShape *shape1, const cpShape *shape2, cpContact *con)
+circle2poly(const cpShape *shape1, const cpShape *shape2, cpContact *con, cpSeparatingAxis *axis)
 {
 	cpCircleShape *circ = (cpCircleShape *)shape1;
 	cpPolyShape *poly = (cpPolyShape *)shape2;
@@ -356,6 +914,353 @@ circle2poly(const cpShape *shape1, const cpShape *shape2, cpContact *con)
 	}
 }
 
+// Tolerance for the direction of contact normals in chainNormalValid() and tileNormalValid().
+#define CP_ADJACENCY_NORMAL_EPSILON 1e-3f
+
+// Chains are collided a segment at a time with the segment collision functions.
+// Only the fields used by them are set.
+static inline void
+chainSegmentInit(cpSegmentShape *seg, const cpChainShape *chain, const int i)
+{
+	seg->shape.hashid = chain->shape.hashid;
+	seg->ta = chain->tVerts[i];
+	seg->tb = chain->tVerts[i + 1];
+	seg->tn = chain->tNormals[i];
+	seg->r = chain->r;
+}
+
+// Check if a contact on segment i with the normal m (pointing away from the chain) should be kept.
+// Contacts leaning towards a joint are only kept if the joint is convex on that side and m is between the
+// normals of the two segments. Otherwise the neighboring segment's face is responsible for the contact.
+static cpBool
+chainNormalValid(const cpChainShape *chain, const int i, const cpVect m)
+{
+	cpVect n = chain->tNormals[i];
+	cpVect t = cpvrperp(n);
+	cpFloat s = (cpvdot(m, n) >= 0.0f ? 1.0f : -1.0f);
+	cpFloat dt = cpvdot(m, t);
+	
+	if(dt > CP_ADJACENCY_NORMAL_EPSILON){
+		int next = cpChainShapeNextSegment(chain, i);
+		if(next < 0) return cpTrue;
+		
+		cpVect tNext = cpvrperp(chain->tNormals[next]);
+		return (s*cpvcross(t, tNext) < 0.0f && cpvdot(m, tNext) <= CP_ADJACENCY_NORMAL_EPSILON);
+	} else if(dt < -CP_ADJACENCY_NORMAL_EPSILON){
+		int prev = cpChainShapePrevSegment(chain, i);
+		if(prev < 0) return cpTrue;
+		
+		cpVect tPrev = cpvrperp(chain->tNormals[prev]);
+		return (s*cpvcross(tPrev, t) < 0.0f && cpvdot(m, tPrev) >= -CP_ADJACENCY_NORMAL_EPSILON);
+	} else {
+		return cpTrue;
+	}
+}
+
+// Add the contacts of a piece of a chain or tile map to its contacts, mixing the id of the piece into their ids.
+// Contacts within tolerance of an existing one with the same normal are merged into it, keeping the deeper one.
+// When the buffer is full, the shallowest contact is replaced.
+static int
+mergeContacts(cpContact *arr, int num, cpContact *cons, const int count, const int id, const cpFloat tolerance)
+{
+	for(int j=0; j<count; j++){
+		cpContact *con = &cons[j];
+		con->hash = CP_HASH_PAIR(con->hash, id);
+		
+		int k = 0;
+		while(k<num && !(cpvnear(arr[k].p, con->p, tolerance) && cpvdot(arr[k].n, con->n) > 1.0f - CP_ADJACENCY_NORMAL_EPSILON)) k++;
+		
+		if(k < num){
+			if(con->dist < arr[k].dist) arr[k] = (*con);
+		} else if(num < CP_MAX_CONTACTS_PER_ARBITER){
+			arr[num++] = (*con);
+		} else {
+			int shallowest = 0;
+			for(int k=1; k<num; k++) if(arr[k].dist > arr[shallowest].dist) shallowest = k;
+			if(con->dist < arr[shallowest].dist) arr[shallowest] = (*con);
+		}
+	}
+	
+	return num;
+}
+
+typedef struct chainCollisionContext {
+	const cpShape *shape;
+	cpContact *arr;
+	int num;
+} chainCollisionContext;
+
+static void
+circle2chainSegment(cpChainShape *chain, int i, chainCollisionContext *context)
+{
+	cpSegmentShape seg;
+	chainSegmentInit(&seg, chain, i);
+	
+	cpContact con;
+	cpSeparatingAxis axis = {NULL, 0};
+	if(circle2segment(context->shape, (cpShape *)&seg, &con, &axis) && chainNormalValid(chain, i, cpvneg(con.n))){
+		context->num = mergeContacts(context->arr, context->num, &con, 1, i, 0.0f);
+	}
+}
+
+// Collide circles to the segments of a chain under their bbox.
+static int
+circle2chain(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
+{
+	chainCollisionContext context = {shape1, arr, 0};
+	cpChainShapeQuery((cpChainShape *)shape2, shape1->bb, (cpChainShapeSegmentFunc)circle2chainSegment, &context);
+	
+	return context.num;
+}
+
+static void
+poly2chainSegment(cpChainShape *chain, int i, chainCollisionContext *context)
+{
+	cpSegmentShape seg;
+	chainSegmentInit(&seg, chain, i);
+	const cpPolyShape *poly = (cpPolyShape *)context->shape;
+	
+	cpContact cons[CP_MAX_CONTACTS_PER_ARBITER];
+	cpSeparatingAxis axis = {NULL, 0};
+	int count = seg2poly((cpShape *)&seg, context->shape, cons, &axis);
+	
+	// If any of the contacts lean towards a joint they shouldn't, only use the poly's vertexes behind the segment's face.
+	for(int j=0; j<count; j++){
+		if(!chainNormalValid(chain, i, cons[j].n)){
+			cpFloat segD = cpvdot(seg.tn, seg.ta);
+			cpFloat minNorm = cpPolyShapeValueOnAxis(poly, seg.tn, segD) - seg.r;
+			cpFloat minNeg = cpPolyShapeValueOnAxis(poly, cpvneg(seg.tn), -segD) - seg.r;
+			
+			count = 0;
+			if(minNorm > minNeg){
+				findPointsBehindSeg(cons, &count, &seg, poly, minNorm, 1.0f);
+			} else {
+				findPointsBehindSeg(cons, &count, &seg, poly, minNeg, -1.0f);
+			}
+			
+			break;
+		}
+	}
+	
+	// seg2poly() makes normals pointing from the segment to the poly.
+	for(int j=0; j<count; j++) cons[j].n = cpvneg(cons[j].n);
+	context->num = mergeContacts(context->arr, context->num, cons, count, i, 0.0f);
+}
+
+// Collide polys to the segments of a chain under their bbox.
+static int
+poly2chain(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
+{
+	chainCollisionContext context = {shape1, arr, 0};
+	cpChainShapeQuery((cpChainShape *)shape2, shape1->bb, (cpChainShapeSegmentFunc)poly2chainSegment, &context);
+	
+	return context.num;
+}
+
+// Sides of a tile in grid space in the same order as the faces of a box made by cpBoxShapeInit().
+// Face i goes from tileCorners[i] to tileCorners[i + 1], and tileNormals[i] is also the offset of the neighboring tile.
+static const cpVect tileCorners[] = {{0.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 1.0f}, {1.0f, 0.0f}};
+static const cpVect tileNormals[] = {{-1.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 0.0f}, {0.0f, -1.0f}};
+
+#define CP_TILE_BOX_SOA_LENGTH ((4 + CP_POLY_SOA_WIDTH - 1)/CP_POLY_SOA_WIDTH*CP_POLY_SOA_WIDTH)
+
+// A tile as a poly so it can be collided with the poly collision functions.
+// Only the fields used by them are set.
+typedef struct tileBox {
+	cpPolyShape poly;
+	cpVect tVerts[4];
+	cpPolyShapeAxis tAxes[4];
+	cpFloat components[5*CP_TILE_BOX_SOA_LENGTH];
+} tileBox;
+
+static void
+tileBoxInit(tileBox *box, const cpTileMapShape *map, const int x, const int y)
+{
+	cpPolyShape *poly = &box->poly;
+	poly->shape.hashid = map->shape.hashid;
+	poly->numVerts = 4;
+	poly->tVerts = box->tVerts;
+	poly->tAxes = box->tAxes;
+	
+	int length = CP_TILE_BOX_SOA_LENGTH;
+	poly->tVertsX = box->components;
+	poly->tVertsY = box->components + 1*length;
+	poly->tAxesX = box->components + 2*length;
+	poly->tAxesY = box->components + 3*length;
+	poly->tAxesD = box->components + 4*length;
+	
+	for(int i=0; i<length; i++){
+		int j = (i < 4 ? i : 0);
+		cpVect v = cpTileMapShapeWorldPoint(map, cpvadd(cpv(x, y), tileCorners[j]));
+		cpVect n = cpvrotate(tileNormals[j], map->tRot);
+		cpFloat d = cpvdot(n, v);
+		
+		if(i < 4){
+			box->tVerts[i] = v;
+			box->tAxes[i].n = n;
+			box->tAxes[i].d = d;
+		}
+		
+		poly->tVertsX[i] = v.x;
+		poly->tVertsY[i] = v.y;
+		poly->tAxesX[i] = n.x;
+		poly->tAxesY[i] = n.y;
+		poly->tAxesD[i] = d;
+	}
+	
+	cpVect *v = box->tVerts;
+	poly->shape.bb = cpBBNew(
+		cpfmin(cpfmin(v[0].x, v[1].x), cpfmin(v[2].x, v[3].x)), cpfmin(cpfmin(v[0].y, v[1].y), cpfmin(v[2].y, v[3].y)),
+		cpfmax(cpfmax(v[0].x, v[1].x), cpfmax(v[2].x, v[3].x)), cpfmax(cpfmax(v[0].y, v[1].y), cpfmax(v[2].y, v[3].y))
+	);
+}
+
+static inline cpBool
+tileFaceExposed(const cpTileMapShape *map, const int x, const int y, const int face)
+{
+	return !cpTileMapShapeIsSolid(map, x + (int)tileNormals[face].x, y + (int)tileNormals[face].y);
+}
+
+// Check if a contact on tile (x, y) with the normal m (pointing away from the tile in grid space) should be kept.
+// Normals can only lean towards the sides of the tile that aren't covered by a neighboring solid tile.
+// Otherwise the neighbor's face is responsible for the contact.
+static cpBool
+tileNormalValid(const cpTileMapShape *map, const int x, const int y, const cpVect m)
+{
+	cpFloat e = CP_ADJACENCY_NORMAL_EPSILON;
+	return !(
+		(m.x >  e && cpTileMapShapeIsSolid(map, x + 1, y)) ||
+		(m.x < -e && cpTileMapShapeIsSolid(map, x - 1, y)) ||
+		(m.y >  e && cpTileMapShapeIsSolid(map, x, y + 1)) ||
+		(m.y < -e && cpTileMapShapeIsSolid(map, x, y - 1))
+	);
+}
+
+typedef struct tileMapCollisionContext {
+	const cpShape *shape;
+	// Position of circles in grid space.
+	cpVect p;
+	
+	cpContact *arr;
+	int num;
+} tileMapCollisionContext;
+
+// Contacts closer than this fraction of a tile are merged, which removes the copies made by neighboring tiles.
+#define CP_TILE_MERGE_TOLERANCE 1e-4f
+
+static void
+circle2tileMapTile(cpTileMapShape *map, int x, int y, tileMapCollisionContext *context)
+{
+	cpCircleShape *circ = (cpCircleShape *)context->shape;
+	cpVect c = context->p;
+	cpFloat r = circ->r/map->cellSize;
+	
+	cpVect q = cpv(cpfclamp(c.x, x, x + 1), cpfclamp(c.y, y, y + 1));
+	cpVect delta = cpvsub(c, q);
+	cpFloat distsq = cpvlengthsq(delta);
+	if(distsq >= r*r) return;
+	
+	cpVect m = cpvzero;
+	cpFloat dist = -INFINITY;
+	if(distsq > 0.0f){
+		dist = cpfsqrt(distsq);
+		m = cpvmult(delta, 1.0f/dist);
+		if(!tileNormalValid(map, x, y, m)) return;
+	} else {
+		// The center is inside of the tile, push it out of the closest exposed face.
+		for(int i=0; i<4; i++){
+			if(!tileFaceExposed(map, x, y, i)) continue;
+			
+			cpVect n = tileNormals[i];
+			cpFloat faceDist = cpvdot(n, cpvsub(c, cpvadd(cpv(x, y), tileCorners[i])));
+			if(faceDist > dist){
+				dist = faceDist;
+				m = n;
+			}
+		}
+		
+		if(dist == -INFINITY) return;
+	}
+	
+	cpVect n = cpvneg(cpvrotate(m, map->tRot));
+	cpFloat depth = (dist - r)*map->cellSize;
+	
+	cpContact con;
+	cpContactInit(&con, cpvadd(circ->tc, cpvmult(n, circ->r + depth*0.5f)), n, depth, 0);
+	context->num = mergeContacts(context->arr, context->num, &con, 1, x + y*map->width, CP_TILE_MERGE_TOLERANCE*map->cellSize);
+}
+
+// Collide circles to the solid tiles under their bbox.
+static int
+circle2tileMap(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
+{
+	cpTileMapShape *map = (cpTileMapShape *)shape2;
+	
+	tileMapCollisionContext context = {shape1, cpTileMapShapeGridPoint(map, ((cpCircleShape *)shape1)->tc), arr, 0};
+	cpTileMapShapeQuery(map, shape1->bb, (cpTileMapShapeTileFunc)circle2tileMapTile, &context);
+	
+	return context.num;
+}
+
+static void
+poly2tileMapTile(cpTileMapShape *map, int x, int y, tileMapCollisionContext *context)
+{
+	const cpPolyShape *poly = (cpPolyShape *)context->shape;
+	
+	tileBox box;
+	tileBoxInit(&box, map, x, y);
+	
+	cpContact cons[CP_MAX_CONTACTS_PER_ARBITER];
+	cpSeparatingAxis axis = {NULL, 0};
+	int count = poly2poly(context->shape, (cpShape *)&box, cons, &axis);
+	
+	// If any of the contacts lean towards a neighboring solid tile,
+	// only use the poly's vertexes behind the exposed face it penetrates the least.
+	for(int j=0; j<count; j++){
+		if(!tileNormalValid(map, x, y, cpvunrotate(cpvneg(cons[j].n), map->tRot))){
+			int face = -1;
+			cpFloat min = -INFINITY;
+			for(int i=0; i<4; i++){
+				if(!tileFaceExposed(map, x, y, i)) continue;
+				
+				cpFloat dist = cpPolyShapeValueOnAxis(poly, box.tAxes[i].n, box.tAxes[i].d);
+				if(dist > min){
+					min = dist;
+					face = i;
+				}
+			}
+			
+			count = 0;
+			if(face >= 0){
+				cpSegmentShape seg;
+				seg.shape.hashid = map->shape.hashid;
+				seg.ta = box.tVerts[face];
+				seg.tb = box.tVerts[(face + 1)%4];
+				seg.tn = box.tAxes[face].n;
+				seg.r = 0.0f;
+				
+				// findPointsBehindSeg() makes normals pointing from the tile to the poly.
+				findPointsBehindSeg(cons, &count, &seg, poly, min, 1.0f);
+				for(int k=0; k<count; k++) cons[k].n = cpvneg(cons[k].n);
+			}
+			
+			break;
+		}
+	}
+	
+	context->num = mergeContacts(context->arr, context->num, cons, count, x + y*map->width, CP_TILE_MERGE_TOLERANCE*map->cellSize);
+}
+
+// Collide polys to the solid tiles under their bbox.
+static int
+poly2tileMap(const cpShape *shape1, const cpShape *shape2, cpContact *arr, cpSeparatingAxis *axis)
+{
+	tileMapCollisionContext context = {shape1, cpvzero, arr, 0};
+	cpTileMapShapeQuery((cpTileMapShape *)shape2, shape1->bb, (cpTileMapShapeTileFunc)poly2tileMapTile, &context);
+	
+	return context.num;
+}
+
 //static const collisionFunc builtinCollisionFuncs[9] = {
 //	circle2circle,
 //	NULL,
@@ -395,6 +1300,10 @@ extern "C" {
 		addColFunc(CP_SEGMENT_SHAPE, CP_POLY_SHAPE,    seg2poly);
 		addColFunc(CP_CIRCLE_SHAPE,  CP_POLY_SHAPE,    circle2poly);
 		addColFunc(CP_POLY_SHAPE,    CP_POLY_SHAPE,    poly2poly);
+		addColFunc(CP_CIRCLE_SHAPE,  CP_CHAIN_SHAPE,   circle2chain);
+		addColFunc(CP_POLY_SHAPE,    CP_CHAIN_SHAPE,   poly2chain);
+		addColFunc(CP_CIRCLE_SHAPE,  CP_TILE_MAP_SHAPE, circle2tileMap);
+		addColFunc(CP_POLY_SHAPE,    CP_TILE_MAP_SHAPE, poly2tileMap);
 	}	
 #ifdef __cplusplus
 }
@@ -402,10 +1311,299 @@ extern "C" {
 
 int
 cpCollideShapes(const cpShape *a, const cpShape *b, cpContact *arr)
+{
+	cpSeparatingAxis axis = {NULL, 0};
+	return cpCollideShapesWithAxis(a, b, arr, &axis);
+}
+
+int
+cpCollideShapesWithAxis(const cpShape *a, const cpShape *b, cpContact *arr, cpSeparatingAxis *axis)
 {
 	// Their shape types must be in order.
 	cpAssert(a->klass->type <= b->klass->type, "Collision shapes passed to cpCollideShapes() are not sorted.");
 	
 	collisionFunc cfunc = colfuncs[a->klass->type + b->klass->type*CP_NUM_SHAPES];
-	return (cfunc) ? cfunc(a, b, arr) : 0;
+	return (cfunc) ? cfunc(a, b, arr, axis) : 0;
+}
+
+// Number of circle pairs tested at once by circle2circleBatch().
+#define CP_CIRCLE_BATCH_WIDTH 8
+
+// Collide circle pairs a block at a time.
+// The overlap tests are branch free over component arrays so the compiler can vectorize them.
+// Only the overlapping pairs go through circle2circleQuery() to make their contacts.
+static void
+circle2circleBatch(const cpShape **a, const cpShape **b, int count, cpContact *arr, int *numContacts)
+{
+	for(int block=0; block<count; block+=CP_CIRCLE_BATCH_WIDTH){
+		int width = (count - block < CP_CIRCLE_BATCH_WIDTH ? count - block : CP_CIRCLE_BATCH_WIDTH);
+		
+		cpFloat dx[CP_CIRCLE_BATCH_WIDTH] = {0}, dy[CP_CIRCLE_BATCH_WIDTH] = {0}, r[CP_CIRCLE_BATCH_WIDTH] = {0};
+		for(int k=0; k<width; k++){
+			cpCircleShape *circ1 = (cpCircleShape *)a[block + k];
+			cpCircleShape *circ2 = (cpCircleShape *)b[block + k];
+			dx[k] = circ2->tc.x - circ1->tc.x;
+			dy[k] = circ2->tc.y - circ1->tc.y;
+			r[k] = circ1->r + circ2->r;
+		}
+		
+		int hit[CP_CIRCLE_BATCH_WIDTH];
+		for(int k=0; k<CP_CIRCLE_BATCH_WIDTH; k++) hit[k] = (dx[k]*dx[k] + dy[k]*dy[k] < r[k]*r[k]);
+		
+		for(int k=0; k<width; k++){
+			int i = block + k;
+			if(hit[k]){
+				cpCircleShape *circ1 = (cpCircleShape *)a[i];
+				cpCircleShape *circ2 = (cpCircleShape *)b[i];
+				numContacts[i] = circle2circleQuery(circ1->tc, circ2->tc, circ1->r, circ2->r, arr + i*CP_MAX_CONTACTS_PER_ARBITER);
+			} else {
+				numContacts[i] = 0;
+			}
+		}
+	}
+}
+
+void
+cpCollideShapesBatch(const cpShape **a, const cpShape **b, cpSeparatingAxis *axes, int count, cpContact *arr, int *numContacts)
+{
+	if(!count) return;
+	
+	cpShapeType ta = a[0]->klass->type;
+	cpShapeType tb = b[0]->klass->type;
+	cpAssert(ta <= tb, "Collision shapes passed to cpCollideShapesBatch() are not sorted.");
+	
+	if(ta == CP_CIRCLE_SHAPE && tb == CP_CIRCLE_SHAPE){
+		circle2circleBatch(a, b, count, arr, numContacts);
+	} else {
+		collisionFunc cfunc = colfuncs[ta + tb*CP_NUM_SHAPES];
+		for(int i=0; i<count; i++){
+			numContacts[i] = (cfunc ? cfunc(a[i], b[i], arr + i*CP_MAX_CONTACTS_PER_ARBITER, &axes[i]) : 0);
+		}
+	}
+}
+
+// A shape as a convex core and a rounding radius.
+// Circles are a single point, segments are two points and polys don't have a radius.
+typedef struct castCore {
+	int count;
+	cpVect verts[2];
+	const cpVect *v;
+	cpFloat r;
+} castCore;
+
+static void
+castCoreInit(castCore *core, const cpShape *shape)
+{
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: {
+			cpCircleShape *circ = (cpCircleShape *)shape;
+			core->count = 1;
+			core->verts[0] = circ->tc;
+			core->v = core->verts;
+			core->r = circ->r;
+		} break;
+		case CP_SEGMENT_SHAPE: {
+			cpSegmentShape *seg = (cpSegmentShape *)shape;
+			core->count = 2;
+			core->verts[0] = seg->ta;
+			core->verts[1] = seg->tb;
+			core->v = core->verts;
+			core->r = seg->r;
+		} break;
+		case CP_POLY_SHAPE: {
+			cpPolyShape *poly = (cpPolyShape *)shape;
+			core->count = poly->numVerts;
+			core->v = poly->tVerts;
+			core->r = 0.0f;
+		} break;
+		default:
+			cpAssert(cpFalse, "Shape type not supported by cpCastShapes().");
+			
+			// An empty core that can't be hit when assertions are disabled.
+			core->count = 0;
+			core->v = NULL;
+			core->r = 0.0f;
+			break;
+	}
+}
+
+// Cast the point o along d against a circle.
+static void
+castPointCircle(const cpVect o, const cpVect d, const cpVect c, const cpFloat r, cpFloat *t_out, cpVect *n_out)
+{
+	cpVect delta = cpvsub(o, c);
+	
+	cpFloat qa = cpvdot(d, d);
+	cpFloat qb = cpvdot(delta, d);
+	cpFloat qc = cpvdot(delta, delta) - r*r;
+	
+	// Only look for hits when starting outside and moving inwards.
+	if(qc < 0.0f || qb >= 0.0f) return;
+	
+	cpFloat det = qb*qb - qa*qc;
+	if(det < 0.0f) return;
+	
+	cpFloat t = (-qb - cpfsqrt(det))/qa;
+	if(t < *t_out){
+		(*t_out) = t;
+		(*n_out) = cpvnormalize(cpvadd(delta, cpvmult(d, t)));
+	}
+}
+
+// Cast the point o along d against the segment a->b rounded by r.
+static void
+castPointCapsule(const cpVect o, const cpVect d, const cpVect a, const cpVect b, const cpFloat r, cpFloat *t_out, cpVect *n_out)
+{
+	cpVect delta = cpvsub(b, a);
+	cpFloat length = cpvlength(delta);
+	
+	if(length){
+		cpVect tangent = cpvmult(delta, 1.0f/length);
+		cpVect n = cpvperp(tangent);
+		
+		// Use the side of the segment that the point starts on.
+		cpFloat dist = cpvdot(cpvsub(o, a), n);
+		if(dist < 0.0f){
+			n = cpvneg(n);
+			dist = -dist;
+		}
+		
+		cpFloat dn = cpvdot(d, n);
+		if(dist >= r && dn < 0.0f){
+			cpFloat t = (r - dist)/dn;
+			cpFloat s = cpvdot(cpvsub(cpvadd(o, cpvmult(d, t)), a), tangent);
+			
+			if(t < *t_out && 0.0f <= s && s <= length){
+				(*t_out) = t;
+				(*n_out) = n;
+				return; // don't continue on and check endcaps
+			}
+		}
+	}
+	
+	castPointCircle(o, d, a, r, t_out, n_out);
+	castPointCircle(o, d, b, r, t_out, n_out);
+}
+
+// Cast each vertex of 'a' along d against the rounded core of 'b'.
+// Returns cpTrue if the hit was improved.
+static cpBool
+castCoreVerts(const castCore *a, const castCore *b, const cpVect d, const cpFloat r, cpFloat *t_out, cpVect *n_out)
+{
+	cpFloat t = *t_out;
+	
+	for(int i=0; i<a->count; i++){
+		cpVect o = a->v[i];
+		
+		if(b->count == 1){
+			castPointCircle(o, d, b->v[0], r, t_out, n_out);
+		} else if(b->count == 2){
+			castPointCapsule(o, d, b->v[0], b->v[1], r, t_out, n_out);
+		} else {
+			for(int j=0; j<b->count; j++) castPointCapsule(o, d, b->v[j], b->v[(j+1)%b->count], r, t_out, n_out);
+		}
+	}
+	
+	return (*t_out < t);
+}
+
+// Sweep core a along d against core b.
+static cpFloat
+castCores(const castCore *a, const castCore *b, const cpVect d, const cpFloat t_max, cpVect *n)
+{
+	cpFloat r = a->r + b->r;
+	
+	// The first contact of two convex cores is always between a vertex of one and the rounded
+	// core of the other. Cast a's verts forwards against b, then b's verts backwards against a.
+	cpFloat t = t_max;
+	castCoreVerts(a, b, d, r, &t, n);
+	
+	cpVect n2;
+	if(castCoreVerts(b, a, cpvneg(d), r, &t, &n2)) (*n) = cpvneg(n2);
+	
+	return t;
+}
+
+typedef struct castContext {
+	const castCore *core;
+	cpVect d;
+	cpFloat t;
+	cpVect n;
+} castContext;
+
+static void
+castChainSegment(cpChainShape *chain, int i, castContext *context)
+{
+	castCore seg;
+	seg.count = 2;
+	seg.verts[0] = chain->tVerts[i];
+	seg.verts[1] = chain->tVerts[i + 1];
+	seg.v = seg.verts;
+	seg.r = chain->r;
+	
+	context->t = castCores(context->core, &seg, context->d, context->t, &context->n);
+}
+
+static void
+castTileMapTile(cpTileMapShape *map, int x, int y, castContext *context)
+{
+	// Tiles surrounded by solid tiles can't be the first thing hit.
+	if(!(tileFaceExposed(map, x, y, 0) || tileFaceExposed(map, x, y, 1) || tileFaceExposed(map, x, y, 2) || tileFaceExposed(map, x, y, 3))) return;
+	
+	tileBox box;
+	tileBoxInit(&box, map, x, y);
+	
+	castCore tile;
+	tile.count = 4;
+	tile.v = box.tVerts;
+	tile.r = 0.0f;
+	
+	context->t = castCores(context->core, &tile, context->d, context->t, &context->n);
+}
+
+// Sweep shape a against the pieces of a chain or tile map under its swept bbox.
+static cpFloat
+castPieces(const cpShape *a, const cpShape *b, const cpVect d, const cpFloat t_max, cpVect *n)
+{
+	castCore core;
+	castCoreInit(&core, a);
+	
+	cpBB bb = a->bb;
+	cpVect delta = cpvmult(d, t_max);
+	bb = cpBBmerge(bb, cpBBNew(bb.l + delta.x, bb.b + delta.y, bb.r + delta.x, bb.t + delta.y));
+	
+	castContext context = {&core, d, t_max, cpvzero};
+	if(b->klass->type == CP_CHAIN_SHAPE){
+		cpChainShapeQuery((cpChainShape *)b, bb, (cpChainShapeSegmentFunc)castChainSegment, &context);
+	} else {
+		cpTileMapShapeQuery((cpTileMapShape *)b, bb, (cpTileMapShapeTileFunc)castTileMapTile, &context);
+	}
+	
+	if(context.t < t_max) (*n) = context.n;
+	return context.t;
+}
+
+static inline cpBool castHasPieces(const cpShapeType type){return (type == CP_CHAIN_SHAPE || type == CP_TILE_MAP_SHAPE);}
+
+cpFloat
+cpCastShapes(const cpShape *a, const cpShape *b, cpVect d, cpFloat t_max, cpVect *n)
+{
+	// Only cast against shapes that could collide.
+	cpShapeType ta = a->klass->type, tb = b->klass->type;
+	if(!(ta <= tb ? colfuncs[ta + tb*CP_NUM_SHAPES] : colfuncs[tb + ta*CP_NUM_SHAPES])) return t_max;
+	
+	// Chains and tile maps are swept a piece at a time.
+	// Sweeping one of them is the same as sweeping the other shape backwards.
+	if(castHasPieces(tb)) return castPieces(a, b, d, t_max, n);
+	if(castHasPieces(ta)){
+		cpFloat t = castPieces(b, a, cpvneg(d), t_max, n);
+		if(t < t_max) (*n) = cpvneg(*n);
+		return t;
+	}
+	
+	castCore coreA, coreB;
+	castCoreInit(&coreA, a);
+	castCoreInit(&coreB, b);
+	
+	return castCores(&coreA, &coreB, d, t_max, n);
 }
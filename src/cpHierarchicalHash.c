@@ -0,0 +1,358 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "chipmunk_private.h"
+
+// Tracks which level of the hierarchy an object is stored in.
+typedef struct Entry Entry;
+struct Entry {
+	void *obj;
+	cpHashValue hashid;
+	int level;
+	
+	// Links recycled entries together.
+	Entry *next;
+};
+
+struct cpHierarchicalHash {
+	// Spatial index "superclass". Must be the first member.
+	cpSpatialIndex spatialIndex;
+	
+	// One spatial hash per level. The cells of each level are
+	// twice the size of the cells of the level below it.
+	int numLevels;
+	cpFloat celldim;
+	cpSpaceHash **levels;
+	
+	// Set of the entries, used to look up the level for an object.
+	cpHashSet *entries;
+	
+	// Recycled entries and the buffers to free on destruction.
+	Entry *pooledEntries;
+	cpArray *allocatedBuffers;
+};
+
+static inline const cpSpatialIndexClass *Klass(void);
+
+#pragma mark Entry Functions
+
+static Entry *
+EntryFromPool(cpHierarchicalHash *hhash)
+{
+	Entry *entry = hhash->pooledEntries;
+	
+	if(entry){
+		hhash->pooledEntries = entry->next;
+		return entry;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Entry);
+		cpAssert(count, "Buffer size is too small.");
+		
+		Entry *buffer = (Entry *)cpmalloc(CP_BUFFER_BYTES);
+		cpArrayPush(hhash->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++){
+			buffer[i].next = hhash->pooledEntries;
+			hhash->pooledEntries = buffer + i;
+		}
+		
+		return buffer;
+	}
+}
+
+static inline void
+EntryRecycle(cpHierarchicalHash *hhash, Entry *entry)
+{
+	entry->next = hhash->pooledEntries;
+	hhash->pooledEntries = entry;
+}
+
+// Equality function for the entry set.
+static cpBool entrySetEql(void *obj, Entry *entry){return (obj == entry->obj);}
+
+// Transformation function for the entry set.
+static void *
+entrySetTrans(void *obj, cpHierarchicalHash *hhash)
+{
+	Entry *entry = EntryFromPool(hhash);
+	
+	entry->obj = obj;
+	entry->level = -1;
+	
+	return entry;
+}
+
+// Find the finest level where the bbox spans at most a couple of cells.
+// Objects too large for every level are put in the coarsest one.
+static inline int
+LevelForBB(cpHierarchicalHash *hhash, cpBB bb)
+{
+	cpFloat size = cpfmax(bb.r - bb.l, bb.t - bb.b);
+	cpFloat dim = hhash->celldim;
+	
+	int level = 0;
+	for(int top = hhash->numLevels - 1; level < top && size > dim; level++) dim *= 2.0f;
+	
+	return level;
+}
+
+// Move an entry to the level that matches its current bbox.
+// Returns the bbox so callers don't need to fetch it again.
+static cpBB
+EntryUpdateLevel(cpHierarchicalHash *hhash, Entry *entry)
+{
+	cpBB bb = hhash->spatialIndex.bbfunc(entry->obj);
+	int level = LevelForBB(hhash, bb);
+	
+	if(level != entry->level){
+		if(entry->level >= 0) cpSpaceHashRemove(hhash->levels[entry->level], entry->obj, entry->hashid);
+		cpSpaceHashInsert(hhash->levels[level], entry->obj, entry->hashid, bb);
+		entry->level = level;
+	}
+	
+	return bb;
+}
+
+#pragma mark Memory Management Functions
+
+cpHierarchicalHash *
+cpHierarchicalHashAlloc(void)
+{
+	return (cpHierarchicalHash *)cpcalloc(1, sizeof(cpHierarchicalHash));
+}
+
+cpSpatialIndex *
+cpHierarchicalHashInit(cpHierarchicalHash *hhash, cpFloat celldim, int numLevels, int numcells, cpSpatialIndexBBFunc bbfunc)
+{
+	cpAssert(numLevels > 0, "A hierarchical hash needs at least one level.");
+	cpSpatialIndexInit((cpSpatialIndex *)hhash, Klass(), bbfunc);
+	
+	// Debug builds continue past a failed assertion.
+	if(numLevels < 0) numLevels = 0;
+	hhash->numLevels = numLevels;
+	hhash->celldim = celldim;
+	hhash->levels = (cpSpaceHash **)cpcalloc(numLevels, sizeof(cpSpaceHash *));
+	
+	cpFloat dim = celldim;
+	for(int i=0; i<numLevels; i++){
+		hhash->levels[i] = cpSpaceHashNew(dim, numcells, bbfunc);
+		dim *= 2.0f;
+	}
+	
+	hhash->entries = cpHashSetNew(0, (cpHashSetEqlFunc)entrySetEql, (cpHashSetTransFunc)entrySetTrans);
+	
+	hhash->pooledEntries = NULL;
+	hhash->allocatedBuffers = cpArrayNew(0);
+	
+	return (cpSpatialIndex *)hhash;
+}
+
+cpSpatialIndex *
+cpHierarchicalHashNew(cpFloat celldim, int numLevels, int numcells, cpSpatialIndexBBFunc bbfunc)
+{
+	return cpHierarchicalHashInit(cpHierarchicalHashAlloc(), celldim, numLevels, numcells, bbfunc);
+}
+
+static void freeWrap(void *ptr, void *unused){cpfree(ptr);}
+
+static void
+cpHierarchicalHashDestroy(cpHierarchicalHash *hhash)
+{
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashFree(hhash->levels[i]);
+	cpfree(hhash->levels);
+	
+	cpHashSetFree(hhash->entries);
+	
+	cpArrayEach(hhash->allocatedBuffers, freeWrap, NULL);
+	cpArrayFree(hhash->allocatedBuffers);
+}
+
+#pragma mark Insert/Remove
+
+// The bbfunc can be changed after creation. (cpSpaceSetActiveIndex() and the space's pair cache do this)
+// Pass it on to the levels before they need it.
+static inline void
+syncBBFunc(cpHierarchicalHash *hhash)
+{
+	cpSpatialIndexBBFunc bbfunc = hhash->spatialIndex.bbfunc;
+	for(int i=0; i<hhash->numLevels; i++) hhash->levels[i]->spatialIndex.bbfunc = bbfunc;
+}
+
+static void
+cpHierarchicalHashInsert(cpHierarchicalHash *hhash, void *obj, cpHashValue hashid)
+{
+	syncBBFunc(hhash);
+	
+	Entry *entry = (Entry *)cpHashSetInsert(hhash->entries, hashid, obj, hhash);
+	entry->hashid = hashid;
+	
+	EntryUpdateLevel(hhash, entry);
+}
+
+static void
+cpHierarchicalHashRemove(cpHierarchicalHash *hhash, void *obj, cpHashValue hashid)
+{
+	Entry *entry = (Entry *)cpHashSetRemove(hhash->entries, hashid, obj);
+	
+	if(entry){
+		cpSpaceHashRemove(hhash->levels[entry->level], obj, hashid);
+		EntryRecycle(hhash, entry);
+	}
+}
+
+static cpBool
+cpHierarchicalHashContains(cpHierarchicalHash *hhash, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(hhash->entries, hashid, obj) != NULL);
+}
+
+static int cpHierarchicalHashCount(cpHierarchicalHash *hhash){return hhash->entries->entries;}
+
+typedef struct eachPair {
+	cpSpatialIndexIterator func;
+	void *data;
+} eachPair;
+
+static void eachHelper(Entry *entry, eachPair *pair){pair->func(entry->obj, pair->data);}
+
+static void
+cpHierarchicalHashEach(cpHierarchicalHash *hhash, cpSpatialIndexIterator func, void *data)
+{
+	eachPair pair = {func, data};
+	cpHashSetEach(hhash->entries, (cpHashSetIterFunc)eachHelper, &pair);
+}
+
+#pragma mark Reindex
+
+static void
+updateLevelHelper(Entry *entry, cpHierarchicalHash *hhash)
+{
+	EntryUpdateLevel(hhash, entry);
+}
+
+static void
+cpHierarchicalHashReindex(cpHierarchicalHash *hhash)
+{
+	syncBBFunc(hhash);
+	cpHashSetEach(hhash->entries, (cpHashSetIterFunc)updateLevelHelper, hhash);
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashRehash(hhash->levels[i]);
+}
+
+static void
+cpHierarchicalHashReindexObject(cpHierarchicalHash *hhash, void *obj, cpHashValue hashid)
+{
+	Entry *entry = (Entry *)cpHashSetFind(hhash->entries, hashid, obj);
+	
+	if(entry){
+		syncBBFunc(hhash);
+		
+		int level = entry->level;
+		EntryUpdateLevel(hhash, entry);
+		
+		// Objects that changed levels were already hashed by EntryUpdateLevel().
+		if(level == entry->level) cpSpaceHashRehashObject(hhash->levels[level], obj, hashid);
+	}
+}
+
+// Similar to struct eachPair above.
+typedef struct queryPair {
+	cpHierarchicalHash *hhash;
+	cpSpatialIndexQueryFunc func;
+	void *data;
+} queryPair;
+
+// Pairs between levels are found by querying each object against the coarser levels.
+// Each of those queries only touches a few cells since the cells are larger than the object.
+static void
+crossLevelQueryHelper(Entry *entry, queryPair *pair)
+{
+	cpHierarchicalHash *hhash = pair->hhash;
+	cpBB bb = hhash->spatialIndex.bbfunc(entry->obj);
+	
+	for(int i=entry->level + 1; i<hhash->numLevels; i++){
+		cpSpaceHashQuery(hhash->levels[i], entry->obj, bb, pair->func, pair->data);
+	}
+}
+
+static void
+cpHierarchicalHashReindexQuery(cpHierarchicalHash *hhash, cpSpatialIndexQueryFunc func, void *data)
+{
+	syncBBFunc(hhash);
+	cpHashSetEach(hhash->entries, (cpHashSetIterFunc)updateLevelHelper, hhash);
+	
+	// Pairs within each level.
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashQueryRehash(hhash->levels[i], func, data);
+	
+	queryPair pair = {hhash, func, data};
+	cpHashSetEach(hhash->entries, (cpHashSetIterFunc)crossLevelQueryHelper, &pair);
+}
+
+static void
+cpHierarchicalHashFlush(cpHierarchicalHash *hhash)
+{
+	syncBBFunc(hhash);
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashFlush(hhash->levels[i]);
+}
+
+#pragma mark Query
+
+static void
+cpHierarchicalHashPointQuery(cpHierarchicalHash *hhash, cpVect point, cpSpatialIndexQueryFunc func, void *data)
+{
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashPointQuery(hhash->levels[i], point, func, data);
+}
+
+static void
+cpHierarchicalHashQuery(cpHierarchicalHash *hhash, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashQuery(hhash->levels[i], obj, bb, func, data);
+}
+
+static void
+cpHierarchicalHashSegmentQuery(cpHierarchicalHash *hhash, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	for(int i=0; i<hhash->numLevels; i++) cpSpaceHashSegmentQuery(hhash->levels[i], obj, a, b, t_exit, func, data);
+}
+
+static const cpSpatialIndexClass klass = {
+	(void (*)(cpSpatialIndex *))cpHierarchicalHashDestroy,
+	
+	(int (*)(cpSpatialIndex *))cpHierarchicalHashCount,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexIterator, void *))cpHierarchicalHashEach,
+	(cpBool (*)(cpSpatialIndex *, void *, cpHashValue))cpHierarchicalHashContains,
+	
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpHierarchicalHashInsert,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpHierarchicalHashRemove,
+	
+	(void (*)(cpSpatialIndex *))cpHierarchicalHashReindex,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpHierarchicalHashReindexObject,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexQueryFunc, void *))cpHierarchicalHashReindexQuery,
+	(void (*)(cpSpatialIndex *))cpHierarchicalHashFlush,
+	
+	(void (*)(cpSpatialIndex *, cpVect, cpSpatialIndexQueryFunc, void *))cpHierarchicalHashPointQuery,
+	(void (*)(cpSpatialIndex *, void *, cpBB, cpSpatialIndexQueryFunc, void *))cpHierarchicalHashQuery,
+	(void (*)(cpSpatialIndex *, void *, cpVect, cpVect, cpFloat, cpSpatialIndexSegmentQueryFunc, void *))cpHierarchicalHashSegmentQuery,
+};
+static inline const cpSpatialIndexClass *Klass(void){return &klass;}
@@ -36,8 +36,21 @@ cpPolyShapeTransformVerts(cpPolyShape *poly, cpVect p, cpVect rot)
 	cpVect *src = poly->verts;
 	cpVect *dst = poly->tVerts;
 	
-	for(int i=0; i<poly->numVerts; i++)
-		dst[i] = cpvadd(p, cpvrotate(src[i], rot));
+	cpFloat *x = poly->tVertsX;
+	cpFloat *y = poly->tVertsY;
+	
+	for(int i=0; i<poly->numVerts; i++){
+		cpVect v = cpvadd(p, cpvrotate(src[i], rot));
+		dst[i] = v;
+		x[i] = v.x;
+		y[i] = v.y;
+	}
+	
+	// Pad with copies of the first vertex.
+	for(int i=poly->numVerts, count=cpPolyShapeSoALength(poly->numVerts); i<count; i++){
+		x[i] = x[0];
+		y[i] = y[0];
+	}
 }
 
 static void
@@ -46,10 +59,25 @@ cpPolyShapeTransformAxes(cpPolyShape *poly, cpVect p, cpVect rot)
 	cpPolyShapeAxis *src = poly->axes;
 	cpPolyShapeAxis *dst = poly->tAxes;
 	
+	cpFloat *nx = poly->tAxesX;
+	cpFloat *ny = poly->tAxesY;
+	cpFloat *d = poly->tAxesD;
+	
 	for(int i=0; i<poly->numVerts; i++){
 		cpVect n = cpvrotate(src[i].n, rot);
 		dst[i].n = n;
 		dst[i].d = cpvdot(p, n) + src[i].d;
+		
+		nx[i] = n.x;
+		ny[i] = n.y;
+		d[i] = dst[i].d;
+	}
+	
+	// Pad with copies of the first axis.
+	for(int i=poly->numVerts, count=cpPolyShapeSoALength(poly->numVerts); i<count; i++){
+		nx[i] = nx[0];
+		ny[i] = ny[0];
+		d[i] = d[0];
 	}
 }
 
@@ -91,6 +119,8 @@ cpPolyShapeDestroy(cpShape *shape)
 	
 	cpfree(poly->axes);
 	cpfree(poly->tAxes);
+	
+	cpfree(poly->tVertsX);
 }
 
 static cpBool
@@ -128,12 +158,42 @@ cpPolyShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *
 	}
 }
 
+static void
+cpPolyShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpPolyShape *poly = (cpPolyShape *)shape;
+	cpPolyShapeAxis *axes = poly->tAxes;
+	cpVect *verts = poly->tVerts;
+	int numVerts = poly->numVerts;
+	
+	cpFloat minDist = INFINITY;
+	cpVect closest = cpvzero;
+	cpBool outside = cpFalse;
+	
+	// Axis i is the normal of the edge from verts[i] to verts[i+1].
+	for(int i=0; i<numVerts; i++){
+		if(cpvdot(axes[i].n, p) - axes[i].d > 0.0f) outside = cpTrue;
+		
+		cpVect v = cpClosestPointOnSegment(p, verts[i], verts[(i+1)%numVerts]);
+		cpFloat dist = cpvdist(p, v);
+		if(dist < minDist){
+			minDist = dist;
+			closest = v;
+		}
+	}
+	
+	info->shape = shape;
+	info->p = closest;
+	info->d = (outside ? minDist : -minDist);
+}
+
 static const cpShapeClass polyClass = {
 	CP_POLY_SHAPE,
 	cpPolyShapeCacheData,
 	cpPolyShapeDestroy,
 	cpPolyShapePointQuery,
 	cpPolyShapeSegmentQuery,
+	cpPolyShapeNearestPointQuery,
 };
 
 cpBool
@@ -178,6 +238,14 @@ setUpVerts(cpPolyShape *poly, int numVerts, cpVect *verts, cpVect offset)
 	poly->axes = (cpPolyShapeAxis *)cpcalloc(numVerts, sizeof(cpPolyShapeAxis));
 	poly->tAxes = (cpPolyShapeAxis *)cpcalloc(numVerts, sizeof(cpPolyShapeAxis));
 	
+	// The component arrays are all carved out of the tVertsX allocation.
+	int length = cpPolyShapeSoALength(numVerts);
+	poly->tVertsX = (cpFloat *)cpcalloc(5*length, sizeof(cpFloat));
+	poly->tVertsY = poly->tVertsX + 1*length;
+	poly->tAxesX = poly->tVertsX + 2*length;
+	poly->tAxesY = poly->tVertsX + 3*length;
+	poly->tAxesD = poly->tVertsX + 4*length;
+	
 	for(int i=0; i<numVerts; i++){
 		cpVect a = cpvadd(offset, verts[i]);
 		cpVect b = cpvadd(offset, verts[(i+1)%numVerts]);
@@ -237,4 +305,5 @@ cpPolyShapeSetVerts(cpShape *shape, int numVerts, cpVect *verts, cpVect offset)
 	cpAssert(shape->klass == &polyClass, "Shape is not a poly shape.");
 	cpPolyShapeDestroy(shape);
 	setUpVerts((cpPolyShape *)shape, numVerts, verts, offset);
+	shape->transformGeneration = 0;
 }
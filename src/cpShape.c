@@ -62,6 +62,9 @@ cpShapeInit(cpShape *shape, const cpShapeClass *klass, cpBody *body)
 	shape->data = NULL;
 	shape->next = NULL;
 	
+	shape->transformGeneration = 0;
+	shape->transformBody = NULL;
+	
 //	cpShapeCacheBB(shape);
 	
 	return shape;
@@ -88,6 +91,8 @@ cpShapeCacheBB(cpShape *shape)
 {
 	cpBody *body = shape->body;
 	
+	shape->transformGeneration = cpBodyTransformGeneration(body);
+	shape->transformBody = body;
 	shape->bb = shape->klass->cacheData(shape, body->p, body->rot);
 	return shape->bb;
 }
@@ -106,6 +111,20 @@ cpShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info
 	return (info->shape != NULL);
 }
 
+cpFloat
+cpShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *out)
+{
+	cpNearestPointQueryInfo blank = {NULL, cpvzero, INFINITY};
+	if(out){
+		(*out) = blank;
+	} else {
+		out = &blank;
+	}
+	
+	shape->klass->nearestPointQuery(shape, p, out);
+	return out->d;
+}
+
 void
 cpSegmentQueryInfoPrint(cpSegmentQueryInfo *info)
 {
@@ -176,12 +195,35 @@ cpCircleShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo
 	circleSegmentQuery(shape, circle->tc, circle->r, a, b, info);
 }
 
+// Closest point on the surface of a circle (or rounded endpoint) of radius r.
+static void
+circleNearestPointQuery(cpShape *shape, cpVect center, cpFloat r, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpVect delta = cpvsub(p, center);
+	cpFloat d = cpvlength(delta);
+	
+	// Pick an arbitrary direction when p is exactly at the center.
+	cpVect n = (d ? cpvmult(delta, 1.0f/d) : cpv(1.0f, 0.0f));
+	
+	info->shape = shape;
+	info->p = cpvadd(center, cpvmult(n, r));
+	info->d = d - r;
+}
+
+static void
+cpCircleShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpCircleShape *circle = (cpCircleShape *)shape;
+	circleNearestPointQuery(shape, circle->tc, circle->r, p, info);
+}
+
 static const cpShapeClass cpCircleShapeClass = {
 	CP_CIRCLE_SHAPE,
 	cpCircleShapeCacheData,
 	NULL,
 	cpCircleShapePointQuery,
 	cpCircleShapeSegmentQuery,
+	cpCircleShapeNearestPointQuery,
 };
 
 cpCircleShape *
@@ -281,29 +323,28 @@ cpSegmentShapePointQuery(cpShape *shape, cpVect p){
 
 static inline cpBool inUnitRange(cpFloat t){return (0.0f < t && t < 1.0f);}
 
-static void
-cpSegmentShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info)
+void
+cpRoundedSegmentQuery(cpShape *shape, cpVect ta, cpVect tb, cpVect tn, cpFloat r, cpVect a, cpVect b, cpSegmentQueryInfo *info)
 {
 	// TODO this function could be optimized better.
 	
-	cpSegmentShape *seg = (cpSegmentShape *)shape;
-	cpVect n = seg->tn;
+	cpVect n = tn;
 	// flip n if a is behind the axis
-	if(cpvdot(a, n) < cpvdot(seg->ta, n))
+	if(cpvdot(a, n) < cpvdot(ta, n))
 		n = cpvneg(n);
 	
 	cpFloat an = cpvdot(a, n);
 	cpFloat bn = cpvdot(b, n);
 	
 	if(an != bn){
-		cpFloat d = cpvdot(seg->ta, n) + seg->r;
+		cpFloat d = cpvdot(ta, n) + r;
 		cpFloat t = (d - an)/(bn - an);
 		
 		if(0.0f < t && t < 1.0f){
 			cpVect point = cpvlerp(a, b, t);
-			cpFloat dt = -cpvcross(seg->tn, point);
-			cpFloat dtMin = -cpvcross(seg->tn, seg->ta);
-			cpFloat dtMax = -cpvcross(seg->tn, seg->tb);
+			cpFloat dt = -cpvcross(tn, point);
+			cpFloat dtMin = -cpvcross(tn, ta);
+			cpFloat dtMax = -cpvcross(tn, tb);
 			
 			if(dtMin < dt && dt < dtMax){
 				info->shape = shape;
@@ -315,11 +356,11 @@ cpSegmentShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInf
 		}
 	}
 	
-	if(seg->r) {
+	if(r) {
 		cpSegmentQueryInfo info1 = {NULL, 1.0f, cpvzero};
 		cpSegmentQueryInfo info2 = {NULL, 1.0f, cpvzero};
-		circleSegmentQuery(shape, seg->ta, seg->r, a, b, &info1);
-		circleSegmentQuery(shape, seg->tb, seg->r, a, b, &info2);
+		circleSegmentQuery(shape, ta, r, a, b, &info1);
+		circleSegmentQuery(shape, tb, r, a, b, &info2);
 		
 		if(info1.t < info2.t){
 			(*info) = info1;
@@ -329,12 +370,27 @@ cpSegmentShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInf
 	}
 }
 
+static void
+cpSegmentShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info)
+{
+	cpSegmentShape *seg = (cpSegmentShape *)shape;
+	cpRoundedSegmentQuery(shape, seg->ta, seg->tb, seg->tn, seg->r, a, b, info);
+}
+
+static void
+cpSegmentShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpSegmentShape *seg = (cpSegmentShape *)shape;
+	circleNearestPointQuery(shape, cpClosestPointOnSegment(p, seg->ta, seg->tb), seg->r, p, info);
+}
+
 static const cpShapeClass cpSegmentShapeClass = {
 	CP_SEGMENT_SHAPE,
 	cpSegmentShapeCacheData,
 	NULL,
 	cpSegmentShapePointQuery,
 	cpSegmentShapeSegmentQuery,
+	cpSegmentShapeNearestPointQuery,
 };
 
 cpSegmentShape *
@@ -371,6 +427,7 @@ cpCircleShapeSetRadius(cpShape *shape, cpFloat radius)
 	cpCircleShape *circle = (cpCircleShape *)shape;
 	
 	circle->r = radius;
+	shape->transformGeneration = 0;
 }
 
 void
@@ -380,6 +437,7 @@ cpCircleShapeSetOffset(cpShape *shape, cpVect offset)
 	cpCircleShape *circle = (cpCircleShape *)shape;
 	
 	circle->c = offset;
+	shape->transformGeneration = 0;
 }
 
 void
@@ -391,6 +449,7 @@ cpSegmentShapeSetEndpoints(cpShape *shape, cpVect a, cpVect b)
 	seg->a = a;
 	seg->b = b;
 	seg->n = cpvperp(cpvnormalize(cpvsub(b, a)));
+	shape->transformGeneration = 0;
 }
 
 void
@@ -400,4 +459,5 @@ cpSegmentShapeSetRadius(cpShape *shape, cpFloat radius)
 	cpSegmentShape *seg = (cpSegmentShape *)shape;
 	
 	seg->r = radius;
+	shape->transformGeneration = 0;
 }
@@ -119,9 +119,9 @@ cpSpaceInit(cpSpace *space)
 	
 	space->locked = 0;
 	space->stamp = 0;
-
-	space->staticShapes = cpSpaceHashNew(DEFAULT_DIM_SIZE, DEFAULT_COUNT, (cpSpaceHashBBFunc)shapeBBFunc);
-	space->activeShapes = cpSpaceHashNew(DEFAULT_DIM_SIZE, DEFAULT_COUNT, (cpSpaceHashBBFunc)shapeBBFunc);
+	
+	space->staticShapes = (cpSpatialIndex *)cpSpaceHashNew(DEFAULT_DIM_SIZE, DEFAULT_COUNT, (cpSpatialIndexBBFunc)shapeBBFunc);
+	space->activeShapes = (cpSpatialIndex *)cpSpaceHashNew(DEFAULT_DIM_SIZE, DEFAULT_COUNT, (cpSpatialIndexBBFunc)shapeBBFunc);
 	
 	space->allocatedBuffers = cpArrayNew(0);
 	
@@ -146,6 +146,21 @@ cpSpaceInit(cpSpace *space)
 	
 	space->postStepCallbacks = NULL;
 	
+	space->pairCache = NULL;
+	space->cachedPairs = NULL;
+	space->pooledPairs = cpArrayNew(0);
+	space->pairCacheMargin = 0.0f;
+	space->movedShapes = NULL;
+	space->removedShapes = NULL;
+	space->newStaticShapes = NULL;
+	space->staticPairsStale = cpFalse;
+	
+	space->threads = 1;
+	space->broadphaseThreads = NULL;
+	
+	space->concurrentQueries = cpFalse;
+	space->narrowphaseBatch = NULL;
+	
 	cpBodyInitStatic(&space->staticBody);
 	
 	return space;
@@ -160,8 +175,8 @@ cpSpaceNew(void)
 void
 cpSpaceDestroy(cpSpace *space)
 {
-	cpSpaceHashFree(space->staticShapes);
-	cpSpaceHashFree(space->activeShapes);
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->activeShapes);
 	
 	cpArrayFree(space->bodies);
 	cpArrayFree(space->sleepingComponents);
@@ -174,6 +189,19 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->arbiters);
 	cpArrayFree(space->pooledArbiters);
 	
+	if(space->pairCache){
+		cpHashSetFree(space->pairCache);
+		cpArrayFree(space->cachedPairs);
+		cpArrayFree(space->movedShapes);
+		cpHashSetFree(space->removedShapes);
+		cpHashSetFree(space->newStaticShapes);
+	}
+	cpArrayFree(space->pooledPairs);
+	
+	// Stops and frees the worker threads.
+	cpSpaceSetThreads(space, 1);
+	cpSpaceSetBatchedNarrowphase(space, cpFalse);
+	
 	if(space->allocatedBuffers){
 		cpArrayEach(space->allocatedBuffers, freeWrap, NULL);
 		cpArrayFree(space->allocatedBuffers);
@@ -205,8 +233,8 @@ cpSpaceFreeChildren(cpSpace *space)
 	cpArray *components = space->sleepingComponents;
 	while(components->num) cpBodyActivate((cpBody *)components->arr[0]);
 	
-	cpSpaceHashEach(space->staticShapes, (cpSpaceHashIterator)&shapeFreeWrap, NULL);
-	cpSpaceHashEach(space->activeShapes, (cpSpaceHashIterator)&shapeFreeWrap, NULL);
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)&shapeFreeWrap, NULL);
+	cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)&shapeFreeWrap, NULL);
 	cpArrayEach(space->bodies,           (cpArrayIter)&bodyFreeWrap,          NULL);
 	cpArrayEach(space->constraints,      (cpArrayIter)&constraintFreeWrap,    NULL);
 }
@@ -304,7 +332,7 @@ cpSpaceAddShape(cpSpace *space, cpShape *shape)
 	cpBody *body = shape->body;
 	if(!body || cpBodyIsStatic(body)) return cpSpaceAddStaticShape(space, shape);
 	
-	cpAssert(!cpHashSetFind(space->activeShapes->handleSet, shape->hashid, shape),
+	cpAssert(!cpSpatialIndexContains(space->activeShapes, shape, shape->hashid),
 		"Cannot add the same shape more than once.");
 	cpAssertSpaceUnlocked(space);
 	
@@ -312,7 +340,8 @@ cpSpaceAddShape(cpSpace *space, cpShape *shape)
 	cpBodyAddShape(body, shape);
 	
 	cpShapeCacheBB(shape);
-	cpSpaceHashInsert(space->activeShapes, shape, shape->hashid, shape->bb);
+	cpShapeResetFatBB(shape);
+	cpSpatialIndexInsert(space->activeShapes, shape, shape->hashid);
 		
 	return shape;
 }
@@ -320,7 +349,7 @@ cpSpaceAddShape(cpSpace *space, cpShape *shape)
 cpShape *
 cpSpaceAddStaticShape(cpSpace *space, cpShape *shape)
 {
-	cpAssert(!cpHashSetFind(space->staticShapes->handleSet, shape->hashid, shape),
+	cpAssert(!cpSpatialIndexContains(space->staticShapes, shape, shape->hashid),
 		"Cannot add the same static shape more than once.");
 	cpAssertSpaceUnlocked(space);
 	
@@ -328,11 +357,30 @@ cpSpaceAddStaticShape(cpSpace *space, cpShape *shape)
 	
 	cpShapeCacheBB(shape);
 	cpSpaceActivateShapesTouchingShape(space, shape);
-	cpSpaceHashInsert(space->staticShapes, shape, shape->hashid, shape->bb);
+	cpSpatialIndexInsert(space->staticShapes, shape, shape->hashid);
+	cpSpaceCacheStaticShape(space, shape);
 	
 	return shape;
 }
 
+void
+cpSpaceAddStaticShapes(cpSpace *space, cpShape **shapes, int count)
+{
+	cpAssertSpaceUnlocked(space);
+	
+	for(int i=0; i<count; i++){
+		cpShape *shape = shapes[i];
+		cpAssert(!cpSpatialIndexContains(space->staticShapes, shape, shape->hashid),
+			"Cannot add the same static shape more than once.");
+		
+		if(!shape->body) shape->body = &space->staticBody;
+		
+		cpShapeCacheBB(shape);
+		cpSpatialIndexInsert(space->staticShapes, shape, shape->hashid);
+		cpSpaceCacheStaticShape(space, shape);
+	}
+}
+
 cpBody *
 cpSpaceAddBody(cpSpace *space, cpBody *body)
 {
@@ -391,30 +439,32 @@ cpSpaceRemoveShape(cpSpace *space, cpShape *shape)
 		cpSpaceRemoveStaticShape(space, shape);
 		return;
 	}
-
+	
 	cpBodyActivate(body);
 	
 	cpAssertSpaceUnlocked(space);
-	cpAssertWarn(cpHashSetFind(space->activeShapes->handleSet, shape->hashid, shape),
+	cpAssertWarn(cpSpatialIndexContains(space->activeShapes, shape, shape->hashid),
 		"Cannot remove a shape that was not added to the space. (Removed twice maybe?)");
 	
 	cpBodyRemoveShape(body, shape);
 	
 	removalContext context = {space, shape};
 	cpHashSetFilter(space->contactSet, (cpHashSetFilterFunc)contactSetFilterRemovedShape, &context);
-	cpSpaceHashRemove(space->activeShapes, shape, shape->hashid);
+	cpSpatialIndexRemove(space->activeShapes, shape, shape->hashid);
+	cpSpaceUncacheShape(space, shape);
 }
 
 void
 cpSpaceRemoveStaticShape(cpSpace *space, cpShape *shape)
 {
-	cpAssertWarn(cpHashSetFind(space->staticShapes->handleSet, shape->hashid, shape),
+	cpAssertWarn(cpSpatialIndexContains(space->staticShapes, shape, shape->hashid),
 		"Cannot remove a static or sleeping shape that was not added to the space. (Removed twice maybe?)");
 	cpAssertSpaceUnlocked(space);
 	
 	removalContext context = {space, shape};
 	cpHashSetFilter(space->contactSet, (cpHashSetFilterFunc)contactSetFilterRemovedShape, &context);
-	cpSpaceHashRemove(space->staticShapes, shape, shape->hashid);
+	cpSpatialIndexRemove(space->staticShapes, shape, shape->hashid);
+	cpSpaceUncacheShape(space, shape);
 	
 	cpSpaceActivateShapesTouchingShape(space, shape);
 }
@@ -443,38 +493,84 @@ cpSpaceRemoveConstraint(cpSpace *space, cpConstraint *constraint)
 	cpArrayDeleteObj(space->constraints, constraint);
 }
 
-#pragma mark Spatial Hash Management
+#pragma mark Spatial Index Management
 
 static void updateBBCache(cpShape *shape, void *unused){cpShapeCacheBB(shape);}
 
+static void copyShapes(cpShape *shape, cpSpatialIndex *index){cpSpatialIndexInsert(index, shape, shape->hashid);}
+
+// Move the contents of an index into a replacement and free the original.
+static cpSpatialIndex *
+cpSpaceReplaceIndex(cpSpatialIndex *old, cpSpatialIndex *index)
+{
+	cpAssert(index != old, "The index is already in use by the space.");
+	// Keep the bbfunc of the old index. The active index uses the fat bboxes when the pair cache is enabled.
+	index->bbfunc = old->bbfunc;
+	
+	cpSpatialIndexEach(old, (cpSpatialIndexIterator)copyShapes, index);
+	cpSpatialIndexFree(old);
+	
+	return index;
+}
+
+void
+cpSpaceSetStaticIndex(cpSpace *space, cpSpatialIndex *index)
+{
+	cpAssertSpaceUnlocked(space);
+	space->staticShapes = cpSpaceReplaceIndex(space->staticShapes, index);
+}
+
+void
+cpSpaceSetActiveIndex(cpSpace *space, cpSpatialIndex *index)
+{
+	cpAssertSpaceUnlocked(space);
+	space->activeShapes = cpSpaceReplaceIndex(space->activeShapes, index);
+}
+
 void
 cpSpaceResizeStaticHash(cpSpace *space, cpFloat dim, int count)
 {
-	cpSpaceHashResize(space->staticShapes, dim, count);
-	cpSpaceHashRehash(space->staticShapes);
+	cpAssert(cpSpatialIndexIsSpaceHash(space->staticShapes), "The static shapes are not using a spatial hash.");
+	cpSpaceHashResize((cpSpaceHash *)space->staticShapes, dim, count);
+	cpSpaceHashRehash((cpSpaceHash *)space->staticShapes);
 }
 
 void
 cpSpaceResizeActiveHash(cpSpace *space, cpFloat dim, int count)
 {
-	cpSpaceHashResize(space->activeShapes, dim, count);
+	cpAssert(cpSpatialIndexIsSpaceHash(space->activeShapes), "The active shapes are not using a spatial hash.");
+	cpSpaceHashResize((cpSpaceHash *)space->activeShapes, dim, count);
+}
+
+void
+cpSpaceSetActiveHashAutoTune(cpSpace *space, cpBool autoTune)
+{
+	cpAssert(cpSpatialIndexIsSpaceHash(space->activeShapes), "The active shapes are not using a spatial hash.");
+	cpSpaceHashSetAutoTune((cpSpaceHash *)space->activeShapes, autoTune);
 }
 
 void 
 cpSpaceRehashStatic(cpSpace *space)
 {
-	cpSpaceHashEach(space->staticShapes, (cpSpaceHashIterator)&updateBBCache, NULL);
-	cpSpaceHashRehash(space->staticShapes);
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)&updateBBCache, NULL);
+	cpSpatialIndexReindex(space->staticShapes);
+	cpSpaceInvalidateStaticPairs(space);
 }
 
 void
 cpSpaceRehashShape(cpSpace *space, cpShape *shape)
 {
 	cpShapeCacheBB(shape);
+	cpShapeResetFatBB(shape);
 	
-	// attempt to rehash the shape in both hashes
-	cpSpaceHashRehashObject(space->activeShapes, shape, shape->hashid);
-	cpSpaceHashRehashObject(space->staticShapes, shape, shape->hashid);
+	// attempt to rehash the shape in both indexes
+	cpSpatialIndexReindexObject(space->activeShapes, shape, shape->hashid);
+	
+	if(cpSpatialIndexContains(space->staticShapes, shape, shape->hashid)){
+		cpSpatialIndexReindexObject(space->staticShapes, shape, shape->hashid);
+		cpSpaceUncacheShape(space, shape);
+		cpSpaceCacheStaticShape(space, shape);
+	}
 }
 
 void
@@ -64,8 +64,10 @@ cpSpaceActivateBody(cpSpace *space, cpBody *body)
 	} else {
 		cpArrayPush(space->bodies, body);
 		for(cpShape *shape=body->shapesList; shape; shape=shape->next){
-			cpSpaceHashRemove(space->staticShapes, shape, shape->hashid);
-			cpSpaceHashInsert(space->activeShapes, shape, shape->hashid, shape->bb);
+			cpSpatialIndexRemove(space->staticShapes, shape, shape->hashid);
+			cpSpaceUncacheShape(space, shape);
+			cpShapeResetFatBB(shape);
+			cpSpatialIndexInsert(space->activeShapes, shape, shape->hashid);
 		}
 	}
 }
@@ -211,8 +213,10 @@ cpSpaceProcessComponents(cpSpace *space, cpFloat dt)
 				next = body->node.next;
 				
 				for(cpShape *shape = body->shapesList; shape; shape = shape->next){
-					cpSpaceHashRemove(space->activeShapes, shape, shape->hashid);
-					cpSpaceHashInsert(space->staticShapes, shape, shape->hashid, shape->bb);
+					cpSpatialIndexRemove(space->activeShapes, shape, shape->hashid);
+					cpSpatialIndexInsert(space->staticShapes, shape, shape->hashid);
+					cpSpaceUncacheShape(space, shape);
+					cpSpaceCacheStaticShape(space, shape);
 				}
 			} while((body = next) != root);
 			
@@ -245,8 +249,10 @@ cpBodySleepWithGroup(cpBody *body, cpBody *group){
 	
 	for(cpShape *shape = body->shapesList; shape; shape = shape->next){
 		cpShapeCacheBB(shape);
-		cpSpaceHashRemove(space->activeShapes, shape, shape->hashid);
-		cpSpaceHashInsert(space->staticShapes, shape, shape->hashid, shape->bb);
+		cpSpatialIndexRemove(space->activeShapes, shape, shape->hashid);
+		cpSpatialIndexInsert(space->staticShapes, shape, shape->hashid);
+		cpSpaceUncacheShape(space, shape);
+		cpSpaceCacheStaticShape(space, shape);
 	}
 	
 	if(group){
@@ -272,6 +278,9 @@ activateTouchingHelper(cpShape *shape, cpContactPointSet *points, cpArray **bodi
 
 void
 cpSpaceActivateShapesTouchingShape(cpSpace *space, cpShape *shape){
+	// Only sleeping bodies need to be woken up.
+	if(space->sleepingComponents->num == 0) return;
+	
 	cpArray *bodies = NULL;
 	cpSpaceShapeQuery(space, shape, (cpSpaceShapeQueryFunc)activateTouchingHelper, &bodies);
 }
@@ -21,43 +21,46 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 #include "chipmunk_private.h"
-#include "prime.h"
 
 static cpHandle*
 cpHandleInit(cpHandle *hand, void *obj)
 {
 	hand->obj = obj;
-	hand->retain = 0;
-	hand->stamp = 0;
+	hand->bb = cpBBNew(0.0f, 0.0f, 0.0f, 0.0f);
 	
 	return hand;
 }
 
-static inline void cpHandleRetain(cpHandle *hand){hand->retain++;}
-
-static inline void
-cpHandleRelease(cpHandle *hand, cpArray *pooledHandles)
-{
-	hand->retain--;
-	if(hand->retain == 0) cpArrayPush(pooledHandles, hand);
-}
-
 cpSpaceHash*
 cpSpaceHashAlloc(void)
 {
 	return (cpSpaceHash *)cpcalloc(1, sizeof(cpSpaceHash));
 }
 
-// Frees the old table, and allocate a new one.
+// Frees the old cell arrays, and allocates new ones.
+// The number of cells is rounded up to a power of two so the hash can be masked.
 static void
 cpSpaceHashAllocTable(cpSpaceHash *hash, int numcells)
 {
-	cpfree(hash->table);
+	int size = 1;
+	while(size < numcells) size <<= 1;
 	
-	hash->numcells = numcells;
-	hash->table = (cpSpaceHashBin **)cpcalloc(numcells, sizeof(cpSpaceHashBin *));
+	cpfree(hash->cells);
+	cpfree(hash->cellStamps);
+	cpfree(hash->touchedCells);
+	
+	hash->numcells = size;
+	hash->cells = (cpSpaceHashCell *)cpcalloc(size, sizeof(cpSpaceHashCell));
+	hash->cellStamps = (cpTimestamp *)cpcalloc(size, sizeof(cpTimestamp));
+	hash->touchedCells = (int *)cpcalloc(size, sizeof(int));
+	hash->numTouched = 0;
+	
+	// The cells need to be filled again before they can be used.
+	hash->stale = cpTrue;
 }
 
 // Equality function for the handleset.
@@ -78,23 +81,38 @@ handleSetTrans(void *obj, cpSpaceHash *hash)
 		for(int i=0; i<count; i++) cpArrayPush(hash->pooledHandles, buffer + i);
 	}
 	
-	cpHandle *hand = cpHandleInit((cpHandle *) cpArrayPop(hash->pooledHandles), obj);
-	cpHandleRetain(hand);
-	
-	return hand;
+	return cpHandleInit((cpHandle *) cpArrayPop(hash->pooledHandles), obj);
 }
 
+static inline const cpSpatialIndexClass *Klass(void);
+
 cpSpaceHash*
 cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, int numcells, cpSpaceHashBBFunc bbfunc)
 {
-	cpSpaceHashAllocTable(hash, next_prime(numcells));
+	cpSpatialIndexInit((cpSpatialIndex *)hash, Klass(), bbfunc);
+	
+	cpSpaceHashAllocTable(hash, numcells);
 	hash->celldim = celldim;
-	hash->bbfunc = bbfunc;
 	
 	hash->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql, (cpHashSetTransFunc)handleSetTrans);
 	hash->pooledHandles = cpArrayNew(0);
+	hash->pendingHandles = cpArrayNew(0);
+	hash->dirtyHandles = cpArrayNew(0);
+	
+	hash->entries = NULL;
+	hash->numEntries = 0;
+	hash->usedEntries = 0;
+	hash->maxEntries = 0;
+	hash->wastedEntries = 0;
+	hash->numOccupied = 0;
+	
+	hash->autoTune = cpFalse;
+	hash->tuneUpdates = 0;
+	hash->tuneHandles = 0;
+	hash->tuneEntries = 0;
+	hash->tuneOccupied = 0;
+	hash->tuneExtent = 0.0f;
 	
-	hash->pooledBins = NULL;
 	hash->allocatedBuffers = cpArrayNew(0);
 	
 	hash->stamp = 1;
@@ -108,51 +126,23 @@ cpSpaceHashNew(cpFloat celldim, int cells, cpSpaceHashBBFunc bbfunc)
 	return cpSpaceHashInit(cpSpaceHashAlloc(), celldim, cells, bbfunc);
 }
 
-static inline void
-recycleBin(cpSpaceHash *hash, cpSpaceHashBin *bin)
-{
-	bin->next = hash->pooledBins;
-	hash->pooledBins = bin;
-}
-
-static inline void
-clearHashCell(cpSpaceHash *hash, int idx)
-{
-	cpSpaceHashBin *bin = hash->table[idx];
-	while(bin){
-		cpSpaceHashBin *next = bin->next;
-		
-		cpHandleRelease(bin->handle, hash->pooledHandles);
-		recycleBin(hash, bin);
-		
-		bin = next;
-	}
-	
-	hash->table[idx] = NULL;
-}
-
-// Clear all cells in the hashtable.
-static void
-clearHash(cpSpaceHash *hash)
-{
-	for(int i=0; i<hash->numcells; i++)
-		clearHashCell(hash, i);
-}
-
 static void freeWrap(void *ptr, void *unused){cpfree(ptr);}
 
 void
 cpSpaceHashDestroy(cpSpaceHash *hash)
 {
-	clearHash(hash);
-	
 	cpHashSetFree(hash->handleSet);
 	
 	cpArrayEach(hash->allocatedBuffers, freeWrap, NULL);
 	cpArrayFree(hash->allocatedBuffers);
 	cpArrayFree(hash->pooledHandles);
+	cpArrayFree(hash->pendingHandles);
+	cpArrayFree(hash->dirtyHandles);
 	
-	cpfree(hash->table);
+	cpfree(hash->entries);
+	cpfree(hash->cells);
+	cpfree(hash->cellStamps);
+	cpfree(hash->touchedCells);
 }
 
 void
@@ -167,53 +157,34 @@ cpSpaceHashFree(cpSpaceHash *hash)
 void
 cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells)
 {
-	// Clear the hash to release the old handle locks.
-	clearHash(hash);
-	
 	hash->celldim = celldim;
-	cpSpaceHashAllocTable(hash, next_prime(numcells));
+	cpSpaceHashAllocTable(hash, numcells);
 }
 
-// Return true if the chain contains the handle.
-static inline cpBool
-containsHandle(cpSpaceHashBin *bin, cpHandle *hand)
-{
-	while(bin){
-		if(bin->handle == hand) return cpTrue;
-		bin = bin->next;
-	}
-	
-	return cpFalse;
-}
-
-// Get a recycled or new bin.
-static inline cpSpaceHashBin *
-getEmptyBin(cpSpaceHash *hash)
+void
+cpSpaceHashSetAutoTune(cpSpaceHash *hash, cpBool autoTune)
 {
-	cpSpaceHashBin *bin = hash->pooledBins;
+	hash->autoTune = autoTune;
 	
-	if(bin){
-		hash->pooledBins = bin->next;
-		return bin;
-	} else {
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpSpaceHashBin);
-		cpAssert(count, "Buffer size is too small.");
-		
-		cpSpaceHashBin *buffer = (cpSpaceHashBin *)cpmalloc(CP_BUFFER_BYTES);
-		cpArrayPush(hash->allocatedBuffers, buffer);
-		
-		// push all but the first one, return the first instead
-		for(int i=1; i<count; i++) recycleBin(hash, buffer + i);
-		return buffer;
-	}
+	hash->tuneUpdates = 0;
+	hash->tuneHandles = 0;
+	hash->tuneEntries = 0;
+	hash->tuneOccupied = 0;
+	hash->tuneExtent = 0.0f;
 }
 
 // The hash function itself.
-static inline cpHashValue
-hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
+// Mixes the bits of the cell coordinates so that they can be masked
+// down to a power of two sized table without clustering.
+static inline int
+hash_func(int x, int y, int mask)
 {
-	return (x*1640531513ul ^ y*2654435789ul) % n;
+	cpHashValue h = ((cpHashValue)x*1640531513ul ^ (cpHashValue)y*2654435789ul);
+	h ^= h >> 15;
+	h *= 2246822519ul;
+	h ^= h >> 13;
+	
+	return (int)(h & mask);
 }
 
 // Much faster than (int)floor(f)
@@ -225,62 +196,386 @@ floor_int(cpFloat f)
 	return (f < 0.0f && f != i ? i - 1 : i);
 }
 
-static inline void
-hashHandle(cpSpaceHash *hash, cpHandle *hand, cpBB bb)
+static inline cpSpaceHashRect
+cellRectForBB(cpSpaceHash *hash, cpBB bb)
+{
+	cpFloat dim = hash->celldim;
+	cpSpaceHashRect rect = {floor_int(bb.l/dim), floor_int(bb.b/dim), floor_int(bb.r/dim), floor_int(bb.t/dim)}; // Fix by ShiftZ
+	return rect;
+}
+
+static inline cpBool
+cellRectEql(cpSpaceHashRect a, cpSpaceHashRect b)
+{
+	return (a.l == b.l && a.b == b.b && a.r == b.r && a.t == b.t);
+}
+
+static inline cpBool
+cellRectContains(cpSpaceHashRect rect, int i, int j)
+{
+	return (rect.l <= i && i <= rect.r && rect.b <= j && j <= rect.t);
+}
+
+static inline cpBool
+bbEql(cpBB a, cpBB b)
+{
+	return (a.l == b.l && a.b == b.b && a.r == b.r && a.t == b.t);
+}
+
+static inline cpBool
+bbContainsPoint(cpBB bb, cpVect p)
+{
+	return (bb.l <= p.x && p.x <= bb.r && bb.b <= p.y && p.y <= bb.t);
+}
+
+// Returns true if a pair of overlapping bboxes should be reported in the given cell.
+// Objects spanning several cells would be found once in each cell they share.
+// Only the cell holding the lower left corner of the overlap reports them.
+static inline cpBool
+pairOwnedByCell(cpSpaceHash *hash, cpBB a, cpBB b, int i, int j)
 {
-	// Find the dimensions in cell coordinates.
 	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim); // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
-	
-	int n = hash->numcells;
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			int idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = hash->table[idx];
+	return (floor_int(cpfmax(a.l, b.l)/dim) == i && floor_int(cpfmax(a.b, b.b)/dim) == j);
+}
+
+#pragma mark Cell Functions
+
+static void
+growEntries(cpSpaceHash *hash, int count)
+{
+	if(count > hash->maxEntries){
+		hash->maxEntries = (count > hash->maxEntries*2 ? count : hash->maxEntries*2);
+		hash->entries = (cpSpaceHashEntry *)cprealloc(hash->entries, hash->maxEntries*sizeof(cpSpaceHashEntry));
+	}
+}
+
+static void
+cellAddEntry(cpSpaceHash *hash, int idx, cpSpaceHashEntry entry)
+{
+	cpSpaceHashCell *cell = &hash->cells[idx];
+	
+	if(cell->count == cell->capacity){
+		// Out of room. Move the cell to the end of the array with room to grow.
+		if(cell->capacity == 0) hash->touchedCells[hash->numTouched++] = idx;
+		int capacity = (cell->capacity ? cell->capacity*2 : 2);
+		growEntries(hash, hash->usedEntries + capacity);
+		
+		memcpy(hash->entries + hash->usedEntries, hash->entries + cell->start, cell->count*sizeof(cpSpaceHashEntry));
+		hash->wastedEntries += cell->capacity;
+		
+		cell->start = hash->usedEntries;
+		cell->capacity = capacity;
+		hash->usedEntries += capacity;
+	}
+	
+	if(cell->count == 0) hash->numOccupied++;
+	hash->entries[cell->start + cell->count++] = entry;
+	hash->numEntries++;
+}
+
+static void
+cellRemoveEntry(cpSpaceHash *hash, int idx, cpHandle *hand)
+{
+	cpSpaceHashCell *cell = &hash->cells[idx];
+	cpSpaceHashEntry *entries = hash->entries + cell->start;
+	
+	for(int k=0; k<cell->count; k++){
+		if(entries[k].handle == hand){
+			entries[k] = entries[--cell->count];
 			
-			// Don't add an object twice to the same cell.
-			if(containsHandle(bin, hand)) continue;
-
-			cpHandleRetain(hand);
-			// Insert a new bin for the handle in this cell.
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			hash->table[idx] = newBin;
+			if(cell->count == 0) hash->numOccupied--;
+			hash->numEntries--;
+			return;
+		}
+	}
+}
+
+static void
+cellUpdateEntry(cpSpaceHash *hash, int idx, cpHandle *hand)
+{
+	cpSpaceHashCell cell = hash->cells[idx];
+	cpSpaceHashEntry *entries = hash->entries + cell.start;
+	
+	for(int k=0; k<cell.count; k++){
+		if(entries[k].handle == hand){
+			entries[k].bb = hand->bb;
+			return;
+		}
+	}
+}
+
+// Add a copy of the handle to each of the cells it covers.
+// A handle is only added once to a cell even if its cells collide in the hash.
+static void
+linkHandle(cpSpaceHash *hash, cpHandle *hand)
+{
+	cpSpaceHashRect rect = hand->rect;
+	cpTimestamp *stamps = hash->cellStamps;
+	cpTimestamp stamp = hash->stamp++;
+	int mask = hash->numcells - 1;
+	
+	cpSpaceHashEntry entry = {hand->obj, hand->bb, hand};
+	
+	for(int i=rect.l; i<=rect.r; i++){
+		for(int j=rect.b; j<=rect.t; j++){
+			int idx = hash_func(i,j,mask);
+			if(stamps[idx] == stamp) continue;
+			
+			stamps[idx] = stamp;
+			cellAddEntry(hash, idx, entry);
+		}
+	}
+}
+
+// Removes a handle's copies from the cells.
+static void
+unlinkHandle(cpSpaceHash *hash, cpHandle *hand)
+{
+	if(hash->stale) return;
+	
+	cpSpaceHashRect rect = hand->rect;
+	int mask = hash->numcells - 1;
+	
+	for(int i=rect.l; i<=rect.r; i++){
+		for(int j=rect.b; j<=rect.t; j++){
+			cellRemoveEntry(hash, hash_func(i,j,mask), hand);
+		}
+	}
+}
+
+// Update the copies of a handle after its bbox changed.
+// They are only moved if the handle changed cells.
+static void
+moveHandle(cpSpaceHash *hash, cpHandle *hand)
+{
+	cpSpaceHashRect rect = cellRectForBB(hash, hand->bb);
+	
+	if(hash->stale){
+		hand->rect = rect;
+	} else if(cellRectEql(rect, hand->rect)){
+		int mask = hash->numcells - 1;
+		for(int i=rect.l; i<=rect.r; i++){
+			for(int j=rect.b; j<=rect.t; j++){
+				cellUpdateEntry(hash, hash_func(i,j,mask), hand);
+			}
+		}
+	} else {
+		unlinkHandle(hash, hand);
+		hand->rect = rect;
+		linkHandle(hash, hand);
+	}
+}
+
+#pragma mark Table Building
+
+// First pass of the counting sort. Count how many entries land in each cell.
+static void
+countHandleHelper(cpHandle *hand, cpSpaceHash *hash)
+{
+	cpSpaceHashRect rect = hand->rect = cellRectForBB(hash, hand->bb);
+	
+	cpSpaceHashCell *cells = hash->cells;
+	cpTimestamp *stamps = hash->cellStamps;
+	cpTimestamp stamp = hash->stamp++;
+	int mask = hash->numcells - 1;
+	
+	for(int i=rect.l; i<=rect.r; i++){
+		for(int j=rect.b; j<=rect.t; j++){
+			int idx = hash_func(i,j,mask);
+			if(stamps[idx] == stamp) continue;
+			
+			stamps[idx] = stamp;
+			if(cells[idx].count++ == 0) hash->touchedCells[hash->numTouched++] = idx;
+		}
+	}
+}
+
+// Second pass of the counting sort. Copy the handle into each of its cells.
+static void fillHandleHelper(cpHandle *hand, cpSpaceHash *hash){linkHandle(hash, hand);}
+
+// Rebuild the cells from scratch. Each cell becomes a span of the flat entry array.
+// Only the cells that were touched since the last rebuild need to be cleared.
+static void
+rebuildTable(cpSpaceHash *hash)
+{
+	cpSpaceHashCell *cells = hash->cells;
+	int *touched = hash->touchedCells;
+	
+	cpSpaceHashCell empty = {0, 0, 0};
+	for(int i=0; i<hash->numTouched; i++) cells[touched[i]] = empty;
+	
+	hash->numTouched = 0;
+	cpHashSetEach(hash->handleSet, (cpHashSetIterFunc)countHandleHelper, hash);
+	
+	// Lay out the spans, leaving some spare room in each occupied cell.
+	int used = 0;
+	for(int i=0; i<hash->numTouched; i++){
+		int idx = touched[i];
+		int count = cells[idx].count;
+		
+		cells[idx].start = used;
+		cells[idx].count = 0;
+		cells[idx].capacity = count + (count>>1) + 1;
+		used += cells[idx].capacity;
+	}
+	
+	growEntries(hash, used);
+	hash->numEntries = 0;
+	hash->usedEntries = used;
+	hash->wastedEntries = 0;
+	hash->numOccupied = 0;
+	
+	hash->stale = cpFalse;
+	cpHashSetEach(hash->handleSet, (cpHashSetIterFunc)fillHandleHelper, hash);
+	
+	hash->pendingHandles->num = 0;
+}
+
+// Add the handles inserted since the last update to the cells.
+static void
+linkPendingHandles(cpSpaceHash *hash)
+{
+	cpArray *pending = hash->pendingHandles;
+	
+	// Rebuilding is cheaper when many objects were added at once.
+	if(pending->num*2 > hash->handleSet->entries) hash->stale = cpTrue;
+	
+	if(!hash->stale){
+		for(int i=0; i<pending->num; i++) linkHandle(hash, (cpHandle *)pending->arr[i]);
+	}
+	
+	pending->num = 0;
+}
+
+// Make sure the cells are up to date before running a query.
+// Rebuilds the cells if they are stale, or if moving cells around has wasted too much space.
+static inline void
+flushPendingHandles(cpSpaceHash *hash)
+{
+	if(hash->pendingHandles->num) linkPendingHandles(hash);
+	if(hash->stale || hash->wastedEntries > hash->usedEntries/2) rebuildTable(hash);
+}
+
+// Number of updates to gather stats over before auto tuning the hash.
+#define TUNE_INTERVAL 60
+
+// Pick a new cell size and table size using the stats from the last several updates.
+// The hash is only resized when it is well outside of its sweet spot so it doesn't thrash.
+static void
+tuneHash(cpSpaceHash *hash)
+{
+	int updates = hash->tuneUpdates;
+	int handles = hash->tuneHandles;
+	if(updates < TUNE_INTERVAL) return;
+	
+	if(handles && hash->tuneOccupied){
+		// Average size of the objects.
+		cpFloat extent = hash->tuneExtent/handles;
+		// Number of cells each object was copied to.
+		cpFloat cellsPerHandle = (cpFloat)hash->tuneEntries/handles;
+		// Average number of entries in a non-empty cell.
+		cpFloat chainLength = (cpFloat)hash->tuneEntries/hash->tuneOccupied;
+		// Fraction of the table in use.
+		cpFloat load = (cpFloat)hash->tuneEntries/((cpFloat)updates*hash->numcells);
+		
+		cpFloat dim = hash->celldim;
+		if(extent > 0.0f && (extent > dim*1.5f || extent < dim/1.5f)){
+			// Objects copied into many cells mean the cells are too small.
+			// Long chains in a lightly loaded table mean the cells are too large.
+			if(cellsPerHandle > 4.0f || (chainLength > 4.0f && load < 0.5f)) dim = extent;
+		}
+		
+		// Estimate the number of entries for the new cell size and keep the table about half full.
+		cpFloat cellsAcross = extent/dim + 1.0f;
+		int expected = (int)((cpFloat)handles/updates*cellsAcross*cellsAcross) + 1;
+		
+		int numcells = hash->numcells;
+		if(dim != hash->celldim || numcells < expected || numcells > expected*16){
+			cpSpaceHashResize(hash, dim, expected*2);
 		}
 	}
+	
+	cpSpaceHashSetAutoTune(hash, cpTrue);
+}
+
+// Refresh the bbox of a handle and remember it if it changed.
+static void
+refreshHandleHelper(cpHandle *hand, cpSpaceHash *hash)
+{
+	cpBB bb = hash->spatialIndex.bbfunc(hand->obj);
+	if(hash->autoTune) hash->tuneExtent += cpfmax(bb.r - bb.l, bb.t - bb.b);
+	
+	if(!bbEql(bb, hand->bb)){
+		hand->bb = bb;
+		cpArrayPush(hash->dirtyHandles, hand);
+	}
+}
+
+// Refresh the bboxes of all the handles. Only the ones that changed are updated in the cells.
+static void
+updateTable(cpSpaceHash *hash)
+{
+	if(hash->autoTune) tuneHash(hash);
+	
+	if(hash->pendingHandles->num) linkPendingHandles(hash);
+	
+	cpArray *dirty = hash->dirtyHandles;
+	cpHashSetEach(hash->handleSet, (cpHashSetIterFunc)refreshHandleHelper, hash);
+	
+	// Rebuilding is cheaper than updating when most of the objects moved.
+	if(dirty->num*3 > hash->handleSet->entries*2) hash->stale = cpTrue;
+	
+	if(!hash->stale){
+		for(int i=0; i<dirty->num; i++) moveHandle(hash, (cpHandle *)dirty->arr[i]);
+	}
+	
+	dirty->num = 0;
+	if(hash->stale || hash->wastedEntries > hash->usedEntries/2) rebuildTable(hash);
+	
+	if(hash->autoTune){
+		hash->tuneUpdates++;
+		hash->tuneHandles += hash->handleSet->entries;
+		hash->tuneEntries += hash->numEntries;
+		hash->tuneOccupied += hash->numOccupied;
+	}
 }
 
+#pragma mark Insert/Remove
+
 void
 cpSpaceHashInsert(cpSpaceHash *hash, void *obj, cpHashValue hashid, cpBB _deprecated_unused)
 {
 	cpHandle *hand = (cpHandle *)cpHashSetInsert(hash->handleSet, hashid, obj, hash);
-	hashHandle(hash, hand, hash->bbfunc(obj));
+	
+	hand->bb = hash->spatialIndex.bbfunc(obj);
+	hand->rect = cellRectForBB(hash, hand->bb);
+	cpArrayPush(hash->pendingHandles, hand);
 }
 
 void
 cpSpaceHashRehashObject(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
+	cpHandle *hand = (cpHandle *)cpHashSetFind(hash->handleSet, hashid, obj);
 	
 	if(hand){
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
+		hand->bb = hash->spatialIndex.bbfunc(obj);
 		
-		cpSpaceHashInsert(hash, obj, hashid, cpBBNew(0.0f, 0.0f, 0.0f, 0.0f));
+		if(cpArrayContains(hash->pendingHandles, hand)){
+			// Pending handles aren't in the cells yet. Link it now instead.
+			cpArrayDeleteObj(hash->pendingHandles, hand);
+			
+			hand->rect = cellRectForBB(hash, hand->bb);
+			if(!hash->stale) linkHandle(hash, hand);
+		} else {
+			moveHandle(hash, hand);
+		}
 	}
 }
 
-static void handleRehashHelper(cpHandle *hand, cpSpaceHash *hash){hashHandle(hash, hand, hash->bbfunc(hand->obj));}
-
 void
 cpSpaceHashRehash(cpSpaceHash *hash)
 {
-	clearHash(hash);
-	cpHashSetEach(hash->handleSet, (cpHashSetIterFunc)handleRehashHelper, hash);
+	updateTable(hash);
 }
 
 void
@@ -289,8 +584,11 @@ cpSpaceHashRemove(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
 	
 	if(hand){
+		cpArrayDeleteObj(hash->pendingHandles, hand);
+		unlinkHandle(hash, hand);
+		
 		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
+		cpArrayPush(hash->pooledHandles, hand);
 	}
 }
 
@@ -309,166 +607,121 @@ cpSpaceHashEach(cpSpaceHash *hash, cpSpaceHashIterator func, void *data)
 	cpHashSetEach(hash->handleSet, (cpHashSetIterFunc)eachHelper, &pair);
 }
 
-static inline void
-removeOrphanedHandles(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr)
+void
+cpSpaceHashFlush(cpSpaceHash *hash)
 {
-	cpSpaceHashBin *bin = *bin_ptr;
-	while(bin){
-		cpHandle *hand = bin->handle;
-		cpSpaceHashBin *next = bin->next;
-		
-		if(!hand->obj){
-			// orphaned handle, unlink and recycle the bin
-			(*bin_ptr) = bin->next;
-			recycleBin(hash, bin);
-			
-			cpHandleRelease(hand, hash->pooledHandles);
-		} else {
-			bin_ptr = &bin->next;
-		}
-		
-		bin = next;
-	}
+	flushPendingHandles(hash);
 }
 
-// Calls the callback function for the objects in a given chain.
-static inline void
-query(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpaceHashQueryFunc func, void *data)
-{
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
-		
-		if(hand->stamp == hash->stamp || obj == other){
-			continue;
-		} else if(other){
-			func(obj, other, data);
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			removeOrphanedHandles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
-	}
-}
+#pragma mark Query Functions
 
 void
 cpSpaceHashPointQuery(cpSpaceHash *hash, cpVect point, cpSpaceHashQueryFunc func, void *data)
 {
+	flushPendingHandles(hash);
+	
 	cpFloat dim = hash->celldim;
-	int idx = hash_func(floor_int(point.x/dim), floor_int(point.y/dim), hash->numcells);  // Fix by ShiftZ
+	int idx = hash_func(floor_int(point.x/dim), floor_int(point.y/dim), hash->numcells - 1);  // Fix by ShiftZ
 	
-	query(hash, &hash->table[idx], &point, func, data);
-	hash->stamp++;
+	cpSpaceHashCell cell = hash->cells[idx];
+	cpSpaceHashEntry *entries = hash->entries + cell.start;
+	for(int k=0; k<cell.count; k++){
+		cpSpaceHashEntry entry = entries[k];
+		if(bbContainsPoint(entry.bb, point)) func(&point, entry.obj, data);
+	}
 }
 
 void
 cpSpaceHashQuery(cpSpaceHash *hash, void *obj, cpBB bb, cpSpaceHashQueryFunc func, void *data)
 {
+	flushPendingHandles(hash);
+	
 	// Get the dimensions in cell coordinates.
-	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim);  // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
+	cpSpaceHashRect rect = cellRectForBB(hash, bb);
+	int mask = hash->numcells - 1;
 	
-	int n = hash->numcells;
-	cpSpaceHashBin **table = hash->table;
+	cpSpaceHashCell *cells = hash->cells;
 	
 	// Iterate over the cells and query them.
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			query(hash, &table[hash_func(i,j,n)], obj, func, data);
+	for(int i=rect.l; i<=rect.r; i++){
+		for(int j=rect.b; j<=rect.t; j++){
+			cpSpaceHashCell cell = cells[hash_func(i,j,mask)];
+			cpSpaceHashEntry *entries = hash->entries + cell.start;
+			
+			for(int k=0; k<cell.count; k++){
+				cpSpaceHashEntry entry = entries[k];
+				
+				if(
+					entry.obj != obj &&
+					cpBBintersects(bb, entry.bb) &&
+					pairOwnedByCell(hash, bb, entry.bb, i, j)
+				){
+					func(obj, entry.obj, data);
+				}
+			}
 		}
 	}
-	
-	hash->stamp++;
 }
 
-// Similar to struct eachPair above.
-typedef struct queryRehashPair {
-	cpSpaceHash *hash;
-	cpSpaceHashQueryFunc func;
-	void *data;
-} queryRehashPair;
-
-// Hashset iterator func used with cpSpaceHashQueryRehash().
-static void
-handleQueryRehashHelper(void *elt, void *data)
+// Report the overlapping pairs that the cell owns.
+static inline void
+queryCell(cpSpaceHash *hash, int idx, cpSpaceHashQueryFunc func, void *data)
 {
-	cpHandle *hand = (cpHandle *)elt;
-	
-	// Unpack the user callback data.
-	queryRehashPair *pair = (queryRehashPair *)data;
-	cpSpaceHash *hash = pair->hash;
-	cpSpaceHashQueryFunc func = pair->func;
-
 	cpFloat dim = hash->celldim;
-	int n = hash->numcells;
-
-	void *obj = hand->obj;
-	cpBB bb = hash->bbfunc(obj);
-
-	int l = floor_int(bb.l/dim);
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
+	int mask = hash->numcells - 1;
 	
-	cpSpaceHashBin **table = hash->table;
-
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			int idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = table[idx];
-			
-			if(containsHandle(bin, hand)) continue;
-			
-			cpHandleRetain(hand); // this MUST be done first in case the object is removed in func()
-			query(hash, &bin, obj, func, pair->data);
+	cpSpaceHashCell cell = hash->cells[idx];
+	cpSpaceHashEntry *entries = hash->entries + cell.start;
+	
+	for(int k1=0; k1<cell.count; k1++){
+		cpSpaceHashEntry a = entries[k1];
+		
+		for(int k2=k1+1; k2<cell.count; k2++){
+			cpSpaceHashEntry b = entries[k2];
 			
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			table[idx] = newBin;
+			if(
+				cpBBintersects(a.bb, b.bb) &&
+				// Only the cell with the corner of the overlap reports the pair.
+				hash_func(floor_int(cpfmax(a.bb.l, b.bb.l)/dim), floor_int(cpfmax(a.bb.b, b.bb.b)/dim), mask) == idx
+			){
+				func(a.obj, b.obj, data);
+			}
 		}
 	}
-	
-	// Increment the stamp for each object hashed.
-	hash->stamp++;
 }
 
 void
 cpSpaceHashQueryRehash(cpSpaceHash *hash, cpSpaceHashQueryFunc func, void *data)
 {
-	clearHash(hash);
-	
-	queryRehashPair pair = {hash, func, data};
-	cpHashSetEach(hash->handleSet, &handleQueryRehashHelper, &pair);
+	updateTable(hash);
+	
+	cpSpaceHashCell *cells = hash->cells;
+	int *touched = hash->touchedCells;
+	for(int i=0; i<hash->numTouched; i++){
+		// Cells with a single entry can't contain a pair.
+		int idx = touched[i];
+		if(cells[idx].count > 1) queryCell(hash, idx, func, data);
+	}
 }
 
+// Query the objects in cell (i, j) that the segment reaches for the first time.
+// The cells are walked in a staircase that never turns back, so it enters an object's range of cells
+// exactly once. An object is reported in the first cell of its range that the walk visits.
+// Nothing needs to be written to the hash to skip duplicates, so queries can run concurrently.
 static inline cpFloat
-segmentQuery(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpaceHashSegmentQueryFunc func, void *data)
+segmentQuery(cpSpaceHash *hash, int i, int j, int prev_i, int prev_j, void *obj, cpSpaceHashSegmentQueryFunc func, void *data)
 {
 	cpFloat t = 1.0f;
-	 
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
+	
+	cpSpaceHashCell cell = hash->cells[hash_func(i, j, hash->numcells - 1)];
+	cpSpaceHashEntry *entries = hash->entries + cell.start;
+	for(int k=0; k<cell.count; k++){
+		cpSpaceHashEntry entry = entries[k];
+		cpSpaceHashRect rect = entry.handle->rect;
 		
-		// Skip over certain conditions
-		if(hand->stamp == hash->stamp){
-			continue;
-		} else if(other){
-			t = cpfmin(t, func(obj, other, data));
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			removeOrphanedHandles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
+		// Skip objects from other cells that share the same hash bucket and objects that were already found.
+		if(cellRectContains(rect, i, j) && !cellRectContains(rect, prev_i, prev_j)){
+			t = cpfmin(t, func(obj, entry.obj, data));
 		}
 	}
 	
@@ -478,16 +731,18 @@ segmentQuery(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpaceHash
 // modified from http://playtechs.blogspot.com/2007/03/raytracing-on-grid.html
 void cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpaceHashSegmentQueryFunc func, void *data)
 {
+	flushPendingHandles(hash);
+	
 	a = cpvmult(a, 1.0f/hash->celldim);
 	b = cpvmult(b, 1.0f/hash->celldim);
 	
 	int cell_x = floor_int(a.x), cell_y = floor_int(a.y);
-
+	
 	cpFloat t = 0;
-
+	
 	int x_inc, y_inc;
 	cpFloat temp_v, temp_h;
-
+	
 	if (b.x > a.x){
 		x_inc = 1;
 		temp_h = (cpffloor(a.x + 1.0f) - a.x);
@@ -495,7 +750,7 @@ void cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, c
 		x_inc = -1;
 		temp_h = (a.x - cpffloor(a.x));
 	}
-
+	
 	if (b.y > a.y){
 		y_inc = 1;
 		temp_v = (cpffloor(a.y + 1.0f) - a.y);
@@ -508,17 +763,18 @@ void cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, c
 	cpFloat dx = cpfabs(b.x - a.x), dy = cpfabs(b.y - a.y);
 	cpFloat dt_dx = (dx ? 1.0f/dx : INFINITY), dt_dy = (dy ? 1.0f/dy : INFINITY);
 	
-	// fix NANs in horizontal directions
-	cpFloat next_h = (temp_h ? temp_h*dt_dx : dt_dx);
-	cpFloat next_v = (temp_v ? temp_v*dt_dy : dt_dy);
+	// Avoid 0*INFINITY NANs for segments parallel to an axis. A zero distance to the
+	// next cell is valid when the segment starts on a cell edge and moves away from it.
+	cpFloat next_h = (dx ? temp_h*dt_dx : INFINITY);
+	cpFloat next_v = (dy ? temp_v*dt_dy : INFINITY);
+	
+	// The first cell doesn't have a previous cell. Pass one that can't be in any object's range.
+	int prev_x = INT_MIN, prev_y = INT_MIN;
 	
-	cpSpaceHashBin **table = hash->table;
-
-	int n = hash->numcells;
 	while(t < t_exit){
-		int idx = hash_func(cell_x, cell_y, n);
-		t_exit = cpfmin(t_exit, segmentQuery(hash, &table[idx], obj, func, data));
-
+		t_exit = cpfmin(t_exit, segmentQuery(hash, cell_x, cell_y, prev_x, prev_y, obj, func, data));
+		prev_x = cell_x, prev_y = cell_y;
+		
 		if (next_v < next_h){
 			cell_y += y_inc;
 			t = next_v;
@@ -529,6 +785,46 @@ void cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, c
 			next_h += dt_dx;
 		}
 	}
-	
-	hash->stamp++;
 }
+#pragma mark Spatial Index Implementation
+
+cpBool
+cpSpatialIndexIsSpaceHash(cpSpatialIndex *index)
+{
+	return (index->klass == Klass());
+}
+
+static int cpSpaceHashCount(cpSpaceHash *hash){return hash->handleSet->entries;}
+
+static cpBool
+cpSpaceHashContains(cpSpaceHash *hash, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(hash->handleSet, hashid, obj) != NULL);
+}
+
+static void
+cpSpaceHashInsertImpl(cpSpaceHash *hash, void *obj, cpHashValue hashid)
+{
+	cpSpaceHashInsert(hash, obj, hashid, cpBBNew(0.0f, 0.0f, 0.0f, 0.0f));
+}
+
+static const cpSpatialIndexClass klass = {
+	(void (*)(cpSpatialIndex *))cpSpaceHashDestroy,
+	
+	(int (*)(cpSpatialIndex *))cpSpaceHashCount,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexIterator, void *))cpSpaceHashEach,
+	(cpBool (*)(cpSpatialIndex *, void *, cpHashValue))cpSpaceHashContains,
+	
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSpaceHashInsertImpl,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSpaceHashRemove,
+	
+	(void (*)(cpSpatialIndex *))cpSpaceHashRehash,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSpaceHashRehashObject,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexQueryFunc, void *))cpSpaceHashQueryRehash,
+	(void (*)(cpSpatialIndex *))cpSpaceHashFlush,
+	
+	(void (*)(cpSpatialIndex *, cpVect, cpSpatialIndexQueryFunc, void *))cpSpaceHashPointQuery,
+	(void (*)(cpSpatialIndex *, void *, cpBB, cpSpatialIndexQueryFunc, void *))cpSpaceHashQuery,
+	(void (*)(cpSpatialIndex *, void *, cpVect, cpVect, cpFloat, cpSpatialIndexSegmentQueryFunc, void *))cpSpaceHashSegmentQuery,
+};
+static inline const cpSpatialIndexClass *Klass(void){return &klass;}
@@ -19,10 +19,92 @@
  * SOFTWARE.
  */
  
+#include <math.h>
 #include <stdlib.h>
 
 #include "chipmunk_private.h"
 
+#pragma mark Concurrent Queries
+
+// Queries normally lock the space so their callbacks can't modify it.
+// Between cpSpaceBeginConcurrentQueries() and cpSpaceEndConcurrentQueries() the space is already locked,
+// and the lock count is left alone so that queries running on several threads don't race on it.
+static inline void
+queryLock(cpSpace *space)
+{
+	if(!space->concurrentQueries) cpSpaceLock(space);
+}
+
+static inline void
+queryUnlock(cpSpace *space)
+{
+	if(!space->concurrentQueries) cpSpaceUnlock(space);
+}
+
+// Like cpShapeCacheBB(), but doesn't touch the body's transform generation so concurrent queries can share bodies.
+// The shape is recached by the next step if it's in a space.
+static cpBB
+cacheQueryShape(cpShape *shape)
+{
+	cpBody *body = shape->body;
+	
+	shape->transformGeneration = 0;
+	shape->bb = shape->klass->cacheData(shape, body->p, body->rot);
+	return shape->bb;
+}
+
+void
+cpSpaceBeginConcurrentQueries(cpSpace *space)
+{
+	cpAssert(!space->locked, "Concurrent queries cannot be started during a call to cpSpaceStep() or during a query.");
+	
+	// The indexes link in pending changes lazily when they are first queried.
+	// Do it now so that the concurrent queries only read from them.
+	cpSpatialIndexFlush(space->activeShapes);
+	cpSpatialIndexFlush(space->staticShapes);
+	
+	cpSpaceLock(space);
+	space->concurrentQueries = cpTrue;
+}
+
+void
+cpSpaceEndConcurrentQueries(cpSpace *space)
+{
+	cpAssert(space->concurrentQueries, "cpSpaceEndConcurrentQueries() called without calling cpSpaceBeginConcurrentQueries() first.");
+	
+	space->concurrentQueries = cpFalse;
+	cpSpaceUnlock(space);
+}
+
+// Shared context for the query variants that write their results into a caller provided buffer.
+// Hits past the capacity are counted but not written.
+typedef struct queryBufferContext {
+	cpLayers layers;
+	cpGroup group;
+	
+	cpShape **shapes;
+	int capacity;
+	int count;
+} queryBufferContext;
+
+static inline cpBool
+queryBufferRejects(queryBufferContext *context, cpShape *shape)
+{
+	return (shape->group && context->group == shape->group) || !(context->layers&shape->layers);
+}
+
+// Returns the index the hit was written to, or -1 if the buffer is full.
+// Queries that write their own result structs pass a NULL shape buffer.
+static inline int
+queryBufferPush(queryBufferContext *context, cpShape *shape)
+{
+	int i = context->count++;
+	if(i >= context->capacity) return -1;
+	
+	if(context->shapes) context->shapes[i] = shape;
+	return i;
+}
+
 #pragma mark Point Query Functions
 
 typedef struct pointQueryContext {
@@ -48,10 +130,29 @@ cpSpacePointQuery(cpSpace *space, cpVect point, cpLayers layers, cpGroup group,
 {
 	pointQueryContext context = {layers, group, func, data};
 	
-	cpSpaceLock(space); {
-		cpSpaceHashPointQuery(space->activeShapes, point, (cpSpaceHashQueryFunc)pointQueryHelper, &context);
-		cpSpaceHashPointQuery(space->staticShapes, point, (cpSpaceHashQueryFunc)pointQueryHelper, &context);
-	} cpSpaceUnlock(space);
+	queryLock(space); {
+		cpSpatialIndexPointQuery(space->activeShapes, point, (cpSpatialIndexQueryFunc)pointQueryHelper, &context);
+		cpSpatialIndexPointQuery(space->staticShapes, point, (cpSpatialIndexQueryFunc)pointQueryHelper, &context);
+	} queryUnlock(space);
+}
+
+static void
+pointQueryIntoHelper(cpVect *point, cpShape *shape, queryBufferContext *context)
+{
+	if(!queryBufferRejects(context, shape) && cpShapePointQuery(shape, *point)) queryBufferPush(context, shape);
+}
+
+int
+cpSpacePointQueryInto(cpSpace *space, cpVect point, cpLayers layers, cpGroup group, cpShape **out, int capacity)
+{
+	queryBufferContext context = {layers, group, out, capacity, 0};
+	
+	queryLock(space); {
+		cpSpatialIndexPointQuery(space->activeShapes, point, (cpSpatialIndexQueryFunc)pointQueryIntoHelper, &context);
+		cpSpatialIndexPointQuery(space->staticShapes, point, (cpSpatialIndexQueryFunc)pointQueryIntoHelper, &context);
+	} queryUnlock(space);
+	
+	return context.count;
 }
 
 static void
@@ -70,6 +171,337 @@ cpSpacePointQueryFirst(cpSpace *space, cpVect point, cpLayers layers, cpGroup gr
 }
 
 
+#pragma mark Batched Point Query Functions
+
+// Max number of points tested against each shape at once.
+#define POINT_BATCH_SIZE 64
+
+// Batched queries are sorted by the grid cell they start in so nearby queries are processed together.
+typedef struct batchKey {
+	unsigned long long cell;
+	int sub;
+	int index;
+} batchKey;
+
+static inline batchKey
+batchKeyNew(cpVect p, cpFloat dim, int sub, int index)
+{
+	unsigned int cx = (unsigned int)(int)cpffloor(p.x/dim);
+	unsigned int cy = (unsigned int)(int)cpffloor(p.y/dim);
+	
+	batchKey key = {((unsigned long long)cx<<32) | cy, sub, index};
+	return key;
+}
+
+static int
+batchKeyCompare(const batchKey *a, const batchKey *b)
+{
+	if(a->cell != b->cell) return (a->cell < b->cell ? -1 : 1);
+	if(a->sub != b->sub) return a->sub - b->sub;
+	return a->index - b->index;
+}
+
+static inline void
+batchKeySort(batchKey *keys, int count)
+{
+	qsort(keys, count, sizeof(batchKey), (int (*)(const void *, const void *))batchKeyCompare);
+}
+
+typedef struct pointBatchContext {
+	cpLayers layers;
+	cpGroup group;
+	
+	// The points in the group being queried, stored as separate x and y arrays for the kernels below.
+	int count;
+	cpFloat x[POINT_BATCH_SIZE], y[POINT_BATCH_SIZE];
+	int indexes[POINT_BATCH_SIZE];
+	
+	// Output for cpSpacePointQueryBatch().
+	cpShape **outShapes;
+	int *outPoints;
+	int capacity;
+	int numHits;
+	
+	// Output for cpSpacePointQueryFirstBatch().
+	cpShape **outFirst;
+} pointBatchContext;
+
+// Test all of the points in the group against a single shape.
+// The loops are kept branch free so the compiler can vectorize them.
+static void
+pointBatchTest(cpShape *shape, pointBatchContext *context, unsigned char *inside)
+{
+	const cpFloat *x = context->x, *y = context->y;
+	int count = context->count;
+	
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: {
+			cpCircleShape *circle = (cpCircleShape *)shape;
+			cpFloat cx = circle->tc.x, cy = circle->tc.y, rsq = circle->r*circle->r;
+			
+			for(int k=0; k<count; k++){
+				cpFloat dx = x[k] - cx, dy = y[k] - cy;
+				inside[k] = (dx*dx + dy*dy < rsq);
+			}
+		} break;
+		case CP_POLY_SHAPE: {
+			cpPolyShape *poly = (cpPolyShape *)shape;
+			cpPolyShapeAxis *axes = poly->tAxes;
+			
+			for(int k=0; k<count; k++) inside[k] = 1;
+			for(int i=0; i<poly->numVerts; i++){
+				cpFloat nx = axes[i].n.x, ny = axes[i].n.y, d = axes[i].d;
+				for(int k=0; k<count; k++) inside[k] &= (nx*x[k] + ny*y[k] <= d);
+			}
+		} break;
+		default:
+			for(int k=0; k<count; k++) inside[k] = cpShapePointQuery(shape, cpv(x[k], y[k]));
+			break;
+	}
+}
+
+static void
+pointBatchHelper(pointBatchContext *context, cpShape *shape, void *unused)
+{
+	if((shape->group && context->group == shape->group) || !(context->layers&shape->layers)) return;
+	
+	unsigned char inside[POINT_BATCH_SIZE];
+	pointBatchTest(shape, context, inside);
+	
+	for(int k=0; k<context->count; k++){
+		if(!inside[k]) continue;
+		
+		if(context->outFirst){
+			if(!shape->sensor) context->outFirst[context->indexes[k]] = shape;
+		} else {
+			int hit = context->numHits++;
+			if(hit < context->capacity){
+				context->outShapes[hit] = shape;
+				context->outPoints[hit] = context->indexes[k];
+			}
+		}
+	}
+}
+
+// Size of the cells used to group the points.
+// Matches the cells of a spatial hash so each group walks a single cell.
+// Otherwise it's picked so a group gets a few points on average.
+static cpFloat
+pointBatchCellDim(cpSpatialIndex *index, const cpVect *points, int count)
+{
+	if(cpSpatialIndexIsSpaceHash(index)) return ((cpSpaceHash *)index)->celldim;
+	
+	cpBB bb = cpBBNew(points[0].x, points[0].y, points[0].x, points[0].y);
+	for(int i=1; i<count; i++) bb = cpBBexpand(bb, points[i]);
+	
+	cpFloat dim = 2.0f*cpfsqrt((bb.r - bb.l)*(bb.t - bb.b)/count);
+	return (dim > 0.0f ? dim : 1.0f);
+}
+
+static void
+pointBatchQueryIndex(cpSpatialIndex *index, const cpVect *points, int count, batchKey *keys, pointBatchContext *context)
+{
+	if(cpSpatialIndexCount(index) == 0) return;
+	
+	cpFloat dim = pointBatchCellDim(index, points, count);
+	for(int i=0; i<count; i++) keys[i] = batchKeyNew(points[i], dim, 0, i);
+	batchKeySort(keys, count);
+	
+	// Query the index once for each run of points in the same cell.
+	for(int start=0; start<count;){
+		int end = start + 1;
+		while(end < count && end - start < POINT_BATCH_SIZE && keys[end].cell == keys[start].cell) end++;
+		
+		cpVect p = points[keys[start].index];
+		cpBB bb = cpBBNew(p.x, p.y, p.x, p.y);
+		
+		context->count = end - start;
+		for(int k=0; k<context->count; k++){
+			int idx = keys[start + k].index;
+			p = points[idx];
+			
+			context->x[k] = p.x;
+			context->y[k] = p.y;
+			context->indexes[k] = idx;
+			bb = cpBBexpand(bb, p);
+		}
+		
+		cpSpatialIndexQuery(index, context, bb, (cpSpatialIndexQueryFunc)pointBatchHelper, NULL);
+		start = end;
+	}
+}
+
+static void
+pointBatchQuery(cpSpace *space, const cpVect *points, int count, pointBatchContext *context)
+{
+	if(count <= 0) return;
+	batchKey *keys = (batchKey *)cpmalloc(count*sizeof(batchKey));
+	
+	queryLock(space); {
+		pointBatchQueryIndex(space->activeShapes, points, count, keys, context);
+		pointBatchQueryIndex(space->staticShapes, points, count, keys, context);
+	} queryUnlock(space);
+	
+	cpfree(keys);
+}
+
+int
+cpSpacePointQueryBatch(cpSpace *space, const cpVect *points, int count, cpLayers layers, cpGroup group, cpShape **outShapes, int *outPoints, int capacity)
+{
+	pointBatchContext context = {layers, group};
+	context.outShapes = outShapes;
+	context.outPoints = outPoints;
+	context.capacity = capacity;
+	
+	pointBatchQuery(space, points, count, &context);
+	return context.numHits;
+}
+
+void
+cpSpacePointQueryFirstBatch(cpSpace *space, const cpVect *points, int count, cpLayers layers, cpGroup group, cpShape **out)
+{
+	for(int i=0; i<count; i++) out[i] = NULL;
+	
+	pointBatchContext context = {layers, group};
+	context.outFirst = out;
+	
+	pointBatchQuery(space, points, count, &context);
+}
+
+#pragma mark Nearest Point Query Functions
+
+typedef struct nearestQueryContext {
+	cpVect point;
+	cpFloat maxDistance;
+	cpLayers layers;
+	cpGroup group;
+	
+	// The area being searched, and the area searched by the previous ring.
+	// Shapes overlapping the previous ring were already tested.
+	cpBB ring, searched;
+	cpBool hasSearched;
+	// Number of shapes overlapping the current ring.
+	int visited;
+	
+	// The k closest shapes found so far, sorted by distance.
+	cpNearestPointQueryInfo *out;
+	int k, count;
+} nearestQueryContext;
+
+static inline cpFloat
+bbDistance(cpBB bb, cpVect p)
+{
+	cpFloat dx = cpfmax(cpfmax(bb.l - p.x, p.x - bb.r), 0.0f);
+	cpFloat dy = cpfmax(cpfmax(bb.b - p.y, p.y - bb.t), 0.0f);
+	return cpfsqrt(dx*dx + dy*dy);
+}
+
+// Distance a shape has to beat to make it into the results.
+static inline cpFloat
+nearestQueryBound(nearestQueryContext *context)
+{
+	return (context->count < context->k ? context->maxDistance : context->out[context->k - 1].d);
+}
+
+static void
+nearestQueryHelper(nearestQueryContext *context, cpShape *shape, void *unused)
+{
+	// Shapes outside of the ring are left for a later ring to find.
+	if(!cpBBintersects(shape->bb, context->ring)) return;
+	context->visited++;
+	
+	if(
+		(context->hasSearched && cpBBintersects(shape->bb, context->searched)) ||
+		(shape->group && context->group == shape->group) ||
+		!(context->layers&shape->layers) ||
+		shape->sensor
+	) return;
+	
+	// The bbox distance is only a lower bound when the point is outside of it.
+	// Shapes containing the point can have any negative distance.
+	cpFloat bound = nearestQueryBound(context);
+	cpFloat bbDist = bbDistance(shape->bb, context->point);
+	if(bbDist > 0.0f && bbDist > bound) return;
+	
+	cpNearestPointQueryInfo info;
+	cpShapeNearestPointQuery(shape, context->point, &info);
+	if(context->count < context->k ? info.d > bound : info.d >= bound) return;
+	
+	// Insertion sort it into the results.
+	cpNearestPointQueryInfo *out = context->out;
+	int i = (context->count < context->k ? context->count++ : context->k - 1);
+	for(; i>0 && out[i - 1].d > info.d; i--) out[i] = out[i - 1];
+	out[i] = info;
+}
+
+// Radius of the first ring to search.
+static cpFloat
+nearestQueryRadius(cpSpace *space, cpFloat maxDistance)
+{
+	if(cpSpatialIndexIsSpaceHash(space->activeShapes)) return ((cpSpaceHash *)space->activeShapes)->celldim;
+	if(cpSpatialIndexIsSpaceHash(space->staticShapes)) return ((cpSpaceHash *)space->staticShapes)->celldim;
+	
+	// Without a grid to go by, start at a fraction of the max distance.
+	return (maxDistance < INFINITY ? maxDistance/8.0f : 1.0f);
+}
+
+static int
+nearestQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpLayers layers, cpGroup group, cpNearestPointQueryInfo *out, int k)
+{
+	if(k <= 0) return 0;
+	
+	nearestQueryContext context = {point, maxDistance, layers, group};
+	context.out = out;
+	context.k = k;
+	
+	int total = cpSpatialIndexCount(space->activeShapes) + cpSpatialIndexCount(space->staticShapes);
+	cpFloat radius = nearestQueryRadius(space, maxDistance);
+	
+	// Search outwards in growing rings until no unsearched shape could be closer than the results.
+	queryLock(space); {
+		for(;;){
+			radius = cpfmin(radius, maxDistance);
+			context.ring = cpBBNew(point.x - radius, point.y - radius, point.x + radius, point.y + radius);
+			context.visited = 0;
+			
+			cpSpatialIndexQuery(space->activeShapes, &context, context.ring, (cpSpatialIndexQueryFunc)nearestQueryHelper, NULL);
+			cpSpatialIndexQuery(space->staticShapes, &context, context.ring, (cpSpatialIndexQueryFunc)nearestQueryHelper, NULL);
+			
+			if(
+				radius >= maxDistance ||
+				context.visited == total ||
+				(context.count == k && out[k - 1].d <= radius)
+			) break;
+			
+			context.searched = context.ring;
+			context.hasSearched = cpTrue;
+			radius *= 2.0f;
+		}
+	} queryUnlock(space);
+	
+	return context.count;
+}
+
+cpShape *
+cpSpaceNearestPointQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpLayers layers, cpGroup group, cpNearestPointQueryInfo *out)
+{
+	cpNearestPointQueryInfo info = {NULL, cpvzero, maxDistance};
+	if(out){
+		(*out) = info;
+	} else {
+		out = &info;
+	}
+	
+	nearestQuery(space, point, maxDistance, layers, group, out, 1);
+	return out->shape;
+}
+
+int
+cpSpaceNearestPointQueryK(cpSpace *space, cpVect point, cpFloat maxDistance, cpLayers layers, cpGroup group, cpNearestPointQueryInfo *out, int k)
+{
+	return nearestQuery(space, point, maxDistance, layers, group, out, k);
+}
+
 #pragma mark Segment Query Functions
 
 typedef struct segQueryContext {
@@ -103,10 +535,45 @@ cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpLayers layers, c
 		func,
 	};
 	
-	cpSpaceLock(space); {
-		cpSpaceHashSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpaceHashSegmentQueryFunc)segQueryFunc, data);
-		cpSpaceHashSegmentQuery(space->activeShapes, &context, start, end, 1.0f, (cpSpaceHashSegmentQueryFunc)segQueryFunc, data);
-	} cpSpaceUnlock(space);
+	queryLock(space); {
+		cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)segQueryFunc, data);
+		cpSpatialIndexSegmentQuery(space->activeShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)segQueryFunc, data);
+	} queryUnlock(space);
+}
+
+typedef struct segQueryIntoContext {
+	cpVect start, end;
+	queryBufferContext buffer;
+	cpSegmentQueryInfo *out;
+} segQueryIntoContext;
+
+static cpFloat
+segQueryIntoHelper(segQueryIntoContext *context, cpShape *shape, void *unused)
+{
+	cpSegmentQueryInfo info;
+	
+	if(
+		!queryBufferRejects(&context->buffer, shape) &&
+		cpShapeSegmentQuery(shape, context->start, context->end, &info)
+	){
+		int i = queryBufferPush(&context->buffer, shape);
+		if(i >= 0) context->out[i] = info;
+	}
+	
+	return 1.0f;
+}
+
+int
+cpSpaceSegmentQueryInto(cpSpace *space, cpVect start, cpVect end, cpLayers layers, cpGroup group, cpSegmentQueryInfo *out, int capacity)
+{
+	segQueryIntoContext context = {start, end, {layers, group, NULL, capacity, 0}, out};
+	
+	queryLock(space); {
+		cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)segQueryIntoHelper, NULL);
+		cpSpatialIndexSegmentQuery(space->activeShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)segQueryIntoHelper, NULL);
+	} queryUnlock(space);
+	
+	return context.buffer.count;
 }
 
 typedef struct segQueryFirstContext {
@@ -148,12 +615,241 @@ cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpLayers laye
 		layers, group
 	};
 	
-	cpSpaceHashSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpaceHashSegmentQueryFunc)segQueryFirst, out);
-	cpSpaceHashSegmentQuery(space->activeShapes, &context, start, end, out->t, (cpSpaceHashSegmentQueryFunc)segQueryFirst, out);
+	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)segQueryFirst, out);
+	cpSpatialIndexSegmentQuery(space->activeShapes, &context, start, end, out->t, (cpSpatialIndexSegmentQueryFunc)segQueryFirst, out);
 	
 	return out->shape;
 }
 
+#pragma mark Batched Segment Query Functions
+
+// Max number of segments in a bundle.
+#define SEGMENT_BUNDLE_SIZE 32
+// Max area of a bundle's bounding box, measured in grid cells.
+#define SEGMENT_BUNDLE_CELLS 16.0f
+
+// A bundle of nearby segments with similar directions.
+// The spatial index is only queried once with the bounds of the whole bundle,
+// and then each candidate shape is tested against every segment in it.
+typedef struct segBundleContext {
+	cpLayers layers;
+	cpGroup group;
+	
+	int count;
+	cpFloat ax[SEGMENT_BUNDLE_SIZE], ay[SEGMENT_BUNDLE_SIZE];
+	cpFloat bx[SEGMENT_BUNDLE_SIZE], by[SEGMENT_BUNDLE_SIZE];
+	
+	// Closest hit found so far for each segment.
+	cpFloat t[SEGMENT_BUNDLE_SIZE];
+	cpFloat nx[SEGMENT_BUNDLE_SIZE], ny[SEGMENT_BUNDLE_SIZE];
+	cpShape *shape[SEGMENT_BUNDLE_SIZE];
+} segBundleContext;
+
+static void
+segBundleCircle(segBundleContext *context, cpShape *shape, cpVect center, cpFloat r)
+{
+	int count = context->count;
+	cpFloat t[SEGMENT_BUNDLE_SIZE];
+	
+	// Same math as circleSegmentQuery() in cpShape.c, run across the whole bundle.
+	for(int k=0; k<count; k++){
+		cpFloat ax = context->ax[k] - center.x, ay = context->ay[k] - center.y;
+		cpFloat bx = context->bx[k] - center.x, by = context->by[k] - center.y;
+		
+		cpFloat aa = ax*ax + ay*ay, ab = ax*bx + ay*by, bb = bx*bx + by*by;
+		cpFloat qa = aa - 2.0f*ab + bb;
+		cpFloat qb = -2.0f*aa + 2.0f*ab;
+		cpFloat qc = aa - r*r;
+		
+		cpFloat det = qb*qb - 4.0f*qa*qc;
+		cpFloat hit = (-qb - cpfsqrt(cpfmax(det, 0.0f)))/(2.0f*qa);
+		t[k] = (det >= 0.0f && 0.0f <= hit && hit <= 1.0f ? hit : INFINITY);
+	}
+	
+	for(int k=0; k<count; k++){
+		if(t[k] < context->t[k]){
+			cpVect a = cpv(context->ax[k] - center.x, context->ay[k] - center.y);
+			cpVect b = cpv(context->bx[k] - center.x, context->by[k] - center.y);
+			cpVect n = cpvnormalize(cpvlerp(a, b, t[k]));
+			
+			context->t[k] = t[k];
+			context->nx[k] = n.x;
+			context->ny[k] = n.y;
+			context->shape[k] = shape;
+		}
+	}
+}
+
+static void
+segBundlePoly(segBundleContext *context, cpPolyShape *poly)
+{
+	int count = context->count;
+	cpPolyShapeAxis *axes = poly->tAxes;
+	cpVect *verts = poly->tVerts;
+	int numVerts = poly->numVerts;
+	
+	// Same math as cpPolyShapeSegmentQuery(), run across the whole bundle one axis at a time.
+	for(int i=0; i<numVerts; i++){
+		cpFloat nx = axes[i].n.x, ny = axes[i].n.y, d = axes[i].d;
+		cpFloat dtMin = -cpvcross(axes[i].n, verts[i]);
+		cpFloat dtMax = -cpvcross(axes[i].n, verts[(i+1)%numVerts]);
+		
+		for(int k=0; k<count; k++){
+			cpFloat ax = context->ax[k], ay = context->ay[k];
+			cpFloat bx = context->bx[k], by = context->by[k];
+			
+			cpFloat an = ax*nx + ay*ny;
+			cpFloat bn = bx*nx + by*ny;
+			cpFloat t = (d - an)/(bn - an);
+			
+			cpFloat px = ax*(1.0f - t) + bx*t, py = ay*(1.0f - t) + by*t;
+			cpFloat dt = -(nx*py - ny*px);
+			
+			int hit = (d <= an && 0.0f <= t && t <= 1.0f && dtMin <= dt && dt <= dtMax && t < context->t[k]);
+			context->t[k] = (hit ? t : context->t[k]);
+			context->nx[k] = (hit ? nx : context->nx[k]);
+			context->ny[k] = (hit ? ny : context->ny[k]);
+			context->shape[k] = (hit ? (cpShape *)poly : context->shape[k]);
+		}
+	}
+}
+
+static void
+segBundleHelper(segBundleContext *context, cpShape *shape, void *unused)
+{
+	if(
+		(shape->group && context->group == shape->group) ||
+		!(context->layers&shape->layers) ||
+		shape->sensor
+	) return;
+	
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: {
+			cpCircleShape *circle = (cpCircleShape *)shape;
+			segBundleCircle(context, shape, circle->tc, circle->r);
+		} break;
+		case CP_POLY_SHAPE:
+			segBundlePoly(context, (cpPolyShape *)shape);
+			break;
+		default:
+			for(int k=0; k<context->count; k++){
+				cpSegmentQueryInfo info;
+				if(
+					cpShapeSegmentQuery(shape, cpv(context->ax[k], context->ay[k]), cpv(context->bx[k], context->by[k]), &info) &&
+					info.t < context->t[k]
+				){
+					context->t[k] = info.t;
+					context->nx[k] = info.n.x;
+					context->ny[k] = info.n.y;
+					context->shape[k] = shape;
+				}
+			}
+			break;
+	}
+}
+
+// Grid size used to find coherent segments.
+// Matches the cells of a spatial hash, otherwise it's based on the average segment length.
+static cpFloat
+segBatchCellDim(cpSpatialIndex *index, const cpVect *starts, const cpVect *ends, int count)
+{
+	if(cpSpatialIndexIsSpaceHash(index)) return ((cpSpaceHash *)index)->celldim;
+	
+	cpFloat length = 0.0f;
+	for(int i=0; i<count; i++) length += cpvdist(starts[i], ends[i]);
+	
+	cpFloat dim = length/count;
+	return (dim > 0.0f ? dim : 1.0f);
+}
+
+static inline int
+segOctant(cpVect a, cpVect b)
+{
+	cpVect d = cpvsub(b, a);
+	return (d.x < 0.0f)<<2 | (d.y < 0.0f)<<1 | (cpfabs(d.x) < cpfabs(d.y));
+}
+
+static inline cpBB
+segBB(cpVect a, cpVect b)
+{
+	return cpBBNew(cpfmin(a.x, b.x), cpfmin(a.y, b.y), cpfmax(a.x, b.x), cpfmax(a.y, b.y));
+}
+
+int
+cpSpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, int count, cpLayers layers, cpGroup group, cpSegmentQueryInfo *out)
+{
+	if(count <= 0) return 0;
+	
+	cpSegmentQueryInfo blank = {NULL, 1.0f, cpvzero};
+	for(int i=0; i<count; i++) out[i] = blank;
+	
+	// Segments are sorted by the cell they start in, then by direction.
+	cpSpatialIndex *index = space->activeShapes;
+	cpFloat dim = segBatchCellDim(index, starts, ends, count);
+	cpFloat maxArea = SEGMENT_BUNDLE_CELLS*dim*dim;
+	
+	batchKey *keys = (batchKey *)cpmalloc(count*sizeof(batchKey));
+	for(int i=0; i<count; i++) keys[i] = batchKeyNew(starts[i], dim, segOctant(starts[i], ends[i]), i);
+	batchKeySort(keys, count);
+	
+	segBundleContext context = {layers, group};
+	
+	queryLock(space); {
+		for(int start=0; start<count;){
+			int first = keys[start].index;
+			cpBB bb = segBB(starts[first], ends[first]);
+			
+			// Grow the bundle while the segments start in the same cell, point the same way
+			// and the bundle's bounds stay small enough to be worth a single index query.
+			int end = start + 1;
+			while(end < count && end - start < SEGMENT_BUNDLE_SIZE){
+				batchKey key = keys[end];
+				if(key.cell != keys[start].cell || key.sub != keys[start].sub) break;
+				
+				cpBB merged = cpBBmerge(bb, segBB(starts[key.index], ends[key.index]));
+				if(cpBBArea(merged) > maxArea) break;
+				
+				bb = merged;
+				end++;
+			}
+			
+			if(end - start == 1 && cpBBArea(bb) > maxArea){
+				// Long lone segments walk the index and can stop at the first hit.
+				cpSpaceSegmentQueryFirst(space, starts[first], ends[first], layers, group, &out[first]);
+			} else {
+				context.count = end - start;
+				for(int k=0; k<context.count; k++){
+					int idx = keys[start + k].index;
+					context.ax[k] = starts[idx].x; context.ay[k] = starts[idx].y;
+					context.bx[k] = ends[idx].x; context.by[k] = ends[idx].y;
+					
+					context.t[k] = 1.0f;
+					context.nx[k] = context.ny[k] = 0.0f;
+					context.shape[k] = NULL;
+				}
+				
+				cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)segBundleHelper, NULL);
+				cpSpatialIndexQuery(space->activeShapes, &context, bb, (cpSpatialIndexQueryFunc)segBundleHelper, NULL);
+				
+				for(int k=0; k<context.count; k++){
+					cpSegmentQueryInfo *info = &out[keys[start + k].index];
+					info->shape = context.shape[k];
+					info->t = context.t[k];
+					info->n = cpv(context.nx[k], context.ny[k]);
+				}
+			}
+			
+			start = end;
+		}
+	} queryUnlock(space);
+	
+	cpfree(keys);
+	
+	int hits = 0;
+	for(int i=0; i<count; i++) hits += (out[i].shape != NULL);
+	return hits;
+}
+
 #pragma mark BB Query Functions
 
 typedef struct bbQueryContext {
@@ -179,10 +875,29 @@ cpSpaceBBQuery(cpSpace *space, cpBB bb, cpLayers layers, cpGroup group, cpSpaceB
 {
 	bbQueryContext context = {layers, group, func, data};
 	
-	cpSpaceLock(space); {
-		cpSpaceHashQuery(space->activeShapes, &bb, bb, (cpSpaceHashQueryFunc)bbQueryHelper, &context);
-		cpSpaceHashQuery(space->staticShapes, &bb, bb, (cpSpaceHashQueryFunc)bbQueryHelper, &context);
-	} cpSpaceUnlock(space);
+	queryLock(space); {
+		cpSpatialIndexQuery(space->activeShapes, &bb, bb, (cpSpatialIndexQueryFunc)bbQueryHelper, &context);
+		cpSpatialIndexQuery(space->staticShapes, &bb, bb, (cpSpatialIndexQueryFunc)bbQueryHelper, &context);
+	} queryUnlock(space);
+}
+
+static void 
+bbQueryIntoHelper(cpBB *bb, cpShape *shape, queryBufferContext *context)
+{
+	if(!queryBufferRejects(context, shape) && cpBBintersects(*bb, shape->bb)) queryBufferPush(context, shape);
+}
+
+int
+cpSpaceBBQueryInto(cpSpace *space, cpBB bb, cpLayers layers, cpGroup group, cpShape **out, int capacity)
+{
+	queryBufferContext context = {layers, group, out, capacity, 0};
+	
+	queryLock(space); {
+		cpSpatialIndexQuery(space->activeShapes, &bb, bb, (cpSpatialIndexQueryFunc)bbQueryIntoHelper, &context);
+		cpSpatialIndexQuery(space->staticShapes, &bb, bb, (cpSpatialIndexQueryFunc)bbQueryIntoHelper, &context);
+	} queryUnlock(space);
+	
+	return context.count;
 }
 
 #pragma mark Shape Query Functions
@@ -193,18 +908,23 @@ typedef struct shapeQueryContext {
 	cpBool anyCollision;
 } shapeQueryContext;
 
-// Callback from the spatial hash.
-static void
-shapeQueryHelper(cpShape *a, cpShape *b, shapeQueryContext *context)
+static inline cpBool
+shapeQueryReject(cpShape *a, cpShape *b)
 {
-	// Reject any of the simple cases
-	if(
+	return (
 		(a->group && a->group == b->group) ||
 		!(a->layers & b->layers) ||
 		a->sensor || b->sensor
-	) return;
+	);
+}
+
+// Collide the query shape 'a' with 'b'. Returns the number of contacts.
+static int
+shapeQueryCollide(cpShape *a, cpShape *b, cpContact *contacts)
+{
+	// Reject any of the simple cases
+	if(shapeQueryReject(a, b)) return 0;
 	
-	cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
 	int numContacts = 0;
 	
 	// Shape 'a' should have the lower shape type. (required by cpCollideShapes() )
@@ -215,17 +935,34 @@ shapeQueryHelper(cpShape *a, cpShape *b, shapeQueryContext *context)
 		for(int i=0; i<numContacts; i++) contacts[i].n = cpvneg(contacts[i].n);
 	}
 	
+	return numContacts;
+}
+
+static cpContactPointSet
+shapeQueryPointSet(cpContact *contacts, int numContacts)
+{
+	cpContactPointSet set = {numContacts, {}};
+	for(int i=0; i<set.count; i++){
+		set.points[i].point = contacts[i].p;
+		set.points[i].normal = contacts[i].n;
+		set.points[i].dist = contacts[i].dist;
+	}
+	
+	return set;
+}
+
+// Callback from the spatial hash.
+static void
+shapeQueryHelper(cpShape *a, cpShape *b, shapeQueryContext *context)
+{
+	cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
+	int numContacts = shapeQueryCollide(a, b, contacts);
+	
 	if(numContacts){
 		context->anyCollision = cpTrue;
 		
 		if(context->func){
-			cpContactPointSet set = {numContacts, {}};
-			for(int i=0; i<set.count; i++){
-				set.points[i].point = contacts[i].p;
-				set.points[i].normal = contacts[i].p;
-				set.points[i].dist = contacts[i].dist;
-			}
-			
+			cpContactPointSet set = shapeQueryPointSet(contacts, numContacts);
 			context->func(b, &set, context->data);
 		}
 	}
@@ -234,13 +971,107 @@ shapeQueryHelper(cpShape *a, cpShape *b, shapeQueryContext *context)
 cpBool
 cpSpaceShapeQuery(cpSpace *space, cpShape *shape, cpSpaceShapeQueryFunc func, void *data)
 {
-	cpBB bb = cpShapeCacheBB(shape);
+	cpBB bb = cacheQueryShape(shape);
 	shapeQueryContext context = {func, data, cpFalse};
 	
-	cpSpaceLock(space); {
-		cpSpaceHashQuery(space->activeShapes, shape, bb, (cpSpaceHashQueryFunc)shapeQueryHelper, &context);
-		cpSpaceHashQuery(space->staticShapes, shape, bb, (cpSpaceHashQueryFunc)shapeQueryHelper, &context);
-	} cpSpaceUnlock(space);
+	queryLock(space); {
+		cpSpatialIndexQuery(space->activeShapes, shape, bb, (cpSpatialIndexQueryFunc)shapeQueryHelper, &context);
+		cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)shapeQueryHelper, &context);
+	} queryUnlock(space);
 	
 	return context.anyCollision;
 }
+
+typedef struct shapeQueryIntoContext {
+	queryBufferContext buffer;
+	cpContactPointSet *sets;
+} shapeQueryIntoContext;
+
+static void
+shapeQueryIntoHelper(cpShape *a, cpShape *b, shapeQueryIntoContext *context)
+{
+	cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
+	int numContacts = shapeQueryCollide(a, b, contacts);
+	
+	if(numContacts){
+		int i = queryBufferPush(&context->buffer, b);
+		if(i >= 0 && context->sets) context->sets[i] = shapeQueryPointSet(contacts, numContacts);
+	}
+}
+
+int
+cpSpaceShapeQueryInto(cpSpace *space, cpShape *shape, cpShape **out, cpContactPointSet *outSets, int capacity)
+{
+	cpBB bb = cacheQueryShape(shape);
+	shapeQueryIntoContext context = {{CP_ALL_LAYERS, CP_NO_GROUP, out, capacity, 0}, outSets};
+	
+	queryLock(space); {
+		cpSpatialIndexQuery(space->activeShapes, shape, bb, (cpSpatialIndexQueryFunc)shapeQueryIntoHelper, &context);
+		cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)shapeQueryIntoHelper, &context);
+	} queryUnlock(space);
+	
+	return context.buffer.count;
+}
+
+#pragma mark Shape Cast Functions
+
+typedef struct shapeCastContext {
+	cpShape *shape;
+	cpVect d;
+	cpBB bb;
+} shapeCastContext;
+
+static void
+shapeCastHelper(shapeCastContext *context, cpShape *b, cpSegmentQueryInfo *out)
+{
+	cpShape *a = context->shape;
+	if(b == a || b->body == a->body || !cpBBintersects(context->bb, b->bb) || shapeQueryReject(a, b)) return;
+	
+	// Shapes that already overlap at the start are hit immediately.
+	cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
+	if(shapeQueryCollide(a, b, contacts)){
+		if(out->t > 0.0f){
+			out->shape = b;
+			out->t = 0.0f;
+			out->n = cpvneg(contacts[0].n);
+		}
+		
+		return;
+	}
+	
+	cpVect n;
+	cpFloat t = cpCastShapes(a, b, context->d, out->t, &n);
+	if(t < out->t){
+		out->shape = b;
+		out->t = t;
+		out->n = n;
+	}
+}
+
+cpShape *
+cpSpaceShapeCast(cpSpace *space, cpShape *shape, cpVect start, cpVect end, cpSegmentQueryInfo *out)
+{
+	cpSegmentQueryInfo info = {NULL, 1.0f, cpvzero};
+	if(out){
+		(*out) = info;
+	} else {
+		out = &info;
+	}
+	
+	// Find the shape's bbox at both ends, leaving its data cached at the start.
+	cpVect rot = shape->body->rot;
+	cpBB bbEnd = shape->klass->cacheData(shape, end, rot);
+	cpBB bbStart = shape->klass->cacheData(shape, start, rot);
+	
+	shapeCastContext context = {shape, cpvsub(end, start), cpBBmerge(bbStart, bbEnd)};
+	
+	queryLock(space); {
+		cpSpatialIndexQuery(space->activeShapes, &context, context.bb, (cpSpatialIndexQueryFunc)shapeCastHelper, out);
+		cpSpatialIndexQuery(space->staticShapes, &context, context.bb, (cpSpatialIndexQueryFunc)shapeCastHelper, out);
+	} queryUnlock(space);
+	
+	// Restore the shape's cached data to its body's position.
+	cacheQueryShape(shape);
+	
+	return out->shape;
+}
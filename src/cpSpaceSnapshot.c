@@ -0,0 +1,224 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chipmunk_private.h"
+
+// A snapshot is a stripped down space that only holds copies of the shapes and two bbtrees to find them.
+// Only the fields used by the query functions are set, and it's permanently locked for concurrent queries.
+struct cpSpaceQuerySnapshot {
+	cpSpace space;
+	
+	// All of the shape copies and their vertex lists are packed into one buffer.
+	char *buffer;
+	size_t bufferSize;
+};
+
+// Keep the copies aligned for any of the types stored in the buffer.
+static inline size_t snapshotAlign(size_t size){return (size + 15) & ~(size_t)15;}
+
+static size_t
+shapeCopySize(cpShape *shape)
+{
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: return snapshotAlign(sizeof(cpCircleShape));
+		case CP_SEGMENT_SHAPE: return snapshotAlign(sizeof(cpSegmentShape));
+		case CP_POLY_SHAPE: {
+			int numVerts = ((cpPolyShape *)shape)->numVerts;
+			return (
+				snapshotAlign(sizeof(cpPolyShape)) +
+				2*snapshotAlign(numVerts*sizeof(cpVect)) +
+				2*snapshotAlign(numVerts*sizeof(cpPolyShapeAxis)) +
+				snapshotAlign(5*cpPolyShapeSoALength(numVerts)*sizeof(cpFloat))
+			);
+		}
+		case CP_CHAIN_SHAPE: {
+			cpChainShape *chain = (cpChainShape *)shape;
+			return (
+				snapshotAlign(sizeof(cpChainShape)) +
+				2*snapshotAlign(chain->numVerts*sizeof(cpVect)) +
+				2*snapshotAlign(cpChainShapeGetNumSegments(chain)*sizeof(cpVect)) +
+				snapshotAlign(2*chain->numLeaves*sizeof(cpBB))
+			);
+		}
+		case CP_TILE_MAP_SHAPE: {
+			cpTileMapShape *map = (cpTileMapShape *)shape;
+			return snapshotAlign(sizeof(cpTileMapShape)) + snapshotAlign(map->width*map->height*sizeof(unsigned char));
+		}
+		default:
+			cpAssert(cpFalse, "Shape type not supported by cpSpaceQuerySnapshot.");
+			return 0;
+	}
+}
+
+static char *
+copyArray(char *cursor, void **dst, const void *src, size_t size)
+{
+	memcpy(cursor, src, size);
+	(*dst) = cursor;
+	return cursor + snapshotAlign(size);
+}
+
+// Copy the shape to the cursor, returning the cursor past the end of the copy.
+static char *
+copyShape(cpShape *shape, char *cursor)
+{
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE:
+			memcpy(cursor, shape, sizeof(cpCircleShape));
+			return cursor + snapshotAlign(sizeof(cpCircleShape));
+		case CP_SEGMENT_SHAPE:
+			memcpy(cursor, shape, sizeof(cpSegmentShape));
+			return cursor + snapshotAlign(sizeof(cpSegmentShape));
+		case CP_POLY_SHAPE: {
+			cpPolyShape *src = (cpPolyShape *)shape;
+			cpPolyShape *dst = (cpPolyShape *)cursor;
+			(*dst) = (*src);
+			cursor += snapshotAlign(sizeof(cpPolyShape));
+			
+			size_t vertsSize = src->numVerts*sizeof(cpVect);
+			size_t axesSize = src->numVerts*sizeof(cpPolyShapeAxis);
+			cursor = copyArray(cursor, (void **)&dst->verts, src->verts, vertsSize);
+			cursor = copyArray(cursor, (void **)&dst->tVerts, src->tVerts, vertsSize);
+			cursor = copyArray(cursor, (void **)&dst->axes, src->axes, axesSize);
+			cursor = copyArray(cursor, (void **)&dst->tAxes, src->tAxes, axesSize);
+			
+			// Rebase the component arrays onto the copy of their shared allocation.
+			int length = cpPolyShapeSoALength(src->numVerts);
+			cursor = copyArray(cursor, (void **)&dst->tVertsX, src->tVertsX, 5*length*sizeof(cpFloat));
+			dst->tVertsY = dst->tVertsX + 1*length;
+			dst->tAxesX = dst->tVertsX + 2*length;
+			dst->tAxesY = dst->tVertsX + 3*length;
+			dst->tAxesD = dst->tVertsX + 4*length;
+			return cursor;
+		}
+		case CP_CHAIN_SHAPE: {
+			cpChainShape *src = (cpChainShape *)shape;
+			cpChainShape *dst = (cpChainShape *)cursor;
+			(*dst) = (*src);
+			cursor += snapshotAlign(sizeof(cpChainShape));
+			
+			size_t vertsSize = src->numVerts*sizeof(cpVect);
+			size_t normalsSize = cpChainShapeGetNumSegments(src)*sizeof(cpVect);
+			cursor = copyArray(cursor, (void **)&dst->verts, src->verts, vertsSize);
+			cursor = copyArray(cursor, (void **)&dst->tVerts, src->tVerts, vertsSize);
+			cursor = copyArray(cursor, (void **)&dst->normals, src->normals, normalsSize);
+			cursor = copyArray(cursor, (void **)&dst->tNormals, src->tNormals, normalsSize);
+			cursor = copyArray(cursor, (void **)&dst->nodes, src->nodes, 2*src->numLeaves*sizeof(cpBB));
+			return cursor;
+		}
+		case CP_TILE_MAP_SHAPE: {
+			cpTileMapShape *src = (cpTileMapShape *)shape;
+			cpTileMapShape *dst = (cpTileMapShape *)cursor;
+			(*dst) = (*src);
+			cursor += snapshotAlign(sizeof(cpTileMapShape));
+			
+			return copyArray(cursor, (void **)&dst->tiles, src->tiles, src->width*src->height*sizeof(unsigned char));
+		}
+		default:
+			cpAssert(cpFalse, "Shape type not supported by cpSpaceQuerySnapshot.");
+			return cursor;
+	}
+}
+
+static void sizeHelper(cpShape *shape, size_t *size){(*size) += shapeCopySize(shape);}
+
+typedef struct snapshotCopyContext {
+	char *cursor;
+	cpSpatialIndex *index;
+} snapshotCopyContext;
+
+static void
+copyHelper(cpShape *shape, snapshotCopyContext *context)
+{
+	cpShape *copy = (cpShape *)context->cursor;
+	context->cursor = copyShape(shape, context->cursor);
+	
+	// The pair cache's fat bbox isn't used by the snapshot's trees.
+	copy->fatBB = copy->bb;
+	cpSpatialIndexInsert(context->index, copy, copy->hashid);
+}
+
+static cpBB snapshotBBFunc(cpShape *shape){return shape->bb;}
+
+cpSpaceQuerySnapshot *
+cpSpaceQuerySnapshotNew(cpSpace *space)
+{
+	cpSpaceQuerySnapshot *snapshot = (cpSpaceQuerySnapshot *)cpcalloc(1, sizeof(cpSpaceQuerySnapshot));
+	cpSpaceQuerySnapshotUpdate(snapshot, space);
+	
+	return snapshot;
+}
+
+void
+cpSpaceQuerySnapshotFree(cpSpaceQuerySnapshot *snapshot)
+{
+	if(snapshot){
+		cpSpatialIndexFree(snapshot->space.activeShapes);
+		cpSpatialIndexFree(snapshot->space.staticShapes);
+		cpfree(snapshot->buffer);
+		cpfree(snapshot);
+	}
+}
+
+void
+cpSpaceQuerySnapshotUpdate(cpSpaceQuerySnapshot *snapshot, cpSpace *space)
+{
+	cpAssert(!space->locked || space->concurrentQueries, "A snapshot cannot be taken during a call to cpSpaceStep() or during a query.");
+	
+	size_t size = 0;
+	cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)sizeHelper, &size);
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)sizeHelper, &size);
+	
+	if(size > snapshot->bufferSize){
+		cpfree(snapshot->buffer);
+		snapshot->buffer = (char *)cpmalloc(size);
+		snapshot->bufferSize = size;
+	}
+	
+	// The trees are bulk built from scratch since every shape was reinserted.
+	cpSpatialIndexFree(snapshot->space.activeShapes);
+	cpSpatialIndexFree(snapshot->space.staticShapes);
+	
+	cpSpace *shell = &snapshot->space;
+	shell->activeShapes = cpBBTreeNew((cpSpatialIndexBBFunc)snapshotBBFunc);
+	shell->staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)snapshotBBFunc);
+	
+	snapshotCopyContext context = {snapshot->buffer, shell->activeShapes};
+	cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)copyHelper, &context);
+	context.index = shell->staticShapes;
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIterator)copyHelper, &context);
+	
+	// Build the trees now so the queries only read from them.
+	cpSpatialIndexFlush(shell->activeShapes);
+	cpSpatialIndexFlush(shell->staticShapes);
+	
+	shell->locked = 1;
+	shell->concurrentQueries = cpTrue;
+}
+
+cpSpace *
+cpSpaceQuerySnapshotGetSpace(cpSpaceQuerySnapshot *snapshot)
+{
+	return &snapshot->space;
+}
@@ -20,11 +20,17 @@
  */
  
 #include <stdlib.h>
+#include <string.h>
 //#include <stdio.h>
 #include <math.h>
 
 #include "chipmunk_private.h"
 
+#ifndef _WIN32
+	#define CP_USE_PTHREADS 1
+	#include <pthread.h>
+#endif
+
 #pragma mark Post Step Callback Functions
 
 typedef struct PostStepCallback {
@@ -157,39 +163,60 @@ queryReject(cpShape *a, cpShape *b)
 		|| !(a->layers & b->layers);
 }
 
-// Callback from the spatial hash.
-static void
-queryFunc(cpShape *a, cpShape *b, cpSpace *space)
-{
-	// Reject any of the simple cases
-	if(queryReject(a,b)) return;
+// Pair collected by queryFunc() when the narrowphase is batched.
+typedef struct cpNarrowphasePair {
+	cpShape *a, *b;
+	cpCollisionHandler *handler;
+	cpArbiter *arb;
+	cpSeparatingAxis axis;
 	
-	// Find the collision pair function for the shapes.
-	struct{cpCollisionType a, b;} ids = {a->collision_type, b->collision_type};
-	cpHashValue collHashID = CP_HASH_PAIR(a->collision_type, b->collision_type);
-	cpCollisionHandler *handler = (cpCollisionHandler *)cpHashSetFind(space->collFuncSet, collHashID, &ids);
+	cpContact *contacts;
+	int numContacts;
+} cpNarrowphasePair;
+
+// Number of pairs passed to cpCollideShapesBatch() at once.
+#define CP_NARROWPHASE_CHUNK 32
+
+typedef struct cpNarrowphaseBatch {
+	int numPairs, maxPairs;
+	cpNarrowphasePair *pairs;
 	
-	cpBool sensor = a->sensor || b->sensor;
-	if(sensor && handler == &cpSpaceDefaultHandler) return;
+	// Indexes of the pairs bucketed by their shape types.
+	int *order;
 	
-	// Shape 'a' should have the lower shape type. (required by cpCollideShapes() )
-	if(a->klass->type > b->klass->type){
-		cpShape *temp = a;
-		a = b;
-		b = temp;
+	const cpShape *chunkA[CP_NARROWPHASE_CHUNK];
+	const cpShape *chunkB[CP_NARROWPHASE_CHUNK];
+	cpSeparatingAxis chunkAxes[CP_NARROWPHASE_CHUNK];
+	int chunkNumContacts[CP_NARROWPHASE_CHUNK];
+	cpContact chunkContacts[CP_NARROWPHASE_CHUNK*CP_MAX_CONTACTS_PER_ARBITER];
+} cpNarrowphaseBatch;
+
+static void
+batchPushPair(cpNarrowphaseBatch *batch, cpShape *a, cpShape *b, cpCollisionHandler *handler, cpArbiter *arb, cpSeparatingAxis axis)
+{
+	if(batch->numPairs == batch->maxPairs){
+		batch->maxPairs = (batch->maxPairs ? 2*batch->maxPairs : 256);
+		batch->pairs = (cpNarrowphasePair *)cprealloc(batch->pairs, batch->maxPairs*sizeof(cpNarrowphasePair));
+		batch->order = (int *)cprealloc(batch->order, batch->maxPairs*sizeof(int));
 	}
 	
-	// Narrow-phase collision detection.
-	cpContact *contacts = cpContactBufferGetArray(space);
-	int numContacts = cpCollideShapes(a, b, contacts);
-	if(!numContacts) return; // Shapes are not colliding.
-	cpSpacePushContacts(space, numContacts);
-	
+	cpNarrowphasePair pair = {a, b, handler, arb, axis, NULL, 0};
+	batch->pairs[batch->numPairs++] = pair;
+}
+
+// Finds or creates the arbiter for a pair of colliding shapes and runs the collision handler callbacks.
+// The contacts must already be pushed onto the contact buffer.
+static void
+handleContacts(cpSpace *space, cpShape *a, cpShape *b, cpCollisionHandler *handler, cpArbiter *arb, cpSeparatingAxis axis, cpContact *contacts, int numContacts)
+{
 	// Get an arbiter from space->contactSet for the two shapes.
 	// This is where the persistant contact magic comes from.
-	cpShape *shape_pair[] = {a, b};
-	cpHashValue arbHashID = CP_HASH_PAIR((size_t)a, (size_t)b);
-	cpArbiter *arb = (cpArbiter *)cpHashSetInsert(space->contactSet, arbHashID, shape_pair, space);
+	if(!arb){
+		cpShape *shape_pair[] = {a, b};
+		cpHashValue arbHashID = CP_HASH_PAIR((size_t)a, (size_t)b);
+		arb = (cpArbiter *)cpHashSetInsert(space->contactSet, arbHashID, shape_pair, space);
+		arb->axis = axis;
+	}
 	cpArbiterUpdate(arb, contacts, numContacts, handler, a, b);
 	
 	// Call the begin function first if it's the first step
@@ -203,11 +230,12 @@ queryFunc(cpShape *a, cpShape *b, cpSpace *space)
 		// Call preSolve
 		handler->preSolve(arb, space, handler->data) &&
 		// Process, but don't add collisions for sensors.
-		!sensor
+		!(a->sensor || b->sensor)
 	){
 		cpArrayPush(space->arbiters, arb);
 	} else {
-		cpSpacePopContacts(space, numContacts);
+		// The batched narrowphase leaves the unused contacts in the buffer since they might not be the last ones pushed.
+		if(!space->narrowphaseBatch) cpSpacePopContacts(space, numContacts);
 		
 		arb->contacts = NULL;
 		arb->numContacts = 0;
@@ -221,11 +249,652 @@ queryFunc(cpShape *a, cpShape *b, cpSpace *space)
 	arb->stamp = space->stamp;
 }
 
-// Iterator for active/static hash collisions.
+// Callback from the spatial index.
+static void
+queryFunc(cpShape *a, cpShape *b, cpSpace *space)
+{
+	// Reject any of the simple cases
+	if(queryReject(a,b)) return;
+	
+	// Find the collision pair function for the shapes.
+	struct{cpCollisionType a, b;} ids = {a->collision_type, b->collision_type};
+	cpHashValue collHashID = CP_HASH_PAIR(a->collision_type, b->collision_type);
+	cpCollisionHandler *handler = (cpCollisionHandler *)cpHashSetFind(space->collFuncSet, collHashID, &ids);
+	
+	cpBool sensor = a->sensor || b->sensor;
+	if(sensor && handler == &cpSpaceDefaultHandler) return;
+	
+	// Shape 'a' should have the lower shape type. (required by cpCollideShapes() )
+	if(a->klass->type > b->klass->type){
+		cpShape *temp = a;
+		a = b;
+		b = temp;
+	}
+	
+	// Look for an existing arbiter first so the narrow-phase can start with its cached separating axis.
+	cpShape *shape_pair[] = {a, b};
+	cpHashValue arbHashID = CP_HASH_PAIR((size_t)a, (size_t)b);
+	cpArbiter *arb = (cpArbiter *)cpHashSetFind(space->contactSet, arbHashID, shape_pair);
+	cpSeparatingAxis axis = (arb ? arb->axis : (cpSeparatingAxis){NULL, 0});
+	
+	// The batched narrowphase collides the pairs later, see flushNarrowphaseBatch().
+	if(space->narrowphaseBatch){
+		batchPushPair(space->narrowphaseBatch, a, b, handler, arb, axis);
+		return;
+	}
+	
+	// Narrow-phase collision detection.
+	cpContact *contacts = cpContactBufferGetArray(space);
+	int numContacts = cpCollideShapesWithAxis(a, b, contacts, &axis);
+	
+	// Keep the axis even when the shapes separated. The arbiter lingers for a few steps in case they touch again.
+	if(arb) arb->axis = axis;
+	if(!numContacts) return; // Shapes are not colliding.
+	cpSpacePushContacts(space, numContacts);
+	
+	handleContacts(space, a, b, handler, arb, axis, contacts, numContacts);
+}
+
+// Iterator for active/static index collisions.
 static void
 active2staticIter(cpShape *shape, cpSpace *space)
 {
-	cpSpaceHashQuery(space->staticShapes, shape, shape->bb, (cpSpaceHashQueryFunc)queryFunc, space);
+	cpSpatialIndexQuery(space->staticShapes, shape, shape->bb, (cpSpatialIndexQueryFunc)queryFunc, space);
+}
+
+#pragma mark Batched Narrowphase Functions
+
+// Collides the pairs collected by queryFunc().
+// The pairs are bucketed by their shape types so each bucket runs through a single collision function,
+// then the contacts are handed to the arbiters in the order the pairs were found.
+static void
+flushNarrowphaseBatch(cpSpace *space)
+{
+	cpNarrowphaseBatch *batch = space->narrowphaseBatch;
+	cpNarrowphasePair *pairs = batch->pairs;
+	int numPairs = batch->numPairs;
+	
+	// Counting sort of the pairs by shape types.
+	int offsets[CP_NUM_SHAPES*CP_NUM_SHAPES + 1] = {0};
+	for(int i=0; i<numPairs; i++){
+		offsets[pairs[i].a->klass->type + pairs[i].b->klass->type*CP_NUM_SHAPES + 1]++;
+	}
+	
+	for(int i=0; i<CP_NUM_SHAPES*CP_NUM_SHAPES; i++) offsets[i + 1] += offsets[i];
+	for(int i=0; i<numPairs; i++){
+		batch->order[offsets[pairs[i].a->klass->type + pairs[i].b->klass->type*CP_NUM_SHAPES]++] = i;
+	}
+	
+	// Collide the pairs a chunk at a time, never mixing shape types within a chunk.
+	for(int start=0; start<numPairs;){
+		cpShapeType ta = pairs[batch->order[start]].a->klass->type;
+		cpShapeType tb = pairs[batch->order[start]].b->klass->type;
+		
+		int count = 0;
+		while(start + count < numPairs && count < CP_NARROWPHASE_CHUNK){
+			cpNarrowphasePair *pair = &pairs[batch->order[start + count]];
+			if(pair->a->klass->type != ta || pair->b->klass->type != tb) break;
+			
+			batch->chunkA[count] = pair->a;
+			batch->chunkB[count] = pair->b;
+			batch->chunkAxes[count] = pair->axis;
+			count++;
+		}
+		
+		cpCollideShapesBatch(batch->chunkA, batch->chunkB, batch->chunkAxes, count, batch->chunkContacts, batch->chunkNumContacts);
+		
+		// Move the contacts into the contact buffer.
+		for(int i=0; i<count; i++){
+			cpNarrowphasePair *pair = &pairs[batch->order[start + i]];
+			pair->axis = batch->chunkAxes[i];
+			
+			int numContacts = pair->numContacts = batch->chunkNumContacts[i];
+			if(numContacts){
+				pair->contacts = cpContactBufferGetArray(space);
+				memcpy(pair->contacts, batch->chunkContacts + i*CP_MAX_CONTACTS_PER_ARBITER, numContacts*sizeof(cpContact));
+				cpSpacePushContacts(space, numContacts);
+			}
+		}
+		
+		start += count;
+	}
+	
+	// Update the arbiters and call the handlers in the original order to keep the simulation deterministic.
+	for(int i=0; i<numPairs; i++){
+		cpNarrowphasePair *pair = &pairs[i];
+		if(pair->arb) pair->arb->axis = pair->axis;
+		if(pair->numContacts) handleContacts(space, pair->a, pair->b, pair->handler, pair->arb, pair->axis, pair->contacts, pair->numContacts);
+	}
+	
+	batch->numPairs = 0;
+}
+
+void
+cpSpaceSetBatchedNarrowphase(cpSpace *space, cpBool enabled)
+{
+	cpAssert(!space->locked, "The narrowphase mode cannot be changed during a call to cpSpaceStep() or during a query.");
+	
+	if(enabled && !space->narrowphaseBatch){
+		space->narrowphaseBatch = (cpNarrowphaseBatch *)cpcalloc(1, sizeof(cpNarrowphaseBatch));
+	} else if(!enabled && space->narrowphaseBatch){
+		cpfree(space->narrowphaseBatch->pairs);
+		cpfree(space->narrowphaseBatch->order);
+		cpfree(space->narrowphaseBatch);
+		space->narrowphaseBatch = NULL;
+	}
+}
+
+#pragma mark Pair Cache Functions
+
+// Pair of shapes whose fat bboxes overlap.
+// If isStatic is set, 'b' is a static (or sleeping) shape and its regular bbox is used.
+typedef struct cpCachedPair {
+	cpShape *a, *b;
+	cpBool isStatic;
+	// Hash value the pair was inserted with. Stored so the pair can be removed after its shapes are freed.
+	cpHashValue hash;
+} cpCachedPair;
+
+// Equal function for the pairCache.
+static cpBool
+pairCacheEql(cpCachedPair *check, cpCachedPair *pair)
+{
+	return ((check->a == pair->a && check->b == pair->b) || (check->b == pair->a && check->a == pair->b));
+}
+
+// Transformation function for the pairCache.
+// New pairs are also appended to space->cachedPairs which is what gets iterated every step.
+static void *
+pairCacheTrans(cpCachedPair *check, cpSpace *space)
+{
+	if(space->pooledPairs->num == 0){
+		// pair pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(cpCachedPair);
+		cpAssert(count, "Buffer size too small.");
+		
+		cpCachedPair *buffer = (cpCachedPair *)cpmalloc(CP_BUFFER_BYTES);
+		cpArrayPush(space->allocatedBuffers, buffer);
+		
+		// Push them in reverse so they are popped in memory order.
+		for(int i=count-1; i>=0; i--) cpArrayPush(space->pooledPairs, buffer + i);
+	}
+	
+	cpCachedPair *pair = (cpCachedPair *)cpArrayPop(space->pooledPairs);
+	(*pair) = (*check);
+	cpArrayPush(space->cachedPairs, pair);
+	
+	return pair;
+}
+
+// The removedShapes set just stores the pointers. The shapes may have been freed already.
+static cpBool removedShapesEql(void *ptr, void *elt){return (ptr == elt);}
+static void *removedShapesTrans(void *ptr, void *unused){return ptr;}
+
+void
+cpSpaceUncacheShape(cpSpace *space, cpShape *shape)
+{
+	if(space->pairCache){
+		cpHashValue hash = (cpHashValue)(size_t)shape;
+		cpHashSetInsert(space->removedShapes, hash, shape, NULL);
+		// The shape may be freed before the next step, so it can't be left in the set of new static shapes.
+		cpHashSetRemove(space->newStaticShapes, hash, shape);
+	}
+}
+
+void
+cpSpaceCacheStaticShape(cpSpace *space, cpShape *shape)
+{
+	if(space->pairCache) cpHashSetInsert(space->newStaticShapes, (cpHashValue)(size_t)shape, shape, NULL);
+}
+
+// The index uses the fat bbox, but always covers the regular one so queries can't miss a shape whose fat bbox was reset.
+static cpBB fatBBFunc(cpShape *shape){return cpBBmerge(shape->fatBB, shape->bb);}
+static cpBB shapeBBFunc(cpShape *shape){return shape->bb;}
+
+static void resetFatBB(cpShape *shape, void *unused){cpShapeResetFatBB(shape);}
+
+void
+cpSpaceEnablePairCache(cpSpace *space, cpFloat margin)
+{
+	cpAssert(!space->locked, "The pair cache cannot be enabled during a call to cpSpaceStep() or during a query.");
+	space->pairCacheMargin = margin;
+	
+	if(!space->pairCache){
+		space->pairCache = cpHashSetNew(0, (cpHashSetEqlFunc)pairCacheEql, (cpHashSetTransFunc)pairCacheTrans);
+		space->cachedPairs = cpArrayNew(0);
+		space->movedShapes = cpArrayNew(0);
+		space->removedShapes = cpHashSetNew(0, removedShapesEql, removedShapesTrans);
+		space->newStaticShapes = cpHashSetNew(0, removedShapesEql, removedShapesTrans);
+		space->staticPairsStale = cpTrue;
+		
+		// The active index needs to use the fat bboxes from now on.
+		cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)resetFatBB, NULL);
+		space->activeShapes->bbfunc = (cpSpatialIndexBBFunc)fatBBFunc;
+		cpSpatialIndexReindex(space->activeShapes);
+	}
+}
+
+void
+cpSpaceDisablePairCache(cpSpace *space)
+{
+	cpAssert(!space->locked, "The pair cache cannot be disabled during a call to cpSpaceStep() or during a query.");
+	
+	if(space->pairCache){
+		cpArray *pairs = space->cachedPairs;
+		for(int i=0; i<pairs->num; i++) cpArrayPush(space->pooledPairs, pairs->arr[i]);
+		
+		cpHashSetFree(space->pairCache);
+		cpArrayFree(space->cachedPairs);
+		cpArrayFree(space->movedShapes);
+		cpHashSetFree(space->removedShapes);
+		cpHashSetFree(space->newStaticShapes);
+		space->pairCache = NULL;
+		
+		space->activeShapes->bbfunc = (cpSpatialIndexBBFunc)shapeBBFunc;
+		cpSpatialIndexReindex(space->activeShapes);
+	}
+}
+
+// Number of steps worth of velocity to add to the fat bboxes.
+#define PAIR_CACHE_LOOKAHEAD 4.0f
+
+static inline cpBB
+fatBBForShape(cpShape *shape, cpFloat margin, cpFloat dt)
+{
+	cpBB bb = shape->bb;
+	cpVect v = cpvmult(shape->body->v, dt*PAIR_CACHE_LOOKAHEAD);
+	
+	return cpBBNew(
+		bb.l - margin + cpfmin(v.x, 0.0f),
+		bb.b - margin + cpfmin(v.y, 0.0f),
+		bb.r + margin + cpfmax(v.x, 0.0f),
+		bb.t + margin + cpfmax(v.y, 0.0f)
+	);
+}
+
+static inline void
+uncachePair(cpSpace *space, cpCachedPair *pair)
+{
+	cpHashSetRemove(space->pairCache, pair->hash, pair);
+	cpArrayPush(space->pooledPairs, pair);
+}
+
+// Throw away the pairs of removed shapes, and all of the static pairs if they are stale.
+// Doesn't dereference the shapes as removed shapes may have been freed.
+static void
+uncacheRemovedPairs(cpSpace *space)
+{
+	cpHashSet *removed = space->removedShapes;
+	cpBool staticStale = space->staticPairsStale;
+	
+	cpArray *pairs = space->cachedPairs;
+	int num = 0;
+	
+	for(int i=0; i<pairs->num; i++){
+		cpCachedPair *pair = (cpCachedPair *)pairs->arr[i];
+		
+		if(
+			(pair->isStatic && staticStale) ||
+			cpHashSetFind(removed, (cpHashValue)(size_t)pair->a, pair->a) ||
+			cpHashSetFind(removed, (cpHashValue)(size_t)pair->b, pair->b)
+		){
+			uncachePair(space, pair);
+		} else {
+			pairs->arr[num++] = pair;
+		}
+	}
+	
+	pairs->num = num;
+}
+
+static cpBool removedShapesClearFilter(void *elt, void *unused){return cpFalse;}
+
+typedef struct pairCacheContext {
+	cpSpace *space;
+	cpFloat dt;
+} pairCacheContext;
+
+// Iterator to find the active shapes that moved outside of their fat bboxes.
+static void
+markMovedShape(cpShape *shape, pairCacheContext *context)
+{
+	if(!cpBBcontainsBB(shape->fatBB, shape->bb)){
+		cpSpace *space = context->space;
+		
+		shape->fatBB = fatBBForShape(shape, space->pairCacheMargin, context->dt);
+		cpArrayPush(space->movedShapes, shape);
+	}
+}
+
+static void
+cacheActivePair(cpShape *a, cpShape *b, cpSpace *space)
+{
+	// Shapes on the same body never collide and can't be moved to another body.
+	if(a->body == b->body) return;
+	
+	cpHashValue hash = CP_HASH_PAIR(a->hashid, b->hashid);
+	cpCachedPair pair = {a, b, cpFalse, hash};
+	cpHashSetInsert(space->pairCache, hash, &pair, space);
+}
+
+static void
+cacheStaticPair(cpShape *a, cpShape *b, cpSpace *space)
+{
+	cpHashValue hash = CP_HASH_PAIR(a->hashid, b->hashid);
+	cpCachedPair pair = {a, b, cpTrue, hash};
+	cpHashSetInsert(space->pairCache, hash, &pair, space);
+}
+
+static void
+cacheStaticPairsIter(cpShape *shape, cpSpace *space)
+{
+	cpSpatialIndexQuery(space->staticShapes, shape, shape->fatBB, (cpSpatialIndexQueryFunc)cacheStaticPair, space);
+}
+
+// The query passes the new static shape first, but it goes second in a static pair.
+static void
+cacheNewStaticPair(cpShape *b, cpShape *a, cpSpace *space)
+{
+	cacheStaticPair(a, b, space);
+}
+
+static cpBool
+cacheNewStaticShape(cpShape *shape, cpSpace *space)
+{
+	cpSpatialIndexQuery(space->activeShapes, shape, shape->bb, (cpSpatialIndexQueryFunc)cacheNewStaticPair, space);
+	return cpFalse;
+}
+
+// Broadphase using the pair cache.
+// Only the shapes that moved outside of their fat bboxes are queried for new pairs.
+static void
+collideCachedPairs(cpSpace *space, cpFloat dt)
+{
+	cpSpatialIndex *activeShapes = space->activeShapes;
+	cpSpatialIndex *staticShapes = space->staticShapes;
+	
+	// Throw away the old pairs first so that shapes added in place of removed ones keep their new pairs.
+	if(space->removedShapes->entries || space->staticPairsStale){
+		uncacheRemovedPairs(space);
+		cpHashSetFilter(space->removedShapes, removedShapesClearFilter, NULL);
+	}
+	
+	cpArray *moved = space->movedShapes;
+	pairCacheContext context = {space, dt};
+	cpSpatialIndexEach(activeShapes, (cpSpatialIndexIterator)markMovedShape, &context);
+	
+	// Update the index for the new fat bboxes. Reindexing everything is faster when many shapes moved.
+	if(moved->num*4 > cpSpatialIndexCount(activeShapes)){
+		cpSpatialIndexReindex(activeShapes);
+	} else {
+		for(int i=0; i<moved->num; i++){
+			cpShape *shape = (cpShape *)moved->arr[i];
+			cpSpatialIndexReindexObject(activeShapes, shape, shape->hashid);
+		}
+	}
+	
+	// Find the new pairs for the shapes that moved.
+	cpBool queryStatic = cpSpatialIndexCount(staticShapes) && !space->staticPairsStale;
+	for(int i=0; i<moved->num; i++){
+		cpShape *shape = (cpShape *)moved->arr[i];
+		cpSpatialIndexQuery(activeShapes, shape, shape->fatBB, (cpSpatialIndexQueryFunc)cacheActivePair, space);
+		if(queryStatic) cacheStaticPairsIter(shape, space);
+	}
+	
+	moved->num = 0;
+	
+	// Find all of the static pairs again if the static shapes changed.
+	// Otherwise only the static shapes added since the last step need to find their pairs.
+	if(space->staticPairsStale){
+		if(cpSpatialIndexCount(staticShapes)) cpSpatialIndexEach(activeShapes, (cpSpatialIndexIterator)cacheStaticPairsIter, space);
+		cpHashSetFilter(space->newStaticShapes, removedShapesClearFilter, NULL);
+		space->staticPairsStale = cpFalse;
+	} else if(space->newStaticShapes->entries){
+		cpHashSetFilter(space->newStaticShapes, (cpHashSetFilterFunc)cacheNewStaticShape, space);
+	}
+	
+	// Pass the cached pairs on to the collision detection.
+	// Pairs whose fat bboxes stopped overlapping are thrown away.
+	// The list is compacted in place so the pairs stay in the order they were found.
+	cpArray *pairs = space->cachedPairs;
+	int num = 0;
+	
+	for(int i=0; i<pairs->num; i++){
+		cpCachedPair *pair = (cpCachedPair *)pairs->arr[i];
+		cpShape *a = pair->a, *b = pair->b;
+		
+		if(cpBBintersects(a->fatBB, (pair->isStatic ? b->bb : b->fatBB))){
+			queryFunc(a, b, space);
+			pairs->arr[num++] = pair;
+		} else {
+			uncachePair(space, pair);
+		}
+	}
+	
+	pairs->num = num;
+}
+
+#pragma mark Threaded Broadphase Functions
+
+// Candidate pair found by a broadphase worker.
+typedef struct cpShapePair {
+	cpShape *a, *b;
+} cpShapePair;
+
+// Each worker fills its own list of pairs so the workers never share anything they write to.
+typedef struct cpBroadphaseWorker {
+	struct cpBroadphaseThreads *threads;
+	int index;
+	
+	int numPairs, maxPairs;
+	cpShapePair *pairs;
+	
+#ifdef CP_USE_PTHREADS
+	pthread_t thread;
+#endif
+} cpBroadphaseWorker;
+
+typedef struct cpBroadphaseThreads {
+	cpSpace *space;
+	
+	// Worker 0 runs on the thread calling cpSpaceStep().
+	int numWorkers;
+	cpBroadphaseWorker *workers;
+	
+	// The active shapes for the current step. Each worker gets a contiguous range of them.
+	cpArray *shapes;
+	
+#ifdef CP_USE_PTHREADS
+	pthread_mutex_t mutex;
+	pthread_cond_t wake, done;
+	// Incremented to start the workers on a new step.
+	unsigned int generation;
+	// Number of background workers still running for the current step.
+	int running;
+	cpBool quit;
+#endif
+} cpBroadphaseThreads;
+
+static void
+workerPushPair(cpBroadphaseWorker *worker, cpShape *a, cpShape *b)
+{
+	if(worker->numPairs == worker->maxPairs){
+		worker->maxPairs = (worker->maxPairs ? worker->maxPairs*2 : 256);
+		worker->pairs = (cpShapePair *)cprealloc(worker->pairs, worker->maxPairs*sizeof(cpShapePair));
+	}
+	
+	cpShapePair pair = {a, b};
+	worker->pairs[worker->numPairs++] = pair;
+}
+
+static void workerStaticPair(cpShape *a, cpShape *b, cpBroadphaseWorker *worker){workerPushPair(worker, a, b);}
+
+// Both shapes of an active pair find each other. Only the one with the lower hashid keeps it.
+static void
+workerActivePair(cpShape *a, cpShape *b, cpBroadphaseWorker *worker)
+{
+	if(a->hashid < b->hashid) workerPushPair(worker, a, b);
+}
+
+// Find the pairs for the worker's range of shapes.
+// The indexes are only read from here. They must not have pending changes.
+static void
+workerRun(cpBroadphaseWorker *worker)
+{
+	cpBroadphaseThreads *threads = worker->threads;
+	cpSpace *space = threads->space;
+	cpSpatialIndex *staticShapes = space->staticShapes;
+	cpSpatialIndex *activeShapes = space->activeShapes;
+	cpBool queryStatic = (cpSpatialIndexCount(staticShapes) > 0);
+	
+	cpArray *shapes = threads->shapes;
+	int start = (int)((long long)shapes->num*worker->index/threads->numWorkers);
+	int end = (int)((long long)shapes->num*(worker->index + 1)/threads->numWorkers);
+	
+	worker->numPairs = 0;
+	for(int i=start; i<end; i++){
+		cpShape *shape = (cpShape *)shapes->arr[i];
+		if(queryStatic) cpSpatialIndexQuery(staticShapes, shape, shape->bb, (cpSpatialIndexQueryFunc)workerStaticPair, worker);
+		cpSpatialIndexQuery(activeShapes, shape, shape->bb, (cpSpatialIndexQueryFunc)workerActivePair, worker);
+	}
+}
+
+#ifdef CP_USE_PTHREADS
+static void *
+workerThread(cpBroadphaseWorker *worker)
+{
+	cpBroadphaseThreads *threads = worker->threads;
+	unsigned int generation = 0;
+	
+	pthread_mutex_lock(&threads->mutex);
+	for(;;){
+		while(threads->generation == generation && !threads->quit) pthread_cond_wait(&threads->wake, &threads->mutex);
+		if(threads->quit) break;
+		
+		generation = threads->generation;
+		pthread_mutex_unlock(&threads->mutex);
+		
+		workerRun(worker);
+		
+		pthread_mutex_lock(&threads->mutex);
+		if(--threads->running == 0) pthread_cond_signal(&threads->done);
+	}
+	pthread_mutex_unlock(&threads->mutex);
+	
+	return NULL;
+}
+#endif
+
+static cpBroadphaseThreads *
+cpBroadphaseThreadsNew(cpSpace *space, int count)
+{
+	cpBroadphaseThreads *threads = (cpBroadphaseThreads *)cpcalloc(1, sizeof(cpBroadphaseThreads));
+	threads->space = space;
+	threads->numWorkers = count;
+	threads->workers = (cpBroadphaseWorker *)cpcalloc(count, sizeof(cpBroadphaseWorker));
+	threads->shapes = cpArrayNew(0);
+	
+	for(int i=0; i<count; i++){
+		threads->workers[i].threads = threads;
+		threads->workers[i].index = i;
+	}
+	
+#ifdef CP_USE_PTHREADS
+	pthread_mutex_init(&threads->mutex, NULL);
+	pthread_cond_init(&threads->wake, NULL);
+	pthread_cond_init(&threads->done, NULL);
+	
+	for(int i=1; i<count; i++){
+		cpBroadphaseWorker *worker = &threads->workers[i];
+		pthread_create(&worker->thread, NULL, (void *(*)(void *))workerThread, worker);
+	}
+#endif
+	
+	return threads;
+}
+
+static void
+cpBroadphaseThreadsFree(cpBroadphaseThreads *threads)
+{
+#ifdef CP_USE_PTHREADS
+	pthread_mutex_lock(&threads->mutex);
+	threads->quit = cpTrue;
+	pthread_cond_broadcast(&threads->wake);
+	pthread_mutex_unlock(&threads->mutex);
+	
+	for(int i=1; i<threads->numWorkers; i++) pthread_join(threads->workers[i].thread, NULL);
+	
+	pthread_cond_destroy(&threads->done);
+	pthread_cond_destroy(&threads->wake);
+	pthread_mutex_destroy(&threads->mutex);
+#endif
+	
+	for(int i=0; i<threads->numWorkers; i++) cpfree(threads->workers[i].pairs);
+	cpfree(threads->workers);
+	cpArrayFree(threads->shapes);
+	cpfree(threads);
+}
+
+void
+cpSpaceSetThreads(cpSpace *space, int threads)
+{
+	cpAssert(!space->locked, "The thread count cannot be changed during a call to cpSpaceStep() or during a query.");
+	
+#ifdef CP_USE_PTHREADS
+	threads = (threads > 1 ? threads : 1);
+#else
+	threads = 1;
+#endif
+	
+	if(space->broadphaseThreads){
+		cpBroadphaseThreadsFree(space->broadphaseThreads);
+		space->broadphaseThreads = NULL;
+	}
+	
+	space->threads = threads;
+	if(threads > 1) space->broadphaseThreads = cpBroadphaseThreadsNew(space, threads);
+}
+
+static void pushShape(cpShape *shape, cpArray *shapes){cpArrayPush(shapes, shape);}
+
+// Broadphase using worker threads.
+// Finds the same pairs as the single threaded broadphase. They are collected by the workers
+// and then passed on to the collision detection in worker order, which keeps it deterministic.
+static void
+collideThreaded(cpSpace *space)
+{
+	cpBroadphaseThreads *threads = space->broadphaseThreads;
+	cpSpatialIndex *activeShapes = space->activeShapes;
+	
+	// The workers can only read from the indexes.
+	// Update the active index and link any objects still pending in the static index first.
+	cpSpatialIndexReindex(activeShapes);
+	cpSpatialIndexFlush(space->staticShapes);
+	
+	cpArray *shapes = threads->shapes;
+	shapes->num = 0;
+	cpSpatialIndexEach(activeShapes, (cpSpatialIndexIterator)pushShape, shapes);
+	
+#ifdef CP_USE_PTHREADS
+	pthread_mutex_lock(&threads->mutex);
+	threads->running = threads->numWorkers - 1;
+	threads->generation++;
+	pthread_cond_broadcast(&threads->wake);
+	pthread_mutex_unlock(&threads->mutex);
+#endif
+	
+	workerRun(&threads->workers[0]);
+	
+#ifdef CP_USE_PTHREADS
+	pthread_mutex_lock(&threads->mutex);
+	while(threads->running) pthread_cond_wait(&threads->done, &threads->mutex);
+	pthread_mutex_unlock(&threads->mutex);
+#endif
+	
+	for(int i=0; i<threads->numWorkers; i++){
+		cpBroadphaseWorker *worker = &threads->workers[i];
+		for(int j=0; j<worker->numPairs; j++) queryFunc(worker->pairs[j].a, worker->pairs[j].b, space);
+	}
 }
 
 // Hashset filter func to throw away old arbiters.
@@ -282,12 +951,20 @@ postStepCallbackSetIter(PostStepCallback *callback, cpSpace *space)
 
 void cpSpaceProcessComponents(cpSpace *space, cpFloat dt);
 
-static void updateBBCache(cpShape *shape, void *unused){cpShapeCacheBB(shape);}
+// Shapes whose body hasn't moved since their data was last cached don't need to be transformed again.
+// A shape moved to another body is always recached as generations are only unique per body.
+static void
+updateBBCache(cpShape *shape, void *unused)
+{
+	cpBody *body = shape->body;
+	if(shape->transformBody != body || shape->transformGeneration != cpBodyTransformGeneration(body)) cpShapeCacheBB(shape);
+}
 
 void
 cpSpaceStep(cpSpace *space, cpFloat dt)
 {
 	if(!dt) return; // don't step if the timestep is 0!
+	cpAssert(!space->concurrentQueries, "Cannot step a space during concurrent queries. Call cpSpaceEndConcurrentQueries() first.");
 	cpFloat dt_inv = 1.0f/dt;
 
 	cpArray *bodies = space->bodies;
@@ -303,15 +980,23 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 	}
 	
 	// Pre-cache BBoxes and shape data.
-	cpSpaceHashEach(space->activeShapes, (cpSpaceHashIterator)updateBBCache, NULL);
+	cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)updateBBCache, NULL);
 	
 	cpSpaceLock(space);
 	
 	// Collide!
 	cpSpacePushFreshContactBuffer(space);
-	if(space->staticShapes->handleSet->entries)
-		cpSpaceHashEach(space->activeShapes, (cpSpaceHashIterator)active2staticIter, space);
-	cpSpaceHashQueryRehash(space->activeShapes, (cpSpaceHashQueryFunc)queryFunc, space);
+	if(space->pairCache){
+		collideCachedPairs(space, dt);
+	} else if(space->broadphaseThreads){
+		collideThreaded(space);
+	} else {
+		if(cpSpatialIndexCount(space->staticShapes))
+			cpSpatialIndexEach(space->activeShapes, (cpSpatialIndexIterator)active2staticIter, space);
+		cpSpatialIndexReindexQuery(space->activeShapes, (cpSpatialIndexQueryFunc)queryFunc, space);
+	}
+	
+	if(space->narrowphaseBatch) flushNarrowphaseBatch(space);
 	
 	cpSpaceUnlock(space);
 	
@@ -0,0 +1,343 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chipmunk_private.h"
+
+// Tracks the index of an object's cell in the table.
+typedef struct Slot {
+	void *obj;
+	int index;
+} Slot;
+
+// Each cell holds an object and its cached bbox.
+// The table is kept sorted by the left edge of the bboxes.
+typedef struct TableCell {
+	void *obj;
+	cpBB bb;
+	Slot *slot;
+} TableCell;
+
+struct cpSweep1D {
+	// Spatial index "superclass". Must be the first member.
+	cpSpatialIndex spatialIndex;
+	
+	int num, max;
+	TableCell *table;
+	
+	// Set of the slots, used to look up the cell for an object without scanning the table.
+	cpHashSet *slots;
+	cpArray *pooledSlots;
+	// list of buffers to free on destruction.
+	cpArray *allocatedBuffers;
+};
+
+static inline const cpSpatialIndexClass *Klass(void);
+
+#pragma mark Table Functions
+
+static inline TableCell
+MakeTableCell(cpSweep1D *sweep, void *obj, Slot *slot)
+{
+	TableCell cell = {obj, sweep->spatialIndex.bbfunc(obj), slot};
+	return cell;
+}
+
+// Store a cell at index i and keep its slot up to date.
+static inline void
+SetCell(TableCell *table, int i, TableCell cell)
+{
+	table[i] = cell;
+	cell.slot->index = i;
+}
+
+// Slide the cell at index i down the table until it is sorted again.
+// Returns the new index of the cell.
+static inline int
+SortCellDown(TableCell *table, int i)
+{
+	TableCell cell = table[i];
+	
+	int j = i;
+	for(; j > 0 && table[j - 1].bb.l > cell.bb.l; j--) SetCell(table, j, table[j - 1]);
+	SetCell(table, j, cell);
+	
+	return j;
+}
+
+// Slide the cell at index i up the table until it is sorted again.
+static inline void
+SortCellUp(TableCell *table, int num, int i)
+{
+	TableCell cell = table[i];
+	
+	int j = i;
+	for(; j < num - 1 && table[j + 1].bb.l < cell.bb.l; j++) SetCell(table, j, table[j + 1]);
+	SetCell(table, j, cell);
+}
+
+// Objects only move a little from step to step, so the table is
+// already nearly sorted and an insertion sort runs in almost linear time.
+static void
+SortTable(TableCell *table, int num)
+{
+	for(int i=1; i<num; i++){
+		if(table[i].bb.l < table[i - 1].bb.l) SortCellDown(table, i);
+	}
+}
+
+static int
+FindCell(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	Slot *slot = (Slot *)cpHashSetFind(sweep->slots, hashid, obj);
+	return (slot ? slot->index : -1);
+}
+
+static void
+ResizeTable(cpSweep1D *sweep, int size)
+{
+	sweep->max = size;
+	sweep->table = (TableCell *)cprealloc(sweep->table, size*sizeof(TableCell));
+}
+
+#pragma mark Slot Set Functions
+
+static cpBool slotSetEql(void *obj, Slot *slot){return (obj == slot->obj);}
+
+static void *
+slotSetTrans(void *obj, cpSweep1D *sweep)
+{
+	if(sweep->pooledSlots->num == 0){
+		// slot pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Slot);
+		cpAssert(count, "Buffer size is too small.");
+		
+		Slot *buffer = (Slot *)cpmalloc(CP_BUFFER_BYTES);
+		cpArrayPush(sweep->allocatedBuffers, buffer);
+		
+		for(int i=0; i<count; i++) cpArrayPush(sweep->pooledSlots, buffer + i);
+	}
+	
+	Slot *slot = (Slot *)cpArrayPop(sweep->pooledSlots);
+	slot->obj = obj;
+	slot->index = -1;
+	
+	return slot;
+}
+
+#pragma mark Memory Management Functions
+
+cpSweep1D *
+cpSweep1DAlloc(void)
+{
+	return (cpSweep1D *)cpcalloc(1, sizeof(cpSweep1D));
+}
+
+cpSpatialIndex *
+cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)sweep, Klass(), bbfunc);
+	
+	sweep->num = 0;
+	sweep->max = 0;
+	sweep->table = NULL;
+	ResizeTable(sweep, 32);
+	
+	sweep->slots = cpHashSetNew(0, (cpHashSetEqlFunc)slotSetEql, (cpHashSetTransFunc)slotSetTrans);
+	sweep->pooledSlots = cpArrayNew(0);
+	sweep->allocatedBuffers = cpArrayNew(0);
+	
+	return (cpSpatialIndex *)sweep;
+}
+
+cpSpatialIndex *
+cpSweep1DNew(cpSpatialIndexBBFunc bbfunc)
+{
+	return cpSweep1DInit(cpSweep1DAlloc(), bbfunc);
+}
+
+static void freeWrap(void *ptr, void *unused){cpfree(ptr);}
+
+static void
+cpSweep1DDestroy(cpSweep1D *sweep)
+{
+	cpfree(sweep->table);
+	sweep->table = NULL;
+	
+	cpHashSetFree(sweep->slots);
+	cpArrayFree(sweep->pooledSlots);
+	
+	cpArrayEach(sweep->allocatedBuffers, freeWrap, NULL);
+	cpArrayFree(sweep->allocatedBuffers);
+}
+
+#pragma mark Insert/Remove
+
+static void
+cpSweep1DInsert(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	if(sweep->num == sweep->max) ResizeTable(sweep, sweep->max*2);
+	
+	Slot *slot = (Slot *)cpHashSetInsert(sweep->slots, hashid, obj, sweep);
+	sweep->table[sweep->num] = MakeTableCell(sweep, obj, slot);
+	SortCellDown(sweep->table, sweep->num);
+	sweep->num++;
+}
+
+static void
+cpSweep1DRemove(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	Slot *slot = (Slot *)cpHashSetRemove(sweep->slots, hashid, obj);
+	if(!slot) return;
+	
+	int i = slot->index;
+	cpArrayPush(sweep->pooledSlots, slot);
+	
+	// Shift the rest of the table down to keep it sorted.
+	TableCell *table = sweep->table;
+	int count = --sweep->num;
+	memmove(table + i, table + i + 1, (count - i)*sizeof(TableCell));
+	for(; i<count; i++) table[i].slot->index = i;
+}
+
+static cpBool
+cpSweep1DContains(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(sweep->slots, hashid, obj) != NULL);
+}
+
+static int cpSweep1DCount(cpSweep1D *sweep){return sweep->num;}
+
+static void
+cpSweep1DEach(cpSweep1D *sweep, cpSpatialIndexIterator func, void *data)
+{
+	TableCell *table = sweep->table;
+	for(int i=0, count=sweep->num; i<count; i++) func(table[i].obj, data);
+}
+
+#pragma mark Reindex
+
+static void
+cpSweep1DReindex(cpSweep1D *sweep)
+{
+	TableCell *table = sweep->table;
+	cpSpatialIndexBBFunc bbfunc = sweep->spatialIndex.bbfunc;
+	
+	int count = sweep->num;
+	for(int i=0; i<count; i++) table[i].bb = bbfunc(table[i].obj);
+	
+	SortTable(table, count);
+}
+
+static void
+cpSweep1DReindexObject(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	int i = FindCell(sweep, obj, hashid);
+	if(i < 0) return;
+	
+	sweep->table[i].bb = sweep->spatialIndex.bbfunc(obj);
+	
+	int j = SortCellDown(sweep->table, i);
+	if(j == i) SortCellUp(sweep->table, sweep->num, i);
+}
+
+static void
+cpSweep1DReindexQuery(cpSweep1D *sweep, cpSpatialIndexQueryFunc func, void *data)
+{
+	cpSweep1DReindex(sweep);
+	
+	TableCell *table = sweep->table;
+	int count = sweep->num;
+	
+	// Sweep along the x-axis. Every cell that starts before
+	// cell i ends overlaps it on the x-axis.
+	for(int i=0; i<count; i++){
+		TableCell cell = table[i];
+		
+		for(int j=i+1; j<count && table[j].bb.l <= cell.bb.r; j++){
+			cpBB bb = table[j].bb;
+			if(cell.bb.b <= bb.t && bb.b <= cell.bb.t) func(cell.obj, table[j].obj, data);
+		}
+	}
+}
+
+// Objects are sorted into the table as soon as they are inserted, so there is nothing to flush.
+static void cpSweep1DFlush(cpSweep1D *sweep){}
+
+#pragma mark Query
+
+static void
+cpSweep1DPointQuery(cpSweep1D *sweep, cpVect point, cpSpatialIndexQueryFunc func, void *data)
+{
+	TableCell *table = sweep->table;
+	
+	for(int i=0, count=sweep->num; i<count && table[i].bb.l <= point.x; i++){
+		cpBB bb = table[i].bb;
+		if(point.x <= bb.r && bb.b <= point.y && point.y <= bb.t) func(&point, table[i].obj, data);
+	}
+}
+
+static void
+cpSweep1DQuery(cpSweep1D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	TableCell *table = sweep->table;
+	
+	for(int i=0, count=sweep->num; i<count && table[i].bb.l <= bb.r; i++){
+		TableCell cell = table[i];
+		if(cell.obj != obj && cpBBintersects(bb, cell.bb)) func(obj, cell.obj, data);
+	}
+}
+
+static void
+cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	TableCell *table = sweep->table;
+	cpFloat right = cpfmax(a.x, b.x);
+	
+	for(int i=0, count=sweep->num; i<count && table[i].bb.l <= right; i++){
+		if(cpBBSegmentQuery(table[i].bb, a, b) < t_exit){
+			t_exit = cpfmin(t_exit, func(obj, table[i].obj, data));
+		}
+	}
+}
+
+static const cpSpatialIndexClass klass = {
+	(void (*)(cpSpatialIndex *))cpSweep1DDestroy,
+	
+	(int (*)(cpSpatialIndex *))cpSweep1DCount,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexIterator, void *))cpSweep1DEach,
+	(cpBool (*)(cpSpatialIndex *, void *, cpHashValue))cpSweep1DContains,
+	
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSweep1DInsert,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSweep1DRemove,
+	
+	(void (*)(cpSpatialIndex *))cpSweep1DReindex,
+	(void (*)(cpSpatialIndex *, void *, cpHashValue))cpSweep1DReindexObject,
+	(void (*)(cpSpatialIndex *, cpSpatialIndexQueryFunc, void *))cpSweep1DReindexQuery,
+	(void (*)(cpSpatialIndex *))cpSweep1DFlush,
+	
+	(void (*)(cpSpatialIndex *, cpVect, cpSpatialIndexQueryFunc, void *))cpSweep1DPointQuery,
+	(void (*)(cpSpatialIndex *, void *, cpBB, cpSpatialIndexQueryFunc, void *))cpSweep1DQuery,
+	(void (*)(cpSpatialIndex *, void *, cpVect, cpVect, cpFloat, cpSpatialIndexSegmentQueryFunc, void *))cpSweep1DSegmentQuery,
+};
+static inline const cpSpatialIndexClass *Klass(void){return &klass;}
@@ -0,0 +1,323 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+ 
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "chipmunk_private.h"
+
+cpTileMapShape *
+cpTileMapShapeAlloc(void)
+{
+	return (cpTileMapShape *)cpcalloc(1, sizeof(cpTileMapShape));
+}
+
+static cpBB
+cpTileMapShapeCacheData(cpShape *shape, cpVect p, cpVect rot)
+{
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	map->tOffset = cpvadd(p, cpvrotate(map->offset, rot));
+	map->tRot = rot;
+	
+	cpFloat width = map->width, height = map->height;
+	cpVect v0 = cpTileMapShapeWorldPoint(map, cpv(  0.0f,   0.0f));
+	cpVect v1 = cpTileMapShapeWorldPoint(map, cpv( width,   0.0f));
+	cpVect v2 = cpTileMapShapeWorldPoint(map, cpv( width, height));
+	cpVect v3 = cpTileMapShapeWorldPoint(map, cpv(  0.0f, height));
+	
+	return cpBBNew(
+		cpfmin(cpfmin(v0.x, v1.x), cpfmin(v2.x, v3.x)), cpfmin(cpfmin(v0.y, v1.y), cpfmin(v2.y, v3.y)),
+		cpfmax(cpfmax(v0.x, v1.x), cpfmax(v2.x, v3.x)), cpfmax(cpfmax(v0.y, v1.y), cpfmax(v2.y, v3.y))
+	);
+}
+
+static void
+cpTileMapShapeDestroy(cpShape *shape)
+{
+	cpfree(((cpTileMapShape *)shape)->tiles);
+}
+
+// Find the range of tiles under bb. Returns cpFalse if bb is outside of the map.
+static cpBool
+tileRange(const cpTileMapShape *map, const cpBB bb, int *x0, int *y0, int *x1, int *y1)
+{
+	cpVect v0 = cpTileMapShapeGridPoint(map, cpv(bb.l, bb.b));
+	cpVect v1 = cpTileMapShapeGridPoint(map, cpv(bb.r, bb.b));
+	cpVect v2 = cpTileMapShapeGridPoint(map, cpv(bb.r, bb.t));
+	cpVect v3 = cpTileMapShapeGridPoint(map, cpv(bb.l, bb.t));
+	
+	cpFloat l = cpfmin(cpfmin(v0.x, v1.x), cpfmin(v2.x, v3.x));
+	cpFloat b = cpfmin(cpfmin(v0.y, v1.y), cpfmin(v2.y, v3.y));
+	cpFloat r = cpfmax(cpfmax(v0.x, v1.x), cpfmax(v2.x, v3.x));
+	cpFloat t = cpfmax(cpfmax(v0.y, v1.y), cpfmax(v2.y, v3.y));
+	if(r < 0.0f || t < 0.0f || l > map->width || b > map->height) return cpFalse;
+	
+	// Clamp before converting so huge bboxes don't overflow.
+	(*x0) = (int)cpffloor(cpfmax(l, 0.0f));
+	(*y0) = (int)cpffloor(cpfmax(b, 0.0f));
+	(*x1) = (int)cpffloor(cpfmin(r, map->width - 1));
+	(*y1) = (int)cpffloor(cpfmin(t, map->height - 1));
+	
+	return cpTrue;
+}
+
+void
+cpTileMapShapeQuery(cpTileMapShape *map, cpBB bb, cpTileMapShapeTileFunc func, void *data)
+{
+	int x0, y0, x1, y1;
+	if(!tileRange(map, bb, &x0, &y0, &x1, &y1)) return;
+	
+	for(int y=y0; y<=y1; y++){
+		const unsigned char *row = map->tiles + y*map->width;
+		for(int x=x0; x<=x1; x++){
+			if(row[x]) func(map, x, y, data);
+		}
+	}
+}
+
+static cpBool
+cpTileMapShapePointQuery(cpShape *shape, cpVect p){
+	if(!cpBBcontainsVect(shape->bb, p)) return cpFalse;
+	
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	cpVect v = cpTileMapShapeGridPoint(map, p);
+	return (v.x >= 0.0f && v.y >= 0.0f && cpTileMapShapeIsSolid(map, (int)v.x, (int)v.y));
+}
+
+// Clip the segment o + d*t to the slab [0, max] along one axis.
+// n is set to the normal of the side it enters through if that moves t0.
+static inline cpBool
+clipSlab(const cpFloat o, const cpFloat d, const cpFloat max, cpFloat *t0, cpFloat *t1, cpFloat *n)
+{
+	if(d == 0.0f) return (0.0f <= o && o <= max);
+	
+	cpFloat ta = (0.0f - o)/d;
+	cpFloat tb = (max - o)/d;
+	cpFloat tin = cpfmin(ta, tb);
+	if(tin > *t0){
+		(*t0) = tin;
+		(*n) = (d > 0.0f ? -1.0f : 1.0f);
+	}
+	
+	(*t1) = cpfmin(*t1, cpfmax(ta, tb));
+	return (*t0 <= *t1);
+}
+
+static inline int clampTile(const cpFloat v, const int count){return (int)cpffloor(cpfclamp(v, 0.0f, count - 1));}
+
+// Walk the tiles under the segment in order and stop at the first solid one.
+// Solid tiles around the start of the segment are skipped, like shapes that contain it are.
+static void
+cpTileMapShapeSegmentQuery(cpShape *shape, cpVect a, cpVect b, cpSegmentQueryInfo *info)
+{
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	int width = map->width, height = map->height;
+	
+	cpVect ga = cpTileMapShapeGridPoint(map, a);
+	cpVect d = cpvsub(cpTileMapShapeGridPoint(map, b), ga);
+	
+	cpFloat t = 0.0f, t1 = 1.0f;
+	cpVect n = cpvzero;
+	if(!clipSlab(ga.x, d.x, width, &t, &t1, &n.x)) return;
+	cpFloat tx = t;
+	if(!clipSlab(ga.y, d.y, height, &t, &t1, &n.y)) return;
+	if(t > tx) n.x = 0.0f;
+	
+	cpVect p = cpvadd(ga, cpvmult(d, t));
+	int x = clampTile(p.x, width);
+	int y = clampTile(p.y, height);
+	
+	int stepX = (d.x > 0.0f ? 1 : -1);
+	int stepY = (d.y > 0.0f ? 1 : -1);
+	cpFloat tDeltaX = (d.x ? cpfabs(1.0f/d.x) : INFINITY);
+	cpFloat tDeltaY = (d.y ? cpfabs(1.0f/d.y) : INFINITY);
+	cpFloat tMaxX = (d.x ? (x + (d.x > 0.0f) - ga.x)/d.x : INFINITY);
+	cpFloat tMaxY = (d.y ? (y + (d.y > 0.0f) - ga.y)/d.y : INFINITY);
+	
+	cpBool skip = (t == 0.0f);
+	for(;;){
+		if(map->tiles[x + y*width]){
+			if(!skip){
+				info->shape = shape;
+				info->t = t;
+				info->n = cpvrotate(n, map->tRot);
+				return;
+			}
+		} else {
+			skip = cpFalse;
+		}
+		
+		if(tMaxX < tMaxY){
+			t = tMaxX;
+			tMaxX += tDeltaX;
+			x += stepX;
+			n = cpv(-stepX, 0.0f);
+			if(x < 0 || width <= x) return;
+		} else {
+			t = tMaxY;
+			tMaxY += tDeltaY;
+			y += stepY;
+			n = cpv(0.0f, -stepY);
+			if(y < 0 || height <= y) return;
+		}
+		
+		if(t > t1) return;
+	}
+}
+
+// Closest point to p on tile (x, y) in grid space.
+static inline cpVect
+tileClosestPoint(const cpVect p, const int x, const int y)
+{
+	return cpv(cpfclamp(p.x, x, x + 1), cpfclamp(p.y, y, y + 1));
+}
+
+// Search the tiles a ring at a time around p for the closest one that differs from the tile p is in.
+// The tiles of ring k are at least k - 1 tiles away from p, so the search stops once that passes the best distance.
+static void
+cpTileMapShapeNearestPointQuery(cpShape *shape, cpVect p, cpNearestPointQueryInfo *info)
+{
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	int width = map->width, height = map->height;
+	
+	cpVect g = cpTileMapShapeGridPoint(map, p);
+	int cx = clampTile(g.x, width);
+	int cy = clampTile(g.y, height);
+	cpBool inside = (0.0f <= g.x && g.x < width && 0.0f <= g.y && g.y < height && map->tiles[cx + cy*width]);
+	
+	cpFloat min = INFINITY;
+	cpVect closest = g;
+	
+	// Inside of the map, the outside of the map counts as empty too.
+	if(inside){
+		cpFloat dists[] = {g.x, width - g.x, g.y, height - g.y};
+		cpVect points[] = {cpv(0.0f, g.y), cpv(width, g.y), cpv(g.x, 0.0f), cpv(g.x, height)};
+		for(int i=0; i<4; i++){
+			if(dists[i] < min){
+				min = dists[i];
+				closest = points[i];
+			}
+		}
+	}
+	
+	int rings = (width > height ? width : height);
+	for(int k=0; k<=rings && k - 1 < min; k++){
+		for(int y=cy - k; y<=cy + k; y++){
+			if(y < 0 || height <= y) continue;
+			
+			// The first and last rows of the ring are full, the others only have their ends.
+			int step = (y == cy - k || y == cy + k ? 1 : 2*k);
+			for(int x=cx - k; x<=cx + k; x+=step){
+				if(x < 0 || width <= x || (cpBool)(map->tiles[x + y*width] != 0) == inside) continue;
+				
+				cpVect v = tileClosestPoint(g, x, y);
+				cpFloat dist = cpvdist(g, v);
+				if(dist < min){
+					min = dist;
+					closest = v;
+				}
+			}
+		}
+	}
+	
+	// Leave the info alone if there are no solid tiles.
+	if(min == INFINITY) return;
+	
+	info->shape = shape;
+	info->p = cpTileMapShapeWorldPoint(map, closest);
+	info->d = (inside ? -min : min)*map->cellSize;
+}
+
+static const cpShapeClass tileMapClass = {
+	CP_TILE_MAP_SHAPE,
+	cpTileMapShapeCacheData,
+	cpTileMapShapeDestroy,
+	cpTileMapShapePointQuery,
+	cpTileMapShapeSegmentQuery,
+	cpTileMapShapeNearestPointQuery,
+};
+
+int
+cpTileMapShapeGetWidth(cpShape *shape)
+{
+	cpAssert(shape->klass == &tileMapClass, "Shape is not a tile map shape.");
+	return ((cpTileMapShape *)shape)->width;
+}
+
+int
+cpTileMapShapeGetHeight(cpShape *shape)
+{
+	cpAssert(shape->klass == &tileMapClass, "Shape is not a tile map shape.");
+	return ((cpTileMapShape *)shape)->height;
+}
+
+cpFloat
+cpTileMapShapeGetCellSize(cpShape *shape)
+{
+	cpAssert(shape->klass == &tileMapClass, "Shape is not a tile map shape.");
+	return ((cpTileMapShape *)shape)->cellSize;
+}
+
+unsigned char
+cpTileMapShapeGetTile(cpShape *shape, int x, int y)
+{
+	cpAssert(shape->klass == &tileMapClass, "Shape is not a tile map shape.");
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	cpAssert(0 <= x && x < map->width && 0 <= y && y < map->height, "Tile out of range.");
+	
+	return map->tiles[x + y*map->width];
+}
+
+void
+cpTileMapShapeSetTile(cpShape *shape, int x, int y, unsigned char tile)
+{
+	cpAssert(shape->klass == &tileMapClass, "Shape is not a tile map shape.");
+	cpTileMapShape *map = (cpTileMapShape *)shape;
+	cpAssert(0 <= x && x < map->width && 0 <= y && y < map->height, "Tile out of range.");
+	
+	map->tiles[x + y*map->width] = tile;
+}
+
+cpTileMapShape *
+cpTileMapShapeInit(cpTileMapShape *map, cpBody *body, int width, int height, const unsigned char *tiles, cpFloat cellSize, cpVect offset)
+{
+	cpAssert(width > 0 && height > 0, "A tile map needs at least one tile.");
+	cpAssert(cellSize > 0.0f, "A tile map's cell size must be positive.");
+	
+	map->width = width;
+	map->height = height;
+	map->cellSize = cellSize;
+	map->offset = offset;
+	
+	map->tiles = (unsigned char *)cpcalloc(width*height, sizeof(unsigned char));
+	if(tiles) memcpy(map->tiles, tiles, width*height*sizeof(unsigned char));
+	
+	cpShapeInit((cpShape *)map, &tileMapClass, body);
+	
+	return map;
+}
+
+cpShape *
+cpTileMapShapeNew(cpBody *body, int width, int height, const unsigned char *tiles, cpFloat cellSize, cpVect offset)
+{
+	return (cpShape *)cpTileMapShapeInit(cpTileMapShapeAlloc(), body, width, height, tiles, cellSize, offset);
+}